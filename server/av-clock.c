@@ -0,0 +1,84 @@
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "av-clock.h"
+
+void av_clock_init(AVClock *clock, uint32_t initial_latency)
+{
+    clock->latency = initial_latency;
+    clock->has_report = false;
+    clock->required_latency = 0;
+    clock->jitter = 0;
+    clock->last_decrease = 0;
+}
+
+bool av_clock_add_required_latency(AVClock *clock, uint32_t latency, red_time_t now)
+{
+    int64_t err;
+    uint32_t target;
+    uint64_t max_decrease;
+
+    /* same smoothing as the TCP roundtrip estimation (RFC 6298) */
+    if (!clock->has_report) {
+        clock->has_report = true;
+        clock->required_latency = (int64_t) latency << 3;
+        clock->jitter = 0;
+        clock->last_decrease = now;
+    } else {
+        clock->required_latency += (((int64_t) latency << 3) - clock->required_latency) / 8;
+        err = (int64_t) latency - (clock->required_latency >> 3);
+        if (err < 0) {
+            err = -err;
+        }
+        clock->jitter += ((err << 2) - clock->jitter) / 4;
+    }
+
+    target = (clock->required_latency >> 3) + 2 * (clock->jitter >> 2);
+    /* the last report must be satisfied in any case */
+    target = MAX(target, latency);
+
+    if (target > clock->latency) {
+        clock->latency = target;
+        clock->last_decrease = now;
+        return true;
+    }
+
+    max_decrease = (now - clock->last_decrease) / NSEC_PER_MILLISEC *
+                   AV_CLOCK_MAX_DECREASE_PER_SEC / MSEC_PER_SEC;
+    if (max_decrease < clock->latency) {
+        target = MAX(target, clock->latency - max_decrease);
+    }
+    if (clock->latency - target < AV_CLOCK_MIN_DECREASE) {
+        return false;
+    }
+    clock->latency = target;
+    clock->last_decrease = now;
+    return true;
+}
+
+uint32_t av_clock_get_latency(AVClock *clock)
+{
+    return clock->latency;
+}
+
+uint32_t av_clock_get_jitter(AVClock *clock)
+{
+    return clock->jitter >> 2;
+}
@@ -0,0 +1,56 @@
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AV_CLOCK_H_
+#define AV_CLOCK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/* how fast the latency is lowered once the clients need less */
+#define AV_CLOCK_MAX_DECREASE_PER_SEC 20 /* ms */
+/* latency decreases smaller than this are not worth telling the clients */
+#define AV_CLOCK_MIN_DECREASE 5 /* ms */
+
+/*
+ * Computes the latency of the multimedia time sent to the clients, which
+ * is the delay they apply before playing audio and video.
+ * The latency required by the clients, from their stream and playback
+ * reports, is smoothed and its variation (jitter) is tracked. The latency
+ * is the smoothed requirement plus a margin of twice the jitter. It is
+ * raised immediately when needed, to avoid underruns, but lowered slowly,
+ * so that a single report does not make playback jump.
+ * All the functions are called from the main thread.
+ */
+typedef struct AVClock {
+    uint32_t latency; /* ms */
+    bool has_report;
+    int64_t required_latency; /* smoothed, ms << 3 */
+    int64_t jitter; /* mean deviation, ms << 2 */
+    red_time_t last_decrease;
+} AVClock;
+
+void av_clock_init(AVClock *clock, uint32_t initial_latency);
+
+/* returns true if the latency changed and should be sent to the clients */
+bool av_clock_add_required_latency(AVClock *clock, uint32_t latency, red_time_t now);
+
+uint32_t av_clock_get_latency(AVClock *clock);
+uint32_t av_clock_get_jitter(AVClock *clock);
+
+#endif /* AV_CLOCK_H_ */
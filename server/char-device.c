@@ -26,6 +26,7 @@
 #include "red-client.h"
 #include "reds.h"
 #include "glib-compat.h"
+#include "timer-wheel.h"
 
 #define CHAR_DEVICE_WRITE_TO_TIMEOUT 100
 #define RED_CHAR_DEVICE_WAIT_TOKENS_TIMEOUT 30000
@@ -54,7 +55,7 @@ struct RedCharDeviceClient {
     uint64_t num_client_tokens;
     uint64_t num_client_tokens_free; /* client messages that were consumed by the device */
     uint64_t num_send_tokens; /* send to client */
-    SpiceTimer *wait_for_tokens_timer;
+    RedTimer *wait_for_tokens_timer;
     int wait_for_tokens_started;
     GQueue *send_queue;
     uint32_t max_send_queue_size;
@@ -70,7 +71,7 @@ struct RedCharDevicePrivate {
     uint64_t cur_pool_size;
     RedCharDeviceWriteBuffer *cur_write_buf;
     uint8_t *cur_write_buf_pos;
-    SpiceTimer *write_to_dev_timer;
+    RedTimer *write_to_dev_timer;
     uint64_t num_self_tokens;
 
     GList *clients; /* list of RedCharDeviceClient */
@@ -183,7 +184,7 @@ static void red_char_device_client_free(RedCharDevice *dev,
 {
     GList *l, *next;
 
-    reds_core_timer_remove(dev->priv->reds, dev_client->wait_for_tokens_timer);
+    red_timer_free(dev_client->wait_for_tokens_timer);
     dev_client->wait_for_tokens_timer = NULL;
 
     g_queue_free_full(dev_client->send_queue, (GDestroyNotify)red_pipe_item_unref);
@@ -284,8 +285,8 @@ static void red_char_device_add_msg_to_client_queue(RedCharDeviceClient *dev_cli
     red_pipe_item_ref(msg);
     g_queue_push_head(dev_client->send_queue, msg);
     if (!dev_client->wait_for_tokens_started) {
-        reds_core_timer_start(dev->priv->reds, dev_client->wait_for_tokens_timer,
-                              RED_CHAR_DEVICE_WAIT_TOKENS_TIMEOUT);
+        red_timer_start(dev_client->wait_for_tokens_timer,
+                        RED_CHAR_DEVICE_WAIT_TOKENS_TIMEOUT);
         dev_client->wait_for_tokens_started = TRUE;
     }
 }
@@ -388,12 +389,12 @@ static void red_char_device_send_to_client_tokens_absorb(RedCharDeviceClient *de
     }
 
     if (red_char_device_can_send_to_client(dev_client)) {
-        reds_core_timer_cancel(dev->priv->reds, dev_client->wait_for_tokens_timer);
+        red_timer_cancel(dev_client->wait_for_tokens_timer);
         dev_client->wait_for_tokens_started = FALSE;
         red_char_device_read_from_device(dev_client->dev);
     } else if (!g_queue_is_empty(dev_client->send_queue)) {
-        reds_core_timer_start(dev->priv->reds, dev_client->wait_for_tokens_timer,
-                              RED_CHAR_DEVICE_WAIT_TOKENS_TIMEOUT);
+        red_timer_start(dev_client->wait_for_tokens_timer,
+                        RED_CHAR_DEVICE_WAIT_TOKENS_TIMEOUT);
         dev_client->wait_for_tokens_started = TRUE;
     }
 }
@@ -472,7 +473,7 @@ static int red_char_device_write_to_device(RedCharDevice *dev)
     g_object_ref(dev);
 
     if (dev->priv->write_to_dev_timer) {
-        reds_core_timer_cancel(dev->priv->reds, dev->priv->write_to_dev_timer);
+        red_timer_cancel(dev->priv->write_to_dev_timer);
     }
 
     sif = spice_char_device_get_interface(dev->priv->sin);
@@ -509,8 +510,8 @@ static int red_char_device_write_to_device(RedCharDevice *dev)
     if (dev->priv->running) {
         if (dev->priv->cur_write_buf) {
             if (dev->priv->write_to_dev_timer) {
-                reds_core_timer_start(dev->priv->reds, dev->priv->write_to_dev_timer,
-                                      CHAR_DEVICE_WRITE_TO_TIMEOUT);
+                red_timer_start(dev->priv->write_to_dev_timer,
+                                CHAR_DEVICE_WRITE_TO_TIMEOUT);
             }
         } else {
             spice_assert(g_queue_is_empty(&dev->priv->write_queue));
@@ -527,11 +528,30 @@ static void red_char_device_write_retry(void *opaque)
     RedCharDevice *dev = opaque;
 
     if (dev->priv->write_to_dev_timer) {
-        reds_core_timer_cancel(dev->priv->reds, dev->priv->write_to_dev_timer);
+        red_timer_cancel(dev->priv->write_to_dev_timer);
     }
     red_char_device_write_to_device(dev);
 }
 
+static RedCharDeviceWriteBuffer *red_char_device_write_buffer_pool_get(RedCharDevice *dev,
+                                                                       int size)
+{
+    GList *l;
+
+    /* Released buffers are pushed at the head, so the most recently used
+     * ones are tried first. A buffer which is already big enough is
+     * preferred to avoid reallocating. */
+    for (l = dev->priv->write_bufs_pool.head; l != NULL; l = l->next) {
+        RedCharDeviceWriteBuffer *buf = l->data;
+
+        if (buf->buf_size >= size) {
+            g_queue_delete_link(&dev->priv->write_bufs_pool, l);
+            return buf;
+        }
+    }
+    return g_queue_pop_head(&dev->priv->write_bufs_pool);
+}
+
 static RedCharDeviceWriteBuffer *__red_char_device_write_buffer_get(
     RedCharDevice *dev, RedClient *client,
     int size, WriteBufferOrigin origin, int migrated_data_tokens)
@@ -542,7 +562,7 @@ static RedCharDeviceWriteBuffer *__red_char_device_write_buffer_get(
         return NULL;
     }
 
-    ret = g_queue_pop_tail(&dev->priv->write_bufs_pool);
+    ret = red_char_device_write_buffer_pool_get(dev, size);
     if (ret) {
         dev->priv->cur_pool_size -= ret->buf_size;
     } else {
@@ -558,7 +578,9 @@ static RedCharDeviceWriteBuffer *__red_char_device_write_buffer_get(
     spice_assert(!ret->buf_used);
 
     if (ret->buf_size < size) {
-        ret->buf = spice_realloc(ret->buf, size);
+        /* the old content is not needed, don't let realloc copy it */
+        free(ret->buf);
+        ret->buf = spice_malloc(size);
         ret->buf_size = size;
     }
     ret->priv->origin = origin;
@@ -718,11 +740,8 @@ static RedCharDeviceClient *red_char_device_client_new(RedClient *client,
         RedsState *reds = red_client_get_server(client);
 
         dev_client->wait_for_tokens_timer =
-            reds_core_timer_add(reds, device_client_wait_for_tokens_timeout,
-                                dev_client);
-        if (!dev_client->wait_for_tokens_timer) {
-            spice_error("failed to create wait for tokens timer");
-        }
+            red_timer_new(reds_get_core_interface(reds)->timer_wheel,
+                          device_client_wait_for_tokens_timeout, dev_client);
         dev_client->num_client_tokens = num_client_tokens;
         dev_client->num_send_tokens = num_send_tokens;
     } else {
@@ -814,7 +833,7 @@ void red_char_device_stop(RedCharDevice *dev)
     dev->priv->running = FALSE;
     dev->priv->active = FALSE;
     if (dev->priv->write_to_dev_timer) {
-        reds_core_timer_cancel(dev->priv->reds, dev->priv->write_to_dev_timer);
+        red_timer_cancel(dev->priv->write_to_dev_timer);
     }
 }
 
@@ -955,9 +974,17 @@ bool red_char_device_restore(RedCharDevice *dev,
     client_tokens_window = dev_client->num_client_tokens; /* initial state of tokens */
     dev_client->num_client_tokens = mig_data->num_client_tokens;
     /* assumption: client_tokens_window stays the same across severs */
-    dev_client->num_client_tokens_free = client_tokens_window -
-                                           mig_data->num_client_tokens -
-                                           mig_data->write_num_client_tokens;
+    if ((uint64_t)mig_data->num_client_tokens + mig_data->write_num_client_tokens >
+        client_tokens_window) {
+        spice_warning("dev %p: client tokens %u+%u exceed the window %u of this server",
+                      dev, mig_data->num_client_tokens, mig_data->write_num_client_tokens,
+                      client_tokens_window);
+        dev_client->num_client_tokens_free = 0;
+    } else {
+        dev_client->num_client_tokens_free = client_tokens_window -
+                                               mig_data->num_client_tokens -
+                                               mig_data->write_num_client_tokens;
+    }
     dev_client->num_send_tokens = mig_data->num_send_tokens;
 
     if (mig_data->write_size > 0) {
@@ -994,6 +1021,21 @@ SpiceCharDeviceInterface *spice_char_device_get_interface(SpiceCharDeviceInstanc
    return SPICE_UPCAST(SpiceCharDeviceInterface, instance->base.sif);
 }
 
+int red_char_device_read_batch(SpiceCharDeviceInstance *sin, uint8_t *buf, int len)
+{
+    SpiceCharDeviceInterface *sif = spice_char_device_get_interface(sin);
+    int total = 0;
+
+    while (total < len) {
+        int n = sif->read(sin, buf + total, len - total);
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    return total;
+}
+
 
 static void red_char_device_init_device_instance(RedCharDevice *self)
 {
@@ -1001,7 +1043,7 @@ static void red_char_device_init_device_instance(RedCharDevice *self)
 
     g_return_if_fail(self->priv->reds);
 
-    reds_core_timer_remove(self->priv->reds, self->priv->write_to_dev_timer);
+    red_timer_free(self->priv->write_to_dev_timer);
     self->priv->write_to_dev_timer = NULL;
 
     if (self->priv->sin == NULL) {
@@ -1011,12 +1053,9 @@ static void red_char_device_init_device_instance(RedCharDevice *self)
     sif = spice_char_device_get_interface(self->priv->sin);
     if (sif->base.minor_version <= 2 ||
         !(sif->flags & SPICE_CHAR_DEVICE_NOTIFY_WRITABLE)) {
-        self->priv->write_to_dev_timer = reds_core_timer_add(self->priv->reds,
-                                                             red_char_device_write_retry,
-                                                             self);
-        if (!self->priv->write_to_dev_timer) {
-            spice_error("failed creating char dev write timer");
-        }
+        self->priv->write_to_dev_timer =
+            red_timer_new(reds_get_core_interface(self->priv->reds)->timer_wheel,
+                          red_char_device_write_retry, self);
     }
 
     self->priv->sin->st = self;
@@ -1091,7 +1130,7 @@ red_char_device_finalize(GObject *object)
 {
     RedCharDevice *self = RED_CHAR_DEVICE(object);
 
-    reds_core_timer_remove(self->priv->reds, self->priv->write_to_dev_timer);
+    red_timer_free(self->priv->write_to_dev_timer);
     self->priv->write_to_dev_timer = NULL;
 
     write_buffers_queue_free(&self->priv->write_queue);
@@ -236,4 +236,10 @@ void spicevmc_device_disconnect(RedsState *reds,
 
 SpiceCharDeviceInterface *spice_char_device_get_interface(SpiceCharDeviceInstance *instance);
 
+/* Reads as much data as the device has immediately available, up to len
+ * bytes, and returns the number of bytes read. Devices usually give small
+ * chunks on each read, gathering them allows to send a single message to
+ * the client instead of one per chunk. */
+int red_char_device_read_batch(SpiceCharDeviceInstance *sin, uint8_t *buf, int len);
+
 #endif /* CHAR_DEVICE_H_ */
@@ -19,6 +19,8 @@
 #include <config.h>
 #endif
 
+#include <stdlib.h>
+#include <glib.h>
 #include <common/generated_server_marshallers.h>
 
 #include "common-graphics-channel.h"
@@ -27,7 +29,9 @@
 #include "cursor-channel.h"
 #include "cursor-channel-client.h"
 
-#define CLIENT_CURSOR_CACHE_SIZE 256
+/* the default size of the shapes the client caches, in KiB, can be set
+ * with SPICE_CURSOR_CACHE_SIZE: 128 hi-DPI shapes of 64 KiB */
+#define CLIENT_CURSOR_CACHE_SIZE (8 * 1024)
 
 #define CURSOR_CACHE_HASH_SHIFT 8
 #define CURSOR_CACHE_HASH_SIZE (1 << CURSOR_CACHE_HASH_SHIFT)
@@ -46,8 +50,27 @@ struct CursorChannelClientPrivate
     Ring cursor_cache_lru;
     long cursor_cache_available;
     uint32_t cursor_cache_items;
+    long cursor_cache_size;
+    RedPipeItem *queued_move;
 };
 
+/* returns the size of the cursor cache in bytes */
+static long cursor_cache_get_size(void)
+{
+    const char *env_size_str = getenv("SPICE_CURSOR_CACHE_SIZE");
+
+    if (env_size_str != NULL) {
+        char *end;
+        long env_size = strtol(env_size_str, &end, 10);
+
+        if (*end == '\0' && env_size > 0 && env_size <= G_MAXLONG / 1024) {
+            return env_size * 1024;
+        }
+        spice_warning("invalid SPICE_CURSOR_CACHE_SIZE: %s", env_size_str);
+    }
+    return CLIENT_CURSOR_CACHE_SIZE * 1024L;
+}
+
 static void
 cursor_channel_client_class_init(CursorChannelClientClass *klass)
 {
@@ -59,7 +82,8 @@ cursor_channel_client_init(CursorChannelClient *self)
 {
     self->priv = CURSOR_CHANNEL_CLIENT_PRIVATE(self);
     ring_init(&self->priv->cursor_cache_lru);
-    self->priv->cursor_cache_available = CLIENT_CURSOR_CACHE_SIZE;
+    self->priv->cursor_cache_size = cursor_cache_get_size();
+    self->priv->cursor_cache_available = self->priv->cursor_cache_size;
 }
 
 #define CLIENT_CURSOR_CACHE
@@ -72,7 +96,9 @@ static int _cursor_count = 0;
 
 void cursor_channel_client_reset_cursor_cache(RedChannelClient *rcc)
 {
-    red_cursor_cache_reset(CURSOR_CHANNEL_CLIENT(rcc), CLIENT_CURSOR_CACHE_SIZE);
+    CursorChannelClient *ccc = CURSOR_CHANNEL_CLIENT(rcc);
+
+    red_cursor_cache_reset(ccc, ccc->priv->cursor_cache_size);
 }
 
 void cursor_channel_client_on_disconnect(RedChannelClient *rcc)
@@ -118,3 +144,13 @@ int cursor_channel_client_cache_add(CursorChannelClient *ccc, uint64_t id, size_
 {
     return red_cursor_cache_add(ccc, id, size);
 }
+
+RedPipeItem* cursor_channel_client_get_queued_move(CursorChannelClient *ccc)
+{
+    return ccc->priv->queued_move;
+}
+
+void cursor_channel_client_set_queued_move(CursorChannelClient *ccc, RedPipeItem *item)
+{
+    ccc->priv->queued_move = item;
+}
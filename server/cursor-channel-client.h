@@ -69,6 +69,9 @@ void cursor_channel_client_reset_cursor_cache(RedChannelClient *rcc);
 void cursor_channel_client_on_disconnect(RedChannelClient *rcc);
 RedCacheItem* cursor_channel_client_cache_find(CursorChannelClient *ccc, uint64_t id);
 int cursor_channel_client_cache_add(CursorChannelClient *ccc, uint64_t id, size_t size);
+/* the cursor move waiting in the pipe, which the next moves update */
+RedPipeItem* cursor_channel_client_get_queued_move(CursorChannelClient *ccc);
+void cursor_channel_client_set_queued_move(CursorChannelClient *ccc, RedPipeItem *item);
 
 enum {
     RED_PIPE_ITEM_TYPE_CURSOR = RED_PIPE_ITEM_TYPE_COMMON_LAST,
@@ -32,6 +32,7 @@ typedef struct CursorItem {
     QXLInstance *qxl;
     int refs;
     RedCursorCmd *red_cursor;
+    uint64_t shape_id; /* the id of the shape in the clients caches, 0 if not cached */
 } CursorItem;
 
 G_STATIC_ASSERT(sizeof(CursorItem) <= QXL_CURSUR_DEVICE_DATA_SIZE);
@@ -55,6 +56,7 @@ struct CursorChannelClass
 
 typedef struct RedCursorPipeItem {
     RedPipeItem base;
+    CursorChannelClient *ccc;
     CursorItem *cursor_item;
 } RedCursorPipeItem;
 
@@ -62,6 +64,30 @@ G_DEFINE_TYPE(CursorChannel, cursor_channel, TYPE_COMMON_GRAPHICS_CHANNEL)
 
 static void cursor_pipe_item_free(RedPipeItem *pipe_item);
 
+/* Guests give a new unique id to shapes they already sent, animated
+ * cursors are sent again for each frame, so the shapes are cached by
+ * their content (FNV-1a) */
+static uint64_t cursor_shape_hash(const SpiceCursor *shape)
+{
+    const SpiceCursorHeader *header = &shape->header;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t props[5] = { header->type, header->width, header->height,
+                          header->hot_spot_x, header->hot_spot_y };
+    const uint8_t *data;
+    uint32_t i;
+
+    data = (const uint8_t *)props;
+    for (i = 0; i < sizeof(props); i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    for (i = 0; i < shape->data_size; i++) {
+        hash = (hash ^ shape->data[i]) * 0x100000001b3ULL;
+    }
+
+    /* 0 means not cached */
+    return hash ? hash : 1;
+}
+
 static CursorItem *cursor_item_new(QXLInstance *qxl, RedCursorCmd *cmd)
 {
     CursorItem *cursor_item;
@@ -72,6 +98,9 @@ static CursorItem *cursor_item_new(QXLInstance *qxl, RedCursorCmd *cmd)
     cursor_item->qxl = qxl;
     cursor_item->refs = 1;
     cursor_item->red_cursor = cmd;
+    if (cmd->type == QXL_CURSOR_SET && cmd->u.set.shape.header.unique) {
+        cursor_item->shape_id = cursor_shape_hash(&cmd->u.set.shape);
+    }
 
     return cursor_item;
 }
@@ -114,12 +143,32 @@ static void cursor_channel_set_item(CursorChannel *cursor, CursorItem *item)
 
 static RedPipeItem *new_cursor_pipe_item(RedChannelClient *rcc, void *data, int num)
 {
-    RedCursorPipeItem *item = spice_malloc0(sizeof(RedCursorPipeItem));
+    CursorChannelClient *ccc = CURSOR_CHANNEL_CLIENT(rcc);
+    CursorItem *cursor_item = data;
+    bool is_move = cursor_item->red_cursor->type == QXL_CURSOR_MOVE;
+    RedPipeItem *queued_move = cursor_channel_client_get_queued_move(ccc);
+    RedCursorPipeItem *item;
+
+    /* a move the client did not get yet is only updated, the client needs
+     * the latest position, not all the ones in between. This is only done
+     * while it is the last item of the pipe: the items queued after it,
+     * whatever the way (init, invalidations, migration...), must stay
+     * after the new position */
+    if (is_move && queued_move &&
+        g_queue_peek_head(red_channel_client_get_pipe(rcc)) == queued_move) {
+        item = SPICE_UPCAST(RedCursorPipeItem, queued_move);
+        cursor_item_unref(item->cursor_item);
+        item->cursor_item = cursor_item_ref(cursor_item);
+        return NULL;
+    }
 
+    item = spice_malloc0(sizeof(RedCursorPipeItem));
     red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_CURSOR,
                             cursor_pipe_item_free);
-    item->cursor_item = data;
-    item->cursor_item->refs++;
+    item->ccc = ccc;
+    item->cursor_item = cursor_item_ref(cursor_item);
+    /* the moves following another command go after it */
+    cursor_channel_client_set_queued_move(ccc, is_move ? &item->base : NULL);
     return &item->base;
 }
 
@@ -142,12 +191,14 @@ static void cursor_fill(CursorChannelClient *ccc, CursorItem *cursor,
     cursor_cmd = cursor->red_cursor;
     *red_cursor = cursor_cmd->u.set.shape;
 
-    if (red_cursor->header.unique) {
-        if (cursor_channel_client_cache_find(ccc, red_cursor->header.unique)) {
+    if (cursor->shape_id) {
+        red_cursor->header.unique = cursor->shape_id;
+        if (cursor_channel_client_cache_find(ccc, cursor->shape_id)) {
             red_cursor->flags |= SPICE_CURSOR_FLAGS_FROM_CACHE;
             return;
         }
-        if (cursor_channel_client_cache_add(ccc, red_cursor->header.unique, 1)) {
+        if (cursor_channel_client_cache_add(ccc, cursor->shape_id,
+                                            MAX(red_cursor->data_size, 1))) {
             red_cursor->flags |= SPICE_CURSOR_FLAGS_CACHE_ME;
         }
     }
@@ -177,6 +228,9 @@ static void cursor_pipe_item_free(RedPipeItem *base)
 
     RedCursorPipeItem *pipe_item = SPICE_UPCAST(RedCursorPipeItem, base);
 
+    if (cursor_channel_client_get_queued_move(pipe_item->ccc) == base) {
+        cursor_channel_client_set_queued_move(pipe_item->ccc, NULL);
+    }
     cursor_item_unref(pipe_item->cursor_item);
     free(pipe_item);
 }
@@ -217,6 +271,11 @@ static void cursor_marshall(CursorChannelClient *ccc,
     case QXL_CURSOR_MOVE:
         {
             SpiceMsgCursorMove cursor_move;
+
+            /* the next moves go to a new item */
+            if (cursor_channel_client_get_queued_move(ccc) == &cursor_pipe_item->base) {
+                cursor_channel_client_set_queued_move(ccc, NULL);
+            }
             red_channel_client_init_send_data(rcc, SPICE_MSG_CURSOR_MOVE);
             cursor_move.position = cmd->u.position;
             spice_marshall_msg_cursor_move(m, &cursor_move);
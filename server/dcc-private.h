@@ -23,6 +23,7 @@
 #include "dcc.h"
 #include "image-encoders.h"
 #include "stream.h"
+#include "gl-stream.h"
 #include "red-channel-client.h"
 
 typedef struct DisplayChannelClientPrivate DisplayChannelClientPrivate;
@@ -64,7 +65,12 @@ struct DisplayChannelClientPrivate
     StreamAgent stream_agents[NUM_STREAMS];
     uint32_t streams_max_latency;
     uint64_t streams_max_bit_rate;
+    /* the frames of the video streams are sent raw, see dcc_new() */
+    bool raw_frames;
     bool gl_draw_ongoing;
+
+    /* the GL scanout streamed to a client which cannot import it */
+    RedGlStream gl_stream;
 };
 
 #endif /* DCC_PRIVATE_H_ */
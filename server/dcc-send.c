@@ -95,7 +95,7 @@ static bool is_surface_area_lossy(DisplayChannelClient *dcc, uint32_t surface_id
 
     spice_return_val_if_fail(display_channel_validate_surface(display, surface_id), FALSE);
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     surface_lossy_region = &dcc->priv->surface_client_lossy_region[surface_id];
 
     if (!area) {
@@ -416,7 +416,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
             return FILL_BITS_TYPE_SURFACE;
         }
 
-        surface = &display->priv->surfaces[surface_id];
+        surface = display_channel_get_surface(display, surface_id);
         image.descriptor.type = SPICE_IMAGE_TYPE_SURFACE;
         image.descriptor.flags = 0;
         image.descriptor.width = surface->context.width;
@@ -438,8 +438,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
         /* Images must be added to the cache only after they are compressed
            in order to prevent starvation in the client between pixmap_cache and
            global dictionary (in cases of multiple monitors) */
-        if (reds_stream_get_family(red_channel_client_get_stream(rcc)) == AF_UNIX ||
-            !dcc_compress_image(dcc, &image, &simage->u.bitmap,
+        if (!dcc_compress_image(dcc, &image, &simage->u.bitmap,
                                 drawable, can_lossy, &comp_send_data)) {
             SpicePalette *palette;
 
@@ -2122,6 +2121,77 @@ static void marshall_lossless_qxl_drawable(RedChannelClient *rcc,
     }
 }
 
+static bool drawable_can_be_coalesced(Drawable *drawable, int surface_id)
+{
+    return drawable->surface_id == surface_id && drawable->stream == NULL;
+}
+
+/*
+ * When the client does not keep up, collapses @drawable, which is about to
+ * be sent, and the drawables and images queued after it into a single image
+ * of the area they cover, so that the client catches up with the latest
+ * state instead of replaying the history.
+ * This is done at send time, when the tree is not being modified. The image
+ * is rendered from the current state, which includes every drawable still
+ * queued, so the whole pipe must be made of such items. They are coalesced
+ * only if they cover the same region, i.e. if the resulting image is not
+ * bigger than the sum of their areas.
+ * Returns TRUE if @drawable was replaced by an image at the tail of the pipe.
+ */
+static bool dcc_coalesce_drawables(DisplayChannelClient *dcc, Drawable *drawable)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+    GQueue *pipe = red_channel_client_get_pipe(rcc);
+    SpiceRect area = drawable->red_drawable->bbox;
+    uint64_t covered_area = rect_get_area(&area);
+    GList *l;
+
+    if (red_channel_client_get_pipe_size(rcc) + 1 < DCC_COALESCE_PIPE_SIZE ||
+        !drawable_can_be_coalesced(drawable, drawable->surface_id)) {
+        return FALSE;
+    }
+
+    for (l = pipe->head; l != NULL; l = l->next) {
+        RedPipeItem *item = l->data;
+        SpiceRect rect;
+
+        if (item->type == RED_PIPE_ITEM_TYPE_DRAW) {
+            Drawable *other = SPICE_CONTAINEROF(item, RedDrawablePipeItem, dpi_pipe_item)->drawable;
+
+            if (!drawable_can_be_coalesced(other, drawable->surface_id)) {
+                return FALSE;
+            }
+            rect = other->red_drawable->bbox;
+        } else if (item->type == RED_PIPE_ITEM_TYPE_IMAGE) {
+            RedImageItem *image = SPICE_UPCAST(RedImageItem, item);
+
+            if (image->surface_id != drawable->surface_id) {
+                return FALSE;
+            }
+            rect.left = image->pos.x;
+            rect.top = image->pos.y;
+            rect.right = image->pos.x + image->width;
+            rect.bottom = image->pos.y + image->height;
+        } else {
+            return FALSE;
+        }
+        rect_union(&area, &rect);
+        covered_area += rect_get_area(&rect);
+    }
+
+    if (rect_get_area(&area) > covered_area) {
+        return FALSE;
+    }
+
+    spice_debug("coalescing %u items", red_channel_client_get_pipe_size(rcc) + 1);
+    while (pipe->head) {
+        red_channel_client_pipe_remove_and_release_pos(rcc, pipe->head);
+    }
+    display_channel_draw(DCC_TO_DC(dcc), &area, drawable->surface_id);
+    dcc_add_surface_area_image(dcc, drawable->surface_id, &area, NULL, TRUE);
+    return TRUE;
+}
+
 static void marshall_qxl_drawable(RedChannelClient *rcc,
                                   SpiceMarshaller *m,
                                   RedDrawablePipeItem *dpi)
@@ -2339,6 +2409,108 @@ static void marshall_gl_draw(RedChannelClient *rcc,
     spice_marshall_msg_display_gl_draw(m, &p->draw);
 }
 
+static void marshall_gl_stream_create(RedChannelClient *rcc,
+                                      SpiceMarshaller *m,
+                                      RedPipeItem *item)
+{
+    RedGlStreamCreateItem *p = SPICE_UPCAST(RedGlStreamCreateItem, item);
+    SpiceMsgDisplayStreamCreate stream_create;
+    SpiceClipRects clip_rects;
+
+    red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_CREATE);
+
+    stream_create.surface_id = 0;
+    stream_create.id = GL_STREAM_ID;
+    stream_create.flags = p->top_down ? SPICE_STREAM_FLAGS_TOP_DOWN : 0;
+    stream_create.codec_type = p->codec_type;
+    stream_create.stamp = 0;
+    stream_create.stream_width = p->width;
+    stream_create.stream_height = p->height;
+    stream_create.src_width = p->width;
+    stream_create.src_height = p->height;
+    stream_create.dest = p->dest;
+    stream_create.clip.type = SPICE_CLIP_TYPE_RECTS;
+    clip_rects.num_rects = 0;
+    stream_create.clip.rects = &clip_rects;
+
+    spice_marshall_msg_display_stream_create(m, &stream_create);
+}
+
+static void marshall_gl_stream_frame(RedChannelClient *rcc,
+                                     SpiceMarshaller *m,
+                                     RedPipeItem *item)
+{
+    DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
+    RedGlStreamFrameItem *p = SPICE_UPCAST(RedGlStreamFrameItem, item);
+    VideoEncoder *encoder = dcc->priv->gl_stream.encoder;
+    RedGlFrame *frame;
+    SpiceMsgDisplayStreamData stream_data;
+    SpiceBitmap bitmap;
+    SpiceRect src;
+    VideoBuffer *outbuf;
+
+    /* the next frames go to a new item */
+    if (dcc->priv->gl_stream.queued_frame == p) {
+        dcc->priv->gl_stream.queued_frame = NULL;
+    }
+
+    /* the frame may belong to a previous scanout */
+    if (p->width != dcc->priv->gl_stream.width ||
+        p->height != dcc->priv->gl_stream.height) {
+        return;
+    }
+
+    if (!p->video) {
+        RedImageItem *image;
+
+        if (!display_channel_get_surface_canvas(DCC_TO_DC(dcc), 0)) {
+            return;
+        }
+        image = red_gl_stream_frame_item_get_image(p);
+        if (image) {
+            red_marshall_image(rcc, m, image);
+        }
+        return;
+    }
+
+    /* the frame may belong to a stream which was stopped since */
+    if (!encoder) {
+        return;
+    }
+    frame = red_gl_stream_frame_item_get_frame(p);
+    if (!frame) {
+        return;
+    }
+
+    red_gl_frame_get_bitmap(frame, &bitmap);
+    src.left = 0;
+    src.top = 0;
+    src.right = frame->width;
+    src.bottom = frame->height;
+    if (encoder->encode_frame(encoder, frame->mm_time, &bitmap, &src, frame->top_down,
+                              frame, &outbuf) != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        return;
+    }
+
+    red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA);
+    stream_data.base.id = GL_STREAM_ID;
+    stream_data.base.multi_media_time = frame->mm_time;
+    stream_data.data_size = outbuf->size;
+    spice_marshall_msg_display_stream_data(m, &stream_data);
+    spice_marshaller_add_by_ref_full(m, outbuf->data, outbuf->size,
+                                     &red_release_video_encoder_buffer, outbuf);
+}
+
+static void marshall_gl_stream_destroy(RedChannelClient *rcc,
+                                       SpiceMarshaller *m)
+{
+    SpiceMsgDisplayStreamDestroy destroy;
+
+    red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DESTROY);
+    destroy.id = GL_STREAM_ID;
+    spice_marshall_msg_display_stream_destroy(m, &destroy);
+}
+
 
 static void begin_send_message(RedChannelClient *rcc)
 {
@@ -2384,7 +2556,10 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     switch (pipe_item->type) {
     case RED_PIPE_ITEM_TYPE_DRAW: {
         RedDrawablePipeItem *dpi = SPICE_CONTAINEROF(pipe_item, RedDrawablePipeItem, dpi_pipe_item);
-        marshall_qxl_drawable(rcc, m, dpi);
+        /* the image replacing the coalesced items is sent next */
+        if (!dcc_coalesce_drawables(dcc, dpi->drawable)) {
+            marshall_qxl_drawable(rcc, m, dpi);
+        }
         break;
     }
     case RED_PIPE_ITEM_TYPE_INVAL_ONE:
@@ -2454,6 +2629,15 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     case RED_PIPE_ITEM_TYPE_GL_DRAW:
         marshall_gl_draw(rcc, m, pipe_item);
         break;
+    case RED_PIPE_ITEM_TYPE_GL_STREAM_CREATE:
+        marshall_gl_stream_create(rcc, m, pipe_item);
+        break;
+    case RED_PIPE_ITEM_TYPE_GL_STREAM_FRAME:
+        marshall_gl_stream_frame(rcc, m, pipe_item);
+        break;
+    case RED_PIPE_ITEM_TYPE_GL_STREAM_DESTROY:
+        marshall_gl_stream_destroy(rcc, m);
+        break;
     default:
         spice_warn_if_reached();
     }
@@ -305,7 +305,7 @@ void dcc_create_surface(DisplayChannelClient *dcc, int surface_id)
         dcc->priv->surface_client_created[surface_id]) {
         return;
     }
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     create = red_surface_create_item_new(RED_CHANNEL(display),
                                          surface_id, surface->context.width,
                                          surface->context.height,
@@ -322,7 +322,7 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
                                          int can_lossy)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
-    RedSurface *surface = &display->priv->surfaces[surface_id];
+    RedSurface *surface = display_channel_get_surface(display, surface_id);
     SpiceCanvas *canvas = surface->context.canvas;
     RedImageItem *item;
     int stride;
@@ -388,7 +388,7 @@ void dcc_push_surface_image(DisplayChannelClient *dcc, int surface_id)
     }
 
     display = DCC_TO_DC(dcc);
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     if (!surface->context.canvas) {
         return;
     }
@@ -493,6 +493,19 @@ static void dcc_init_stream_agents(DisplayChannelClient *dcc)
     }
 }
 
+/* Setting SPICE_LOCAL_RAW_FRAMES sends the frames of the video streams
+ * as regular images to local clients, for which encoding them costs more
+ * than sending them raw over the socket. */
+bool dcc_select_raw_frames(bool local)
+{
+    const char *env_raw_frames = getenv("SPICE_LOCAL_RAW_FRAMES");
+
+    if (env_raw_frames == NULL || strcmp(env_raw_frames, "0") == 0) {
+        return FALSE;
+    }
+    return local;
+}
+
 DisplayChannelClient *dcc_new(DisplayChannel *display,
                               RedClient *client, RedsStream *stream,
                               int mig_target,
@@ -518,6 +531,7 @@ DisplayChannelClient *dcc_new(DisplayChannel *display,
     spice_debug("New display (client %p) dcc %p stream %p", client, dcc, stream);
     common_graphics_channel_set_during_target_migrate(COMMON_GRAPHICS_CHANNEL(display), mig_target);
     dcc->priv->id = common_graphics_channel_get_qxl(COMMON_GRAPHICS_CHANNEL(display))->id;
+    dcc->priv->raw_frames = dcc_select_raw_frames(reds_stream_is_plain_unix(stream));
 
     return dcc;
 }
@@ -576,7 +590,7 @@ void dcc_start(DisplayChannelClient *dcc)
         return;
 
     red_channel_client_ack_zero_messages_window(rcc);
-    if (display->priv->surfaces[0].context.canvas) {
+    if (display_channel_get_surface_canvas(display, 0)) {
         display_channel_current_flush(display, 0);
         red_channel_client_pipe_add_type(rcc, RED_PIPE_ITEM_TYPE_INVAL_PALETTE_CACHE);
         dcc_create_surface(dcc, 0);
@@ -586,8 +600,7 @@ void dcc_start(DisplayChannelClient *dcc)
         dcc_create_all_streams(dcc);
     }
 
-    if (reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)) &&
-        red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_GL_SCANOUT)) {
+    if (dcc_can_use_gl_scanout(dcc)) {
         red_channel_client_pipe_add(rcc, dcc_gl_scanout_item_new(rcc, NULL, 0));
         dcc_push_monitors_config(dcc);
     }
@@ -617,6 +630,9 @@ void dcc_stop(DisplayChannelClient *dcc)
     dcc_palette_cache_reset(dcc);
     free(dcc->priv->send_data.free_list.res);
     dcc_destroy_stream_agents(dcc);
+    dcc_gl_stream_stop(dcc, FALSE);
+    red_timer_free(dcc->priv->gl_stream.idle_timer);
+    dcc->priv->gl_stream.idle_timer = NULL;
     image_encoders_free(&dcc->priv->encoders);
 
     if (dcc->priv->gl_draw_ongoing) {
@@ -694,15 +710,21 @@ static RedSurfaceDestroyItem *red_surface_destroy_item_new(RedChannel *channel,
     return destroy;
 }
 
+/* whether the client can import the GL scanout, the other clients
+ * get it as a video stream */
+bool dcc_can_use_gl_scanout(DisplayChannelClient *dcc)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+
+    return reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)) &&
+           red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_GL_SCANOUT);
+}
+
 RedPipeItem *dcc_gl_scanout_item_new(RedChannelClient *rcc, void *data, int num)
 {
     RedGlScanoutUnixItem *item;
 
-    /* FIXME: on !unix peer, start streaming with a video codec */
-    if (!reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)) ||
-        !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_GL_SCANOUT)) {
-        spice_printerr("FIXME: client does not support GL scanout");
-        red_channel_client_disconnect(rcc);
+    if (!dcc_can_use_gl_scanout(DISPLAY_CHANNEL_CLIENT(rcc))) {
         return NULL;
     }
 
@@ -718,10 +740,8 @@ RedPipeItem *dcc_gl_draw_item_new(RedChannelClient *rcc, void *data, int num)
     const SpiceMsgDisplayGlDraw *draw = data;
     RedGlDrawItem *item;
 
-    if (!reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)) ||
-        !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_GL_SCANOUT)) {
-        spice_printerr("FIXME: client does not support GL scanout");
-        red_channel_client_disconnect(rcc);
+    /* the draw is streamed to the other clients by display_channel_gl_draw() */
+    if (!dcc_can_use_gl_scanout(dcc)) {
         return NULL;
     }
 
@@ -840,6 +860,47 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
     return SPICE_IMAGE_COMPRESSION_INVALID;
 }
 
+/* links faster than this make the CPU spent compressing images more
+ * expensive than the bandwidth it saves */
+#define HIGH_BANDWIDTH_BIT_RATE (1000 * 1000 * 1000ULL)
+
+/* Adjusts the image compression to the link of the client: local clients
+ * get raw images, clients on very fast links get the cheapest compression
+ * instead of the automatic one. A compression set explicitly, by the
+ * server configuration or by the client preference, is kept. */
+SpiceImageCompression dcc_select_link_image_compression(SpiceImageCompression image_compression,
+                                                        bool local, uint64_t bit_rate)
+{
+    if (image_compression == SPICE_IMAGE_COMPRESSION_OFF || local) {
+        return SPICE_IMAGE_COMPRESSION_OFF;
+    }
+    if (image_compression != SPICE_IMAGE_COMPRESSION_AUTO_GLZ &&
+        image_compression != SPICE_IMAGE_COMPRESSION_AUTO_LZ) {
+        return image_compression;
+    }
+
+    if (bit_rate >= HIGH_BANDWIDTH_BIT_RATE) {
+#ifdef USE_LZ4
+        return SPICE_IMAGE_COMPRESSION_LZ4;
+#else
+        return SPICE_IMAGE_COMPRESSION_LZ;
+#endif
+    }
+
+    return image_compression;
+}
+
+static SpiceImageCompression dcc_get_link_image_compression(DisplayChannelClient *dcc)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+    NetEstimator *estimator = red_client_get_net_estimator(red_channel_client_get_client(rcc));
+
+    return dcc_select_link_image_compression(
+        dcc->priv->image_compression,
+        reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)),
+        net_estimator_get_bitrate_per_sec(estimator));
+}
+
 int dcc_compress_image(DisplayChannelClient *dcc,
                        SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
                        int can_lossy,
@@ -852,7 +913,8 @@ int dcc_compress_image(DisplayChannelClient *dcc,
 
     stat_start_time_init(&start_time, &display_channel->priv->encoder_shared_data.off_stat);
 
-    image_compression = get_compression_for_bitmap(src, dcc->priv->image_compression, drawable);
+    image_compression = get_compression_for_bitmap(src, dcc_get_link_image_compression(dcc),
+                                                   drawable);
     switch (image_compression) {
     case SPICE_IMAGE_COMPRESSION_OFF:
         break;
@@ -1421,6 +1483,11 @@ void dcc_set_max_stream_bit_rate(DisplayChannelClient *dcc, uint64_t rate)
     dcc->priv->streams_max_bit_rate = rate;
 }
 
+bool dcc_wants_raw_frames(DisplayChannelClient *dcc)
+{
+    return dcc->priv->raw_frames;
+}
+
 static bool dcc_config_socket(RedChannelClient *rcc)
 {
     RedClient *client = red_channel_client_get_client(rcc);
@@ -76,6 +76,8 @@ GType display_channel_client_get_type(void) G_GNUC_CONST;
 #define NARROW_CLIENT_ACK_WINDOW 20
 
 #define MAX_PIPE_SIZE 50
+/* pipe size from which queued drawables get coalesced, see dcc_send_item */
+#define DCC_COALESCE_PIPE_SIZE (MAX_PIPE_SIZE / 2)
 
 typedef struct DisplayChannel DisplayChannel;
 typedef struct Stream Stream;
@@ -180,6 +182,7 @@ bool                       dcc_clear_surface_drawables_from_pipe     (DisplayCha
                                                                       int wait_if_used);
 bool                       dcc_drawable_is_in_pipe                   (DisplayChannelClient *dcc,
                                                                       Drawable *drawable);
+bool                       dcc_can_use_gl_scanout                    (DisplayChannelClient *dcc);
 RedPipeItem *              dcc_gl_scanout_item_new                   (RedChannelClient *rcc,
                                                                       void *data, int num);
 RedPipeItem *              dcc_gl_draw_item_new                      (RedChannelClient *rcc,
@@ -198,6 +201,13 @@ uint32_t dcc_get_max_stream_latency(DisplayChannelClient *dcc);
 void dcc_set_max_stream_latency(DisplayChannelClient *dcc, uint32_t latency);
 uint64_t dcc_get_max_stream_bit_rate(DisplayChannelClient *dcc);
 void dcc_set_max_stream_bit_rate(DisplayChannelClient *dcc, uint64_t rate);
+bool dcc_wants_raw_frames(DisplayChannelClient *dcc);
+/* the image compression and the video frames of a client, given the
+ * configured compression, whether the client is on a local socket and
+ * the estimated bit rate of its link */
+SpiceImageCompression dcc_select_link_image_compression(SpiceImageCompression image_compression,
+                                                        bool local, uint64_t bit_rate);
+bool dcc_select_raw_frames(bool local);
 gboolean dcc_is_low_bandwidth(DisplayChannelClient *dcc);
 GArray *dcc_get_preferred_video_codecs_for_encoding(DisplayChannelClient *dcc);
 
@@ -19,8 +19,11 @@
 #define DISPLAY_CHANNEL_PRIVATE_H_
 
 #include "display-channel.h"
+#include "gl-stream.h"
 
 #define NUM_DRAWABLES 1000
+#define DRAWABLES_PER_BLOCK 100
+#define NUM_DRAWABLE_BLOCKS (NUM_DRAWABLES / DRAWABLES_PER_BLOCK)
 typedef struct _Drawable _Drawable;
 struct _Drawable {
     union {
@@ -29,6 +32,9 @@ struct _Drawable {
     } u;
 };
 
+#define SURFACES_PER_PAGE 64
+#define NUM_SURFACE_PAGES ((NUM_SURFACES + SURFACES_PER_PAGE - 1) / SURFACES_PER_PAGE)
+
 struct DisplayChannelPrivate
 {
     DisplayChannel *pub;
@@ -48,7 +54,10 @@ struct DisplayChannelPrivate
     Ring current_list;
 
     uint32_t drawable_count;
-    _Drawable drawables[NUM_DRAWABLES];
+    /* the drawables are allocated by blocks, when all the allocated
+     * ones are in use */
+    _Drawable *drawable_blocks[NUM_DRAWABLE_BLOCKS];
+    uint32_t num_drawable_blocks;
     _Drawable *free_drawables;
 
     int stream_video;
@@ -61,13 +70,18 @@ struct DisplayChannelPrivate
     uint32_t next_item_trace;
     uint64_t streams_size_total;
 
-    RedSurface surfaces[NUM_SURFACES];
+    /* the surfaces are allocated by pages, when first used, as guests
+     * only use a few of them */
+    RedSurface *surface_pages[NUM_SURFACE_PAGES];
     uint32_t n_surfaces;
     SpiceImageSurfaces image_surfaces;
 
     ImageCache image_cache;
 
     int gl_draw_async_count;
+    /* the scanout as read by the remote clients streams, mapped on the
+     * first draw they need */
+    RedScanoutMap scanout_map;
 
 /* TODO: some day unify this, make it more runtime.. */
     stat_info_t add_stat;
@@ -83,4 +97,24 @@ struct DisplayChannelPrivate
     ImageEncoderSharedData encoder_shared_data;
 };
 
+/* allocates the page of the surface if needed */
+static inline RedSurface *display_channel_get_surface(DisplayChannel *display,
+                                                      uint32_t surface_id)
+{
+    RedSurface **page = &display->priv->surface_pages[surface_id / SURFACES_PER_PAGE];
+
+    if (SPICE_UNLIKELY(*page == NULL)) {
+        *page = g_new0(RedSurface, SURFACES_PER_PAGE);
+    }
+    return &(*page)[surface_id % SURFACES_PER_PAGE];
+}
+
+static inline SpiceCanvas *display_channel_get_surface_canvas(DisplayChannel *display,
+                                                              uint32_t surface_id)
+{
+    RedSurface *page = display->priv->surface_pages[surface_id / SURFACES_PER_PAGE];
+
+    return page ? page[surface_id % SURFACES_PER_PAGE].context.canvas : NULL;
+}
+
 #endif /* DISPLAY_CHANNEL_PRIVATE_H_ */
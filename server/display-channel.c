@@ -22,6 +22,7 @@
 
 #include "display-channel-private.h"
 #include "glib-compat.h"
+#include "tiled-render.h"
 
 G_DEFINE_TYPE(DisplayChannel, display_channel, TYPE_COMMON_GRAPHICS_CHANNEL)
 
@@ -73,12 +74,18 @@ display_channel_set_property(GObject *object,
     }
 }
 
+static void surfaces_free(DisplayChannel *display);
+static void drawables_free(DisplayChannel *display);
+
 static void
 display_channel_finalize(GObject *object)
 {
     DisplayChannel *self = DISPLAY_CHANNEL(object);
 
     display_channel_destroy_surfaces(self);
+    surfaces_free(self);
+    drawables_free(self);
+    red_scanout_map_destroy(&self->priv->scanout_map);
     image_cache_reset(&self->priv->image_cache);
     monitors_config_unref(self->priv->monitors_config);
     g_array_unref(self->priv->video_codecs);
@@ -253,7 +260,7 @@ static void stop_streams(DisplayChannel *display)
 
 void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
 {
-    RedSurface *surface = &display->priv->surfaces[surface_id];
+    RedSurface *surface = display_channel_get_surface(display, surface_id);
     QXLInstance *qxl = common_graphics_channel_get_qxl(COMMON_GRAPHICS_CHANNEL(display));
     DisplayChannelClient *dcc;
     GListIter iter;
@@ -289,7 +296,7 @@ void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
 gboolean display_channel_surface_has_canvas(DisplayChannel *display,
                                             uint32_t surface_id)
 {
-    return display->priv->surfaces[surface_id].context.canvas != NULL;
+    return display_channel_get_surface_canvas(display, surface_id) != NULL;
 }
 
 static void streams_update_visible_region(DisplayChannel *display, Drawable *drawable)
@@ -389,7 +396,7 @@ static void current_add_drawable(DisplayChannel *display,
     RedSurface *surface;
     uint32_t surface_id = drawable->surface_id;
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     ring_add_after(&drawable->tree_item.base.siblings_link, pos);
     ring_add(&display->priv->current_list, &drawable->list_link);
     ring_add(&surface->current_list, &drawable->surface_list_link);
@@ -480,7 +487,7 @@ static void current_remove(DisplayChannel *display, TreeItem *item)
 
 static void current_remove_all(DisplayChannel *display, int surface_id)
 {
-    Ring *ring = &display->priv->surfaces[surface_id].current;
+    Ring *ring = &display_channel_get_surface(display, surface_id)->current;
     RingItem *ring_item;
 
     while ((ring_item = ring_get_head(ring))) {
@@ -1158,7 +1165,7 @@ static void drawable_ref_surface_deps(DisplayChannel *display, Drawable *drawabl
         if (surface_id == -1) {
             continue;
         }
-        surface = &display->priv->surfaces[surface_id];
+        surface = display_channel_get_surface(display, surface_id);
         surface->refs++;
     }
 }
@@ -1167,7 +1174,7 @@ static void surface_read_bits(DisplayChannel *display, int surface_id,
                               const SpiceRect *area, uint8_t *dest, int dest_stride)
 {
     SpiceCanvas *canvas;
-    RedSurface *surface = &display->priv->surfaces[surface_id];
+    RedSurface *surface = display_channel_get_surface(display, surface_id);
 
     canvas = surface->context.canvas;
     canvas->ops->read_bits(canvas, dest, dest_stride, area);
@@ -1185,7 +1192,7 @@ static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
     int bpp;
     int all_set;
 
-    surface = &display->priv->surfaces[drawable->surface_id];
+    surface = display_channel_get_surface(display, drawable->surface_id);
 
     bpp = SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8;
     width = red_drawable->self_bitmap_area.right - red_drawable->self_bitmap_area.left;
@@ -1237,7 +1244,7 @@ static void surface_add_reverse_dependency(DisplayChannel *display, int surface_
         return;
     }
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     depend_item->drawable = drawable;
     ring_add(&surface->depend_on_me, &depend_item->ring_item);
@@ -1271,7 +1278,7 @@ static void draw_depend_on_me(DisplayChannel *display, uint32_t surface_id)
     RedSurface *surface;
     RingItem *ring_item;
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     while ((ring_item = ring_get_tail(&surface->depend_on_me))) {
         Drawable *drawable;
@@ -1292,7 +1299,7 @@ static bool validate_drawable_bbox(DisplayChannel *display, RedDrawable *drawabl
         if (!display_channel_validate_surface(display, drawable->surface_id)) {
             return FALSE;
         }
-        context = &display->priv->surfaces[surface_id].context;
+        context = &display_channel_get_surface(display, surface_id)->context;
 
         if (drawable->bbox.top < 0)
                 return FALSE;
@@ -1346,7 +1353,7 @@ static Drawable *display_channel_get_drawable(DisplayChannel *display, uint8_t e
     drawable->red_drawable = red_drawable_ref(red_drawable);
 
     drawable->surface_id = red_drawable->surface_id;
-    display->priv->surfaces[drawable->surface_id].refs++;
+    display_channel_get_surface(display, drawable->surface_id)->refs++;
 
     memcpy(drawable->surface_deps, red_drawable->surface_deps, sizeof(drawable->surface_deps));
     /*
@@ -1396,7 +1403,7 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
         return;
     }
 
-    Ring *ring = &display->priv->surfaces[surface_id].current;
+    Ring *ring = &display_channel_get_surface(display, surface_id)->current;
     int add_to_pipe;
     if (has_shadow(red_drawable)) {
         add_to_pipe = current_add_with_shadow(display, ring, drawable);
@@ -1473,7 +1480,7 @@ void display_channel_flush_all_surfaces(DisplayChannel *display)
     int x;
 
     for (x = 0; x < NUM_SURFACES; ++x) {
-        if (display->priv->surfaces[x].context.canvas) {
+        if (display_channel_get_surface_canvas(display, x)) {
             display_channel_current_flush(display, x);
         }
     }
@@ -1527,7 +1534,7 @@ static bool free_one_drawable(DisplayChannel *display, int force_glz_free)
 
 void display_channel_current_flush(DisplayChannel *display, int surface_id)
 {
-    while (!ring_is_empty(&display->priv->surfaces[surface_id].current_list)) {
+    while (!ring_is_empty(&display_channel_get_surface(display, surface_id)->current_list)) {
         free_one_drawable(display, FALSE);
     }
     current_remove_all(display, surface_id);
@@ -1562,11 +1569,31 @@ void display_channel_free_some(DisplayChannel *display)
     }
 }
 
+static void drawable_free(DisplayChannel *display, Drawable *drawable);
+
+static bool drawables_grow(DisplayChannel *display)
+{
+    DisplayChannelPrivate *priv = display->priv;
+    _Drawable *block;
+    int i;
+
+    if (priv->num_drawable_blocks == NUM_DRAWABLE_BLOCKS) {
+        return FALSE;
+    }
+
+    block = g_new(_Drawable, DRAWABLES_PER_BLOCK);
+    priv->drawable_blocks[priv->num_drawable_blocks++] = block;
+    for (i = 0; i < DRAWABLES_PER_BLOCK; i++) {
+        drawable_free(display, &block[i].u.drawable);
+    }
+    return TRUE;
+}
+
 static Drawable* drawable_try_new(DisplayChannel *display)
 {
     Drawable *drawable;
 
-    if (!display->priv->free_drawables)
+    if (!display->priv->free_drawables && !drawables_grow(display))
         return NULL;
 
     drawable = &display->priv->free_drawables->u.drawable;
@@ -1584,11 +1611,28 @@ static void drawable_free(DisplayChannel *display, Drawable *drawable)
 
 static void drawables_init(DisplayChannel *display)
 {
-    int i;
+    display->priv->free_drawables = NULL;
+    display->priv->num_drawable_blocks = 0;
+}
+
+static void drawables_free(DisplayChannel *display)
+{
+    uint32_t i;
 
+    for (i = 0; i < display->priv->num_drawable_blocks; i++) {
+        g_free(display->priv->drawable_blocks[i]);
+    }
+    display->priv->num_drawable_blocks = 0;
     display->priv->free_drawables = NULL;
-    for (i = 0; i < NUM_DRAWABLES; i++) {
-        drawable_free(display, &display->priv->drawables[i].u.drawable);
+}
+
+static void surfaces_free(DisplayChannel *display)
+{
+    int i;
+
+    for (i = 0; i < NUM_SURFACE_PAGES; i++) {
+        g_free(display->priv->surface_pages[i]);
+        display->priv->surface_pages[i] = NULL;
     }
 }
 
@@ -1703,6 +1747,116 @@ static void drawable_deps_draw(DisplayChannel *display, Drawable *drawable)
     }
 }
 
+/* Whether @copy is a plain copy of raw 32 bits per pixel data, which can
+ * be done outside of the canvas. Copies of images to be cached, decoded,
+ * scaled or masked, like composites, are left to the canvas. */
+static bool drawable_copy_is_raw(RedDrawable *red_drawable)
+{
+    SpiceCopy *copy = &red_drawable->u.copy;
+    SpiceImage *image = copy->src_bitmap;
+    SpiceBitmap *bitmap;
+
+    if (image == NULL || image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP ||
+        (image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME) ||
+        copy->rop_descriptor != SPICE_ROPD_OP_PUT || copy->mask.bitmap) {
+        return FALSE;
+    }
+    bitmap = &image->u.bitmap;
+    return bitmap->format == SPICE_BITMAP_FMT_32BIT &&
+           bitmap->data->num_chunks == 1 &&
+           copy->src_area.left >= 0 && copy->src_area.top >= 0 &&
+           copy->src_area.right <= bitmap->x && copy->src_area.bottom <= bitmap->y &&
+           copy->src_area.right - copy->src_area.left ==
+               red_drawable->bbox.right - red_drawable->bbox.left &&
+           copy->src_area.bottom - copy->src_area.top ==
+               red_drawable->bbox.bottom - red_drawable->bbox.top;
+}
+
+/* Large solid fills and raw copies are common on big surfaces (e.g.
+ * clearing a window, a full screen update), render them in parallel bands
+ * rather than through the canvas */
+static bool drawable_draw_tiled(RedSurface *surface, Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    uint32_t color = 0;
+    QRegion region;
+    SpiceRect *rects;
+    int num_rects;
+    bool ret;
+
+    if (!surface->context.canvas_draws_on_surface ||
+        surface->context.format != SPICE_SURFACE_FMT_32_xRGB ||
+        rect_get_area(&red_drawable->bbox) < TILED_RENDER_MIN_AREA) {
+        return FALSE;
+    }
+
+    switch (red_drawable->type) {
+    case QXL_DRAW_FILL:
+        if (red_drawable->u.fill.brush.type != SPICE_BRUSH_TYPE_SOLID ||
+            red_drawable->u.fill.rop_descriptor != SPICE_ROPD_OP_PUT ||
+            red_drawable->u.fill.mask.bitmap) {
+            return FALSE;
+        }
+        color = red_drawable->u.fill.brush.u.color;
+        break;
+    case QXL_DRAW_BLACKNESS:
+        if (red_drawable->u.blackness.mask.bitmap) {
+            return FALSE;
+        }
+        color = 0x0;
+        break;
+    case QXL_DRAW_WHITENESS:
+        if (red_drawable->u.whiteness.mask.bitmap) {
+            return FALSE;
+        }
+        color = 0xffffffff;
+        break;
+    case QXL_DRAW_COPY:
+        if (!drawable_copy_is_raw(red_drawable)) {
+            return FALSE;
+        }
+        break;
+    default:
+        return FALSE;
+    }
+
+    region_init(&region);
+    region_add(&region, &red_drawable->bbox);
+    if (red_drawable->clip.type == SPICE_CLIP_TYPE_RECTS) {
+        QRegion clip_rgn;
+
+        region_init(&clip_rgn);
+        region_add_clip_rects(&clip_rgn, red_drawable->clip.rects);
+        region_and(&region, &clip_rgn);
+        region_destroy(&clip_rgn);
+    }
+    num_rects = pixman_region32_n_rects(&region);
+    rects = spice_new(SpiceRect, num_rects);
+    region_ret_rects(&region, rects, num_rects);
+    if (red_drawable->type == QXL_DRAW_COPY) {
+        SpiceCopy *copy = &red_drawable->u.copy;
+        SpiceBitmap *bitmap = &copy->src_bitmap->u.bitmap;
+        uint8_t *src_line_0 = bitmap->data->chunk[0].data;
+        int32_t src_stride = bitmap->stride;
+
+        if (!(bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN)) {
+            src_line_0 += (bitmap->y - 1) * bitmap->stride;
+            src_stride = -src_stride;
+        }
+        ret = tiled_render_copy_rects(surface->context.line_0, surface->context.stride,
+                                      rects, num_rects, src_line_0, src_stride,
+                                      copy->src_area.left - red_drawable->bbox.left,
+                                      copy->src_area.top - red_drawable->bbox.top);
+    } else {
+        ret = tiled_render_fill_rects(surface->context.line_0, surface->context.stride,
+                                      rects, num_rects, color);
+    }
+    free(rects);
+    region_destroy(&region);
+
+    return ret;
+}
+
 static void drawable_draw(DisplayChannel *display, Drawable *drawable)
 {
     RedSurface *surface;
@@ -1711,7 +1865,7 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
 
     drawable_deps_draw(display, drawable);
 
-    surface = &display->priv->surfaces[drawable->surface_id];
+    surface = display_channel_get_surface(display, drawable->surface_id);
     canvas = surface->context.canvas;
     spice_return_if_fail(canvas);
 
@@ -1719,6 +1873,10 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
 
     region_add(&surface->draw_dirty_region, &drawable->red_drawable->bbox);
 
+    if (drawable_draw_tiled(surface, drawable)) {
+        return;
+    }
+
     switch (drawable->red_drawable->type) {
     case QXL_DRAW_FILL: {
         SpiceFill fill = drawable->red_drawable->u.fill;
@@ -1932,7 +2090,7 @@ void display_channel_draw_until(DisplayChannel *display, const SpiceRect *area,
     spice_return_if_fail(last);
     spice_return_if_fail(ring_item_is_linked(&last->list_link));
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     if (surface_id != last->surface_id) {
         // find the nearest older drawable from the appropriate surface
@@ -1977,7 +2135,7 @@ void display_channel_draw(DisplayChannel *display, const SpiceRect *area, int su
     spice_return_if_fail(area->left >= 0 && area->top >= 0 &&
                          area->left < area->right && area->top < area->bottom);
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     last = current_find_intersects_rect(&surface->current_list, NULL, area);
     if (last)
@@ -2014,7 +2172,7 @@ void display_channel_update(DisplayChannel *display,
     red_get_rect_ptr(&rect, area);
     display_channel_draw(display, &rect, surface_id);
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     if (*qxl_dirty_rects == NULL) {
         *num_dirty_rects = pixman_region32_n_rects(&surface->draw_dirty_region);
         *qxl_dirty_rects = spice_new0(QXLRect, *num_dirty_rects);
@@ -2054,7 +2212,7 @@ void display_channel_destroy_surface_wait(DisplayChannel *display, uint32_t surf
 {
     if (!display_channel_validate_surface(display, surface_id))
         return;
-    if (!display->priv->surfaces[surface_id].context.canvas)
+    if (!display_channel_get_surface_canvas(display, surface_id))
         return;
 
     draw_depend_on_me(display, surface_id);
@@ -2074,12 +2232,12 @@ void display_channel_destroy_surfaces(DisplayChannel *display)
     spice_debug(NULL);
     //to handle better
     for (i = 0; i < NUM_SURFACES; ++i) {
-        if (display->priv->surfaces[i].context.canvas) {
+        if (display_channel_get_surface_canvas(display, i)) {
             display_channel_destroy_surface_wait(display, i);
-            if (display->priv->surfaces[i].context.canvas) {
+            if (display_channel_get_surface_canvas(display, i)) {
                 display_channel_surface_unref(display, i);
             }
-            spice_assert(!display->priv->surfaces[i].context.canvas);
+            spice_assert(!display_channel_get_surface_canvas(display, i));
         }
     }
     spice_warn_if_fail(ring_is_empty(&display->priv->streams));
@@ -2129,7 +2287,7 @@ void display_channel_create_surface(DisplayChannel *display, uint32_t surface_id
                                     uint32_t height, int32_t stride, uint32_t format,
                                     void *line_0, int data_is_valid, int send_client)
 {
-    RedSurface *surface = &display->priv->surfaces[surface_id];
+    RedSurface *surface = display_channel_get_surface(display, surface_id);
 
     spice_warn_if_fail(!surface->context.canvas);
 
@@ -2224,7 +2382,7 @@ static SpiceCanvas *image_surfaces_get(SpiceImageSurfaces *surfaces, uint32_t su
 
     spice_return_val_if_fail(display_channel_validate_surface(display, surface_id), NULL);
 
-    return p->surfaces[surface_id].context.canvas;
+    return display_channel_get_surface_canvas(display, surface_id);
 }
 
 DisplayChannel* display_channel_new(RedsState *reds,
@@ -2323,7 +2481,7 @@ void display_channel_process_surface_cmd(DisplayChannel *display,
         return;
     }
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     switch (surface_cmd->type) {
     case QXL_SURFACE_CMD_CREATE: {
@@ -2382,6 +2540,8 @@ void display_channel_update_compression(DisplayChannel *display, DisplayChannelC
 
 void display_channel_gl_scanout(DisplayChannel *display)
 {
+    /* the new scanout is mapped when it is first drawn to */
+    red_scanout_map_destroy(&display->priv->scanout_map);
     red_channel_pipes_new_add_push(RED_CHANNEL(display), dcc_gl_scanout_item_new, NULL);
 }
 
@@ -2396,12 +2556,67 @@ static void set_gl_draw_async_count(DisplayChannel *display, int num)
     }
 }
 
+static bool display_channel_map_gl_scanout(DisplayChannel *display)
+{
+    QXLInstance *qxl = common_graphics_channel_get_qxl(COMMON_GRAPHICS_CHANNEL(display));
+    SpiceMsgDisplayGlScanoutUnix *scanout;
+    bool mapped = false;
+
+    if (red_scanout_map_is_mapped(&display->priv->scanout_map)) {
+        return true;
+    }
+
+    scanout = red_qxl_get_gl_scanout(qxl);
+    if (scanout) {
+        mapped = red_scanout_map_init(&display->priv->scanout_map, scanout);
+    }
+    red_qxl_put_gl_scanout(qxl, scanout);
+
+    return mapped;
+}
+
+/* The clients which cannot import the scanout get it as a video stream */
+static void display_channel_gl_stream_draw(DisplayChannel *display,
+                                           SpiceMsgDisplayGlDraw *draw)
+{
+    DisplayChannelClient *dcc;
+    RedGlFrame *frame = NULL;
+    SpiceRect damage;
+    uint32_t mm_time = 0;
+    bool mapped = false;
+    GListIter iter;
+
+    FOREACH_DCC(display, iter, dcc) {
+        if (dcc_can_use_gl_scanout(dcc)) {
+            continue;
+        }
+        if (!mapped) {
+            if (!display_channel_map_gl_scanout(display)) {
+                return;
+            }
+            mapped = true;
+            damage.left = draw->x;
+            damage.top = draw->y;
+            damage.right = draw->x + draw->w;
+            damage.bottom = draw->y + draw->h;
+            mm_time = reds_get_mm_time();
+        }
+        dcc_gl_stream_push_frame(dcc, &display->priv->scanout_map, &damage, mm_time, &frame);
+    }
+
+    if (frame) {
+        red_gl_frame_unref(frame);
+    }
+}
+
 void display_channel_gl_draw(DisplayChannel *display, SpiceMsgDisplayGlDraw *draw)
 {
     int num;
 
     spice_return_if_fail(display->priv->gl_draw_async_count == 0);
 
+    /* the scanout is read before the guest is told it can reuse it */
+    display_channel_gl_stream_draw(display, draw);
     num = red_channel_pipes_new_add_push(RED_CHANNEL(display), dcc_gl_draw_item_new, draw);
     set_gl_draw_async_count(display, num);
 }
@@ -2422,9 +2637,8 @@ gboolean display_channel_validate_surface(DisplayChannel *display, uint32_t surf
         spice_warning("invalid surface_id %u", surface_id);
         return FALSE;
     }
-    if (!display->priv->surfaces[surface_id].context.canvas) {
-        spice_warning("canvas address is %p for %d (and is NULL)\n",
-                   &(display->priv->surfaces[surface_id].context.canvas), surface_id);
+    if (!display_channel_get_surface_canvas(display, surface_id)) {
+        spice_warning("canvas is NULL for %d", surface_id);
         spice_warning("failed on %d", surface_id);
         return FALSE;
     }
@@ -2445,11 +2659,11 @@ void display_channel_update_monitors_config(DisplayChannel *display,
 
 void display_channel_set_monitors_config_to_primary(DisplayChannel *display)
 {
-    DrawContext *context = &display->priv->surfaces[0].context;
+    DrawContext *context = &display_channel_get_surface(display, 0)->context;
     QXLHead head = { 0, };
     uint16_t old_max = 1;
 
-    spice_return_if_fail(display->priv->surfaces[0].context.canvas);
+    spice_return_if_fail(display_channel_get_surface_canvas(display, 0));
 
     if (display->priv->monitors_config) {
         old_max = display->priv->monitors_config->max_allowed;
@@ -127,6 +127,9 @@ enum {
     RED_PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT,
     RED_PIPE_ITEM_TYPE_GL_SCANOUT,
     RED_PIPE_ITEM_TYPE_GL_DRAW,
+    RED_PIPE_ITEM_TYPE_GL_STREAM_CREATE,
+    RED_PIPE_ITEM_TYPE_GL_STREAM_FRAME,
+    RED_PIPE_ITEM_TYPE_GL_STREAM_DESTROY,
 };
 
 typedef struct MonitorsConfig {
@@ -20,18 +20,173 @@
  * This file exports a global variable:
  *
  * const SpiceCoreInterfaceInternal event_loop_core;
+ *
+ * and event_loop_core_use_epoll() to switch a core to the epoll variant.
  */
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
 #include "red-common.h"
 
+typedef struct EventLoopCallbackStat EventLoopCallbackStat;
+
+#ifdef RED_STATISTICS
+struct EventLoopCallbackStat {
+    RedStatNode node;
+    RedStatCounter dispatches;
+    RedStatCounter time_us;
+    RedStatCounter max_time_us;
+};
+
+struct EventLoopStats {
+    RedsState *reds;
+    RedStatNode node;
+    RedStatCounter timer_lag_us;
+    RedStatCounter timer_lag_max_us;
+    /* the stats of each callback function */
+    GHashTable *callbacks;
+};
+
+EventLoopStats *event_loop_stats_new(RedsState *reds, const RedStatNode *parent)
+{
+    const char *env_loop_stats = getenv("SPICE_LOOP_STATS");
+    EventLoopStats *stats;
+
+    if (env_loop_stats == NULL || strcmp(env_loop_stats, "0") == 0) {
+        return NULL;
+    }
+
+    stats = g_new0(EventLoopStats, 1);
+    stats->reds = reds;
+    stat_init_node(&stats->node, reds, parent, "loop", TRUE);
+    stat_init_counter(&stats->timer_lag_us, reds, &stats->node, "timer_lag_us", TRUE);
+    stat_init_counter(&stats->timer_lag_max_us, reds, &stats->node, "timer_lag_max_us", TRUE);
+    stats->callbacks = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+    return stats;
+}
+
+static void callback_stat_remove(gpointer key, gpointer value, gpointer user_data)
+{
+    EventLoopCallbackStat *stat = value;
+    EventLoopStats *stats = user_data;
+
+    stat_remove_counter(stats->reds, &stat->dispatches);
+    stat_remove_counter(stats->reds, &stat->time_us);
+    stat_remove_counter(stats->reds, &stat->max_time_us);
+    stat_remove_node(stats->reds, &stat->node);
+}
+
+void event_loop_stats_free(EventLoopStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+
+    g_hash_table_foreach(stats->callbacks, callback_stat_remove, stats);
+    g_hash_table_unref(stats->callbacks);
+    stat_remove_counter(stats->reds, &stats->timer_lag_us);
+    stat_remove_counter(stats->reds, &stats->timer_lag_max_us);
+    stat_remove_node(stats->reds, &stats->node);
+    g_free(stats);
+}
+
+/* The callbacks are told apart by their address, which gdb or addr2line
+ * resolve, @kind is 't' for the timers and 'w' for the watches */
+static EventLoopCallbackStat *callback_stat_get(EventLoopStats *stats, char kind, gpointer func)
+{
+    EventLoopCallbackStat *stat;
+    char name[20];
+
+    if (!stats) {
+        return NULL;
+    }
+
+    stat = g_hash_table_lookup(stats->callbacks, func);
+    if (stat) {
+        return stat;
+    }
+
+    stat = g_new0(EventLoopCallbackStat, 1);
+    snprintf(name, sizeof(name), "%c%" PRIxPTR, kind, (uintptr_t)func);
+    stat_init_node(&stat->node, stats->reds, &stats->node, name, TRUE);
+    stat_init_counter(&stat->dispatches, stats->reds, &stat->node, "dispatches", TRUE);
+    stat_init_counter(&stat->time_us, stats->reds, &stat->node, "time_us", TRUE);
+    stat_init_counter(&stat->max_time_us, stats->reds, &stat->node, "max_time_us", TRUE);
+    g_hash_table_insert(stats->callbacks, func, stat);
+
+    return stat;
+}
+
+static void callback_stat_add(EventLoopCallbackStat *stat, red_time_t start)
+{
+    uint64_t time_us = (spice_get_monotonic_time_ns() - start) / NSEC_PER_MICROSEC;
+
+    stat_inc_counter(stat->dispatches, 1);
+    stat_inc_counter(stat->time_us, time_us);
+    stat_max_counter(stat->max_time_us, time_us);
+}
+
+/* how late a timer runs tells how busy the loop is */
+static void loop_stats_add_timer_lag(EventLoopStats *stats, red_time_t deadline, red_time_t now)
+{
+    uint64_t lag_us;
+
+    if (now <= deadline) {
+        return;
+    }
+    lag_us = (now - deadline) / NSEC_PER_MICROSEC;
+    stat_inc_counter(stats->timer_lag_us, lag_us);
+    stat_max_counter(stats->timer_lag_max_us, lag_us);
+}
+#else
+EventLoopStats *event_loop_stats_new(RedsState *reds, const RedStatNode *parent)
+{
+    return NULL;
+}
+
+void event_loop_stats_free(EventLoopStats *stats)
+{
+}
+
+static inline EventLoopCallbackStat *callback_stat_get(EventLoopStats *stats, char kind,
+                                                       gpointer func)
+{
+    return NULL;
+}
+
+static inline void callback_stat_add(EventLoopCallbackStat *stat, red_time_t start)
+{
+}
+
+static inline void loop_stats_add_timer_lag(EventLoopStats *stats, red_time_t deadline,
+                                            red_time_t now)
+{
+}
+#endif
+
 struct SpiceTimer {
     GMainContext *context;
     SpiceTimerFunc func;
     void *opaque;
     GSource *source;
+    EventLoopStats *loop_stats;
+    EventLoopCallbackStat *stat; /* NULL if the stats are not collected */
+    red_time_t deadline;
+    /* epoll variant */
+    EpollLoop *epoll_loop;
+    GSequenceIter *iter; /* NULL if the timer is not started */
 };
 
 static SpiceTimer* timer_add(const SpiceCoreInterfaceInternal *iface,
@@ -42,6 +197,8 @@ static SpiceTimer* timer_add(const SpiceCoreInterfaceInternal *iface,
     timer->context = iface->main_context;
     timer->func = func;
     timer->opaque = opaque;
+    timer->loop_stats = iface->loop_stats;
+    timer->stat = callback_stat_get(iface->loop_stats, 't', (gpointer)func);
 
     return timer;
 }
@@ -49,9 +206,20 @@ static SpiceTimer* timer_add(const SpiceCoreInterfaceInternal *iface,
 static gboolean timer_func(gpointer user_data)
 {
     SpiceTimer *timer = user_data;
+    EventLoopCallbackStat *stat = timer->stat;
+    red_time_t start;
+
+    if (!stat) {
+        timer->func(timer->opaque);
+        /* timer might be free after func(), don't touch */
+        return FALSE;
+    }
 
+    start = spice_get_monotonic_time_ns();
+    loop_stats_add_timer_lag(timer->loop_stats, timer->deadline, start);
     timer->func(timer->opaque);
     /* timer might be free after func(), don't touch */
+    callback_stat_add(stat, start);
 
     return FALSE;
 }
@@ -73,6 +241,9 @@ static void timer_start(const SpiceCoreInterfaceInternal *iface,
 
     timer->source = g_timeout_source_new(ms);
     spice_assert(timer->source != NULL);
+    if (timer->stat) {
+        timer->deadline = spice_get_monotonic_time_ns() + ms * NSEC_PER_MILLISEC;
+    }
 
     g_source_set_callback(timer->source, timer_func, timer, NULL);
 
@@ -93,6 +264,11 @@ struct SpiceWatch {
     GSource *source;
     GIOChannel *channel;
     SpiceWatchFunc func;
+    EventLoopCallbackStat *stat; /* NULL if the stats are not collected */
+    /* epoll variant */
+    EpollLoop *epoll_loop;
+    int fd;
+    int event_mask;
 };
 
 static GIOCondition spice_event_to_giocondition(int event_mask)
@@ -123,9 +299,19 @@ static gboolean watch_func(GIOChannel *source, GIOCondition condition,
                            gpointer data)
 {
     SpiceWatch *watch = data;
+    EventLoopCallbackStat *stat = watch->stat;
     int fd = g_io_channel_unix_get_fd(source);
+    red_time_t start;
+
+    if (!stat) {
+        watch->func(fd, giocondition_to_spice_event(condition), watch->opaque);
+        return TRUE;
+    }
 
+    start = spice_get_monotonic_time_ns();
     watch->func(fd, giocondition_to_spice_event(condition), watch->opaque);
+    /* watch might be free after func(), don't touch */
+    callback_stat_add(stat, start);
 
     return TRUE;
 }
@@ -160,6 +346,7 @@ static SpiceWatch *watch_add(const SpiceCoreInterfaceInternal *iface,
     watch->channel = g_io_channel_unix_new(fd);
     watch->func = func;
     watch->opaque = opaque;
+    watch->stat = callback_stat_get(iface->loop_stats, 'w', (gpointer)func);
 
     watch_update_mask(iface, watch, event_mask);
 
@@ -186,3 +373,301 @@ const SpiceCoreInterfaceInternal event_loop_core = {
     .watch_update_mask = watch_update_mask,
     .watch_remove = watch_remove,
 };
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * A variant for loops with many watches. GLib builds the array it polls
+ * from all the sources of the context at each iteration, here the watches
+ * are registered with an epoll instance instead and its descriptor is the
+ * only one polled. The timers are kept sorted by deadline and dispatched
+ * by the same source.
+ * The watches are level-triggered: the callbacks do not always read or
+ * write until EAGAIN.
+ */
+
+#define EPOLL_LOOP_MAX_EVENTS 64
+
+struct EpollLoop {
+    GSource source;
+    GPollFD poll_fd;
+    GSequence *timers; /* the started timers, soonest first */
+    /* the watches removed while dispatching, an event may still refer
+     * to them */
+    GList *removed_watches;
+    bool dispatching;
+};
+
+static SpiceTimer *epoll_loop_first_timer(EpollLoop *loop)
+{
+    GSequenceIter *iter = g_sequence_get_begin_iter(loop->timers);
+
+    return g_sequence_iter_is_end(iter) ? NULL : g_sequence_get(iter);
+}
+
+static gboolean epoll_loop_prepare(GSource *source, gint *timeout)
+{
+    EpollLoop *loop = SPICE_CONTAINEROF(source, EpollLoop, source);
+    SpiceTimer *timer = epoll_loop_first_timer(loop);
+    red_time_t now;
+
+    if (!timer) {
+        *timeout = -1;
+        return FALSE;
+    }
+
+    now = spice_get_monotonic_time_ns();
+    if (timer->deadline <= now) {
+        *timeout = 0;
+        return TRUE;
+    }
+    *timeout = MIN((timer->deadline - now + NSEC_PER_MILLISEC - 1) / NSEC_PER_MILLISEC,
+                   G_MAXINT);
+    return FALSE;
+}
+
+static gboolean epoll_loop_check(GSource *source)
+{
+    EpollLoop *loop = SPICE_CONTAINEROF(source, EpollLoop, source);
+    SpiceTimer *timer;
+
+    if (loop->poll_fd.revents & G_IO_IN) {
+        return TRUE;
+    }
+    timer = epoll_loop_first_timer(loop);
+    return timer && timer->deadline <= spice_get_monotonic_time_ns();
+}
+
+static int epoll_events_to_spice_event(uint32_t events, int event_mask)
+{
+    int event = 0;
+
+    if (events & EPOLLIN)
+        event |= SPICE_WATCH_EVENT_READ;
+    if (events & EPOLLOUT)
+        event |= SPICE_WATCH_EVENT_WRITE;
+    /* the callback finds out about the error as it reads or writes */
+    if (events & (EPOLLERR | EPOLLHUP))
+        event |= event_mask;
+
+    return event & event_mask;
+}
+
+static void epoll_watch_dispatch(SpiceWatch *watch, int event)
+{
+    EventLoopCallbackStat *stat = watch->stat;
+    red_time_t start;
+
+    if (!stat) {
+        watch->func(watch->fd, event, watch->opaque);
+        return;
+    }
+
+    start = spice_get_monotonic_time_ns();
+    watch->func(watch->fd, event, watch->opaque);
+    callback_stat_add(stat, start);
+}
+
+static gboolean epoll_loop_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+    EpollLoop *loop = SPICE_CONTAINEROF(source, EpollLoop, source);
+    struct epoll_event events[EPOLL_LOOP_MAX_EVENTS];
+    SpiceTimer *timer;
+    red_time_t now;
+    int i, n;
+
+    loop->dispatching = true;
+    n = epoll_wait(loop->poll_fd.fd, events, G_N_ELEMENTS(events), 0);
+    for (i = 0; i < n; i++) {
+        SpiceWatch *watch = events[i].data.ptr;
+        /* the mask is 0 if an earlier callback removed the watch */
+        int event = epoll_events_to_spice_event(events[i].events, watch->event_mask);
+
+        if (event) {
+            epoll_watch_dispatch(watch, event);
+        }
+    }
+    loop->dispatching = false;
+    g_list_free_full(loop->removed_watches, free);
+    loop->removed_watches = NULL;
+
+    /* a timer started again by its callback has a later deadline than
+     * @now, it waits for the next iteration */
+    now = spice_get_monotonic_time_ns();
+    while ((timer = epoll_loop_first_timer(loop)) && timer->deadline <= now) {
+        g_sequence_remove(timer->iter);
+        timer->iter = NULL;
+        timer_func(timer);
+    }
+
+    return TRUE;
+}
+
+static void epoll_loop_finalize(GSource *source)
+{
+    EpollLoop *loop = SPICE_CONTAINEROF(source, EpollLoop, source);
+
+    close(loop->poll_fd.fd);
+    g_sequence_free(loop->timers);
+    g_list_free_full(loop->removed_watches, free);
+}
+
+static GSourceFuncs epoll_loop_funcs = {
+    .prepare = epoll_loop_prepare,
+    .check = epoll_loop_check,
+    .dispatch = epoll_loop_dispatch,
+    .finalize = epoll_loop_finalize,
+};
+
+static SpiceTimer* epoll_timer_add(const SpiceCoreInterfaceInternal *iface,
+                                   SpiceTimerFunc func, void *opaque)
+{
+    SpiceTimer *timer = timer_add(iface, func, opaque);
+
+    timer->epoll_loop = iface->epoll_loop;
+
+    return timer;
+}
+
+static gint timer_compare_deadline(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const SpiceTimer *timer_a = a, *timer_b = b;
+
+    if (timer_a->deadline == timer_b->deadline) {
+        return 0;
+    }
+    return timer_a->deadline < timer_b->deadline ? -1 : 1;
+}
+
+static void epoll_timer_cancel(const SpiceCoreInterfaceInternal *iface,
+                               SpiceTimer *timer)
+{
+    if (timer->iter) {
+        g_sequence_remove(timer->iter);
+        timer->iter = NULL;
+    }
+}
+
+static void epoll_timer_start(const SpiceCoreInterfaceInternal *iface,
+                              SpiceTimer *timer, uint32_t ms)
+{
+    epoll_timer_cancel(iface, timer);
+
+    timer->deadline = spice_get_monotonic_time_ns() + ms * NSEC_PER_MILLISEC;
+    timer->iter = g_sequence_insert_sorted(timer->epoll_loop->timers, timer,
+                                           timer_compare_deadline, NULL);
+}
+
+static void epoll_timer_remove(const SpiceCoreInterfaceInternal *iface,
+                               SpiceTimer *timer)
+{
+    epoll_timer_cancel(iface, timer);
+    free(timer);
+}
+
+static void epoll_watch_update_mask(const SpiceCoreInterfaceInternal *iface,
+                                    SpiceWatch *watch, int event_mask)
+{
+    struct epoll_event event = { 0, };
+    int op;
+
+    if (event_mask == watch->event_mask) {
+        return;
+    }
+
+    if (!event_mask) {
+        op = EPOLL_CTL_DEL;
+    } else if (!watch->event_mask) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    if (event_mask & SPICE_WATCH_EVENT_READ)
+        event.events |= EPOLLIN;
+    if (event_mask & SPICE_WATCH_EVENT_WRITE)
+        event.events |= EPOLLOUT;
+    event.data.ptr = watch;
+
+    /* a closed descriptor left the epoll set by itself */
+    if (epoll_ctl(watch->epoll_loop->poll_fd.fd, op, watch->fd, &event) == -1 &&
+        !(op == EPOLL_CTL_DEL && errno == EBADF)) {
+        spice_warning("epoll_ctl failed on fd %d: %s", watch->fd, strerror(errno));
+        return;
+    }
+    watch->event_mask = event_mask;
+}
+
+static SpiceWatch *epoll_watch_add(const SpiceCoreInterfaceInternal *iface,
+                                   int fd, int event_mask, SpiceWatchFunc func, void *opaque)
+{
+    SpiceWatch *watch;
+
+    spice_return_val_if_fail(fd != -1, NULL);
+    spice_return_val_if_fail(func != NULL, NULL);
+
+    watch = spice_malloc0(sizeof(SpiceWatch));
+    watch->epoll_loop = iface->epoll_loop;
+    watch->fd = fd;
+    watch->func = func;
+    watch->opaque = opaque;
+    watch->stat = callback_stat_get(iface->loop_stats, 'w', (gpointer)func);
+
+    epoll_watch_update_mask(iface, watch, event_mask);
+
+    return watch;
+}
+
+static void epoll_watch_remove(const SpiceCoreInterfaceInternal *iface,
+                               SpiceWatch *watch)
+{
+    EpollLoop *loop = watch->epoll_loop;
+
+    epoll_watch_update_mask(iface, watch, 0);
+
+    if (loop->dispatching) {
+        loop->removed_watches = g_list_prepend(loop->removed_watches, watch);
+        return;
+    }
+    free(watch);
+}
+
+bool event_loop_core_use_epoll(SpiceCoreInterfaceInternal *core)
+{
+    EpollLoop *loop;
+    GSource *source;
+    int epoll_fd;
+
+    spice_return_val_if_fail(core->main_context != NULL, false);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        spice_warning("epoll_create1 failed: %s", strerror(errno));
+        return false;
+    }
+
+    source = g_source_new(&epoll_loop_funcs, sizeof(EpollLoop));
+    loop = SPICE_CONTAINEROF(source, EpollLoop, source);
+    loop->poll_fd.fd = epoll_fd;
+    loop->poll_fd.events = G_IO_IN;
+    loop->timers = g_sequence_new(NULL);
+    g_source_add_poll(source, &loop->poll_fd);
+    g_source_attach(source, core->main_context);
+    /* the context keeps the source until it is freed */
+    g_source_unref(source);
+
+    core->timer_add = epoll_timer_add;
+    core->timer_start = epoll_timer_start;
+    core->timer_cancel = epoll_timer_cancel;
+    core->timer_remove = epoll_timer_remove;
+    core->watch_add = epoll_watch_add;
+    core->watch_update_mask = epoll_watch_update_mask;
+    core->watch_remove = epoll_watch_remove;
+    core->epoll_loop = loop;
+
+    return true;
+}
+#else
+bool event_loop_core_use_epoll(SpiceCoreInterfaceInternal *core)
+{
+    return false;
+}
+#endif
@@ -0,0 +1,458 @@
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "gl-stream.h"
+#include "dcc-private.h"
+#include "display-channel-private.h"
+#include "main-dispatcher.h"
+#include "reds.h"
+
+#define DRM_FOURCC(a, b, c, d) \
+    ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+#define DRM_FORMAT_XRGB8888 DRM_FOURCC('X', 'R', '2', '4')
+#define DRM_FORMAT_ARGB8888 DRM_FOURCC('A', 'R', '2', '4')
+
+/* the drawn areas up to 1/GL_STREAM_IMAGE_MAX_AREA_RATIO of the frame are
+ * sent as images, a blinking cursor should not cost a video frame */
+#define GL_STREAM_IMAGE_MAX_AREA_RATIO 16
+
+bool red_scanout_map_init(RedScanoutMap *map, const SpiceMsgDisplayGlScanoutUnix *scanout)
+{
+    off_t size;
+    void *data;
+
+    memset(map, 0, sizeof(*map));
+
+    switch (scanout->drm_fourcc_format) {
+    case DRM_FORMAT_XRGB8888:
+        map->format = SPICE_BITMAP_FMT_32BIT;
+        break;
+    case DRM_FORMAT_ARGB8888:
+        map->format = SPICE_BITMAP_FMT_RGBA;
+        break;
+    default:
+        spice_warning("unsupported scanout format 0x%x", scanout->drm_fourcc_format);
+        return false;
+    }
+    if (scanout->stride < scanout->width * 4) {
+        spice_warning("invalid scanout stride %u", scanout->stride);
+        return false;
+    }
+
+    /* the size of a dmabuf can only be queried by seeking */
+    size = lseek(scanout->drm_dma_buf_fd, 0, SEEK_END);
+    if (size < 0 || (uint64_t)size < (uint64_t)scanout->stride * scanout->height) {
+        spice_warning("scanout buffer too small");
+        return false;
+    }
+
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, scanout->drm_dma_buf_fd, 0);
+    if (data == MAP_FAILED) {
+        spice_warning("failed to map the scanout, %s", strerror(errno));
+        return false;
+    }
+
+    map->data = data;
+    map->size = size;
+    map->width = scanout->width;
+    map->height = scanout->height;
+    map->stride = scanout->stride;
+    map->top_down = !!(scanout->flags & SPICE_GL_SCANOUT_FLAGS_Y0TOP);
+    return true;
+}
+
+void red_scanout_map_destroy(RedScanoutMap *map)
+{
+    if (map->data) {
+        munmap(map->data, map->size);
+        map->data = NULL;
+    }
+}
+
+RedGlFrame *red_gl_frame_new(const RedScanoutMap *map, uint32_t mm_time)
+{
+    RedGlFrame *frame;
+    uint32_t line_size = map->width * 4;
+    uint32_t y;
+
+    spice_return_val_if_fail(red_scanout_map_is_mapped(map), NULL);
+
+    frame = spice_new0(RedGlFrame, 1);
+    frame->refs = 1;
+    frame->width = map->width;
+    frame->height = map->height;
+    frame->stride = line_size;
+    frame->format = map->format;
+    frame->top_down = map->top_down;
+    frame->mm_time = mm_time;
+    frame->data = spice_malloc_n(frame->height, line_size);
+    for (y = 0; y < frame->height; y++) {
+        memcpy(frame->data + y * line_size, map->data + y * map->stride, line_size);
+    }
+    frame->chunks = spice_chunks_new_linear(frame->data, frame->height * line_size);
+
+    return frame;
+}
+
+RedGlFrame *red_gl_frame_ref(RedGlFrame *frame)
+{
+    frame->refs++;
+    return frame;
+}
+
+void red_gl_frame_unref(RedGlFrame *frame)
+{
+    if (--frame->refs) {
+        return;
+    }
+    spice_chunks_destroy(frame->chunks);
+    free(frame->data);
+    free(frame);
+}
+
+void red_gl_frame_get_bitmap(RedGlFrame *frame, SpiceBitmap *bitmap)
+{
+    memset(bitmap, 0, sizeof(*bitmap));
+    bitmap->format = frame->format;
+    bitmap->flags = frame->top_down ? SPICE_BITMAP_FLAGS_TOP_DOWN : 0;
+    bitmap->x = frame->width;
+    bitmap->y = frame->height;
+    bitmap->stride = frame->stride;
+    bitmap->data = frame->chunks;
+}
+
+RedImageItem *red_scanout_map_get_image_item(const RedScanoutMap *map, const SpiceRect *area)
+{
+    SpiceRect bounds = { 0, 0, map->width, map->height };
+    SpiceRect rect = *area;
+    RedImageItem *item;
+    int width, height, y;
+
+    spice_return_val_if_fail(red_scanout_map_is_mapped(map), NULL);
+
+    rect_sect(&rect, &bounds);
+    if (rect_is_empty(&rect)) {
+        return NULL;
+    }
+    width = rect.right - rect.left;
+    height = rect.bottom - rect.top;
+
+    item = (RedImageItem *)spice_malloc_n_m(height, width * 4, sizeof(RedImageItem));
+    red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_IMAGE);
+    item->surface_id = 0;
+    item->image_format = map->format;
+    item->image_flags = 0;
+    item->pos.x = rect.left;
+    item->pos.y = rect.top;
+    item->width = width;
+    item->height = height;
+    item->stride = width * 4;
+    item->top_down = TRUE;
+    item->can_lossy = FALSE;
+
+    for (y = 0; y < height; y++) {
+        uint32_t line = map->top_down ? rect.top + y : map->height - 1 - (rect.top + y);
+
+        memcpy(item->data + y * item->stride,
+               map->data + line * map->stride + rect.left * 4, item->stride);
+    }
+
+    return item;
+}
+
+static void gl_frame_ref(gpointer data)
+{
+    red_gl_frame_ref(data);
+}
+
+static void gl_frame_unref(gpointer data)
+{
+    red_gl_frame_unref(data);
+}
+
+static uint32_t gl_stream_get_roundtrip_ms(void *opaque)
+{
+    return dcc_get_stream_roundtrip_ms(opaque);
+}
+
+static uint32_t gl_stream_get_source_fps(void *opaque)
+{
+    return MAX_FPS;
+}
+
+static void gl_stream_update_client_playback_delay(void *opaque, uint32_t delay_ms)
+{
+    DisplayChannelClient *dcc = opaque;
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+    RedsState *reds = red_channel_get_server(red_channel_client_get_channel(rcc));
+
+    if (delay_ms > dcc_get_max_stream_latency(dcc)) {
+        dcc_set_max_stream_latency(dcc, delay_ms);
+    }
+    main_dispatcher_set_mm_time_latency(reds_get_main_dispatcher(reds),
+                                        red_channel_client_get_client(rcc),
+                                        dcc_get_max_stream_latency(dcc));
+}
+
+static void gl_stream_idle_timer(void *opaque)
+{
+    DisplayChannelClient *dcc = opaque;
+
+    dcc->priv->gl_stream.frames_count = 0;
+    dcc_gl_stream_stop(dcc, true);
+    red_channel_client_push(RED_CHANNEL_CLIENT(dcc));
+}
+
+static bool dcc_gl_stream_start(DisplayChannelClient *dcc, const RedScanoutMap *map)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    VideoEncoderRateControlCbs video_cbs;
+    RedGlStreamCreateItem *item;
+    RedSurface *primary;
+    VideoEncoder *encoder;
+
+    /* the stream is shown on the primary surface */
+    if (!display_channel_get_surface_canvas(display, 0)) {
+        return false;
+    }
+    primary = display_channel_get_surface(display, 0);
+
+    video_cbs.opaque = dcc;
+    video_cbs.get_roundtrip_ms = gl_stream_get_roundtrip_ms;
+    video_cbs.get_source_fps = gl_stream_get_source_fps;
+    video_cbs.update_client_playback_delay = gl_stream_update_client_playback_delay;
+
+    encoder = dcc_create_video_encoder(dcc,
+                                       RED_STREAM_CHANNEL_CAPACITY * dcc_get_stream_base_bit_rate(dcc),
+                                       &video_cbs, gl_frame_ref, gl_frame_unref);
+    if (!encoder) {
+        return false;
+    }
+    dcc->priv->gl_stream.encoder = encoder;
+    if (!dcc->priv->gl_stream.idle_timer) {
+        SpiceCoreInterfaceInternal *core =
+            red_channel_get_core_interface(RED_CHANNEL(display));
+
+        dcc->priv->gl_stream.idle_timer = red_timer_new(core->timer_wheel,
+                                                        gl_stream_idle_timer, dcc);
+    }
+
+    item = spice_new0(RedGlStreamCreateItem, 1);
+    red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_GL_STREAM_CREATE);
+    item->codec_type = encoder->codec_type;
+    item->width = map->width;
+    item->height = map->height;
+    item->top_down = map->top_down;
+    item->dest.right = primary->context.width;
+    item->dest.bottom = primary->context.height;
+    red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &item->base);
+
+    return true;
+}
+
+void dcc_gl_stream_stop(DisplayChannelClient *dcc, bool notify_client)
+{
+    if (!dcc->priv->gl_stream.encoder) {
+        return;
+    }
+
+    dcc->priv->gl_stream.encoder->destroy(dcc->priv->gl_stream.encoder);
+    dcc->priv->gl_stream.encoder = NULL;
+    red_timer_cancel(dcc->priv->gl_stream.idle_timer);
+    /* the next frames go after the stream destruction */
+    dcc->priv->gl_stream.queued_frame = NULL;
+    if (notify_client) {
+        red_channel_client_pipe_add_type(RED_CHANNEL_CLIENT(dcc),
+                                         RED_PIPE_ITEM_TYPE_GL_STREAM_DESTROY);
+    }
+}
+
+/* whether the scanout can be drawn as is on the primary surface */
+static bool gl_scanout_fits_primary(DisplayChannel *display, const RedScanoutMap *map)
+{
+    RedSurface *primary;
+
+    if (!display_channel_get_surface_canvas(display, 0)) {
+        return false;
+    }
+    primary = display_channel_get_surface(display, 0);
+    return primary->context.width == map->width &&
+           primary->context.height == map->height;
+}
+
+static bool gl_stream_wants_video(DisplayChannelClient *dcc, const RedScanoutMap *map,
+                                  const SpiceRect *damage)
+{
+    RedGlStream *stream = &dcc->priv->gl_stream;
+    uint64_t frame_area = (uint64_t)map->width * map->height;
+
+    return stream->frames_count >= RED_STREAM_FRAMES_START_CONDITION ||
+           rect_get_area(damage) * GL_STREAM_IMAGE_MAX_AREA_RATIO > frame_area ||
+           !gl_scanout_fits_primary(DCC_TO_DC(dcc), map);
+}
+
+/* the scanout the item was queued for, NULL if it changed since */
+static RedScanoutMap *gl_stream_frame_item_get_map(RedGlStreamFrameItem *item)
+{
+    RedScanoutMap *map = &DCC_TO_DC(item->dcc)->priv->scanout_map;
+
+    if (!red_scanout_map_is_mapped(map) ||
+        map->width != item->width || map->height != item->height) {
+        return NULL;
+    }
+    return map;
+}
+
+RedGlFrame *red_gl_stream_frame_item_get_frame(RedGlStreamFrameItem *item)
+{
+    RedScanoutMap *map;
+
+    if (!item->frame && (map = gl_stream_frame_item_get_map(item))) {
+        item->frame = red_gl_frame_new(map, item->mm_time);
+    }
+    return item->frame;
+}
+
+RedImageItem *red_gl_stream_frame_item_get_image(RedGlStreamFrameItem *item)
+{
+    RedScanoutMap *map;
+
+    if (!item->image && (map = gl_stream_frame_item_get_map(item))) {
+        item->image = red_scanout_map_get_image_item(map, &item->damage);
+    }
+    return item->image;
+}
+
+static void red_gl_stream_frame_item_free(RedPipeItem *base)
+{
+    RedGlStreamFrameItem *item = SPICE_UPCAST(RedGlStreamFrameItem, base);
+
+    if (item->dcc->priv->gl_stream.queued_frame == item) {
+        item->dcc->priv->gl_stream.queued_frame = NULL;
+    }
+    if (item->frame) {
+        red_gl_frame_unref(item->frame);
+    }
+    if (item->image) {
+        red_pipe_item_unref(&item->image->base);
+    }
+    free(item);
+}
+
+void dcc_gl_stream_push_frame(DisplayChannelClient *dcc, const RedScanoutMap *map,
+                              const SpiceRect *draw_damage, uint32_t mm_time,
+                              RedGlFrame **frame)
+{
+    RedGlStream *stream = &dcc->priv->gl_stream;
+    RedGlStreamFrameItem *item;
+    SpiceRect damage = *draw_damage;
+    red_time_t now = spice_get_monotonic_time_ns();
+    bool video;
+
+    if (stream->width != map->width || stream->height != map->height ||
+        stream->top_down != map->top_down) {
+        /* the client has nothing of this scanout yet, a frame queued for
+         * the previous one is skipped when it is sent */
+        dcc_gl_stream_stop(dcc, true);
+        stream->queued_frame = NULL;
+        stream->width = map->width;
+        stream->height = map->height;
+        stream->top_down = map->top_down;
+        stream->frames_count = 0;
+        damage.left = 0;
+        damage.top = 0;
+        damage.right = map->width;
+        damage.bottom = map->height;
+    } else if (now - stream->last_frame_time <= RED_STREAM_DETECTION_MAX_DELTA) {
+        stream->frames_count++;
+    } else {
+        if (now - stream->last_frame_time > RED_STREAM_TIMEOUT) {
+            dcc_gl_stream_stop(dcc, true);
+        }
+        stream->frames_count = 0;
+    }
+    stream->last_frame_time = now;
+
+    video = gl_stream_wants_video(dcc, map, &damage);
+    if (video && !stream->encoder && dcc_gl_stream_start(dcc, map)) {
+        /* the frames already queued go before the stream creation */
+        stream->queued_frame = NULL;
+    }
+    if (!stream->encoder && !gl_scanout_fits_primary(DCC_TO_DC(dcc), map)) {
+        /* the frame is dropped, the next one is sent whole */
+        stream->width = 0;
+        return;
+    }
+    if (stream->encoder) {
+        red_timer_start(stream->idle_timer, RED_STREAM_TIMEOUT / NSEC_PER_MILLISEC);
+    }
+    /* the small and sparse draws are sent as images even when the client
+     * has a stream */
+    video = video && stream->encoder != NULL;
+
+    /* the client is late, it gets the newer frame and all the areas drawn
+     * since it got the last one, as long as it goes the same way (an image
+     * must not absorb the damage of the frames meant for the encoder).
+     * The scanout is not copied for it now, it is when the frame is sent */
+    item = stream->queued_frame;
+    if (item && item->video == video) {
+        rect_union(&item->damage, &damage);
+        item->mm_time = mm_time;
+        if (item->video) {
+            if (item->frame) {
+                red_gl_frame_unref(item->frame);
+                item->frame = NULL;
+            }
+            stream->encoder->notify_server_frame_drop(stream->encoder);
+        } else if (item->image) {
+            red_pipe_item_unref(&item->image->base);
+            item->image = NULL;
+        }
+        return;
+    }
+
+    item = spice_new0(RedGlStreamFrameItem, 1);
+    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_GL_STREAM_FRAME,
+                            red_gl_stream_frame_item_free);
+    item->dcc = dcc;
+    item->width = map->width;
+    item->height = map->height;
+    item->damage = damage;
+    item->mm_time = mm_time;
+    item->video = video;
+    if (video) {
+        /* the whole scanout is copied once for all the clients */
+        if (!*frame) {
+            *frame = red_gl_frame_new(map, mm_time);
+        }
+        item->frame = red_gl_frame_ref(*frame);
+    } else {
+        /* only the drawn area is copied, straight from the scanout */
+        item->image = red_scanout_map_get_image_item(map, &damage);
+    }
+    stream->queued_frame = item;
+    red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &item->base);
+}
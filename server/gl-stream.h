@@ -0,0 +1,137 @@
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GL_STREAM_H_
+#define GL_STREAM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <common/draw.h>
+#include <common/messages.h>
+
+#include "dcc.h"
+#include "display-limits.h"
+#include "timer-wheel.h"
+#include "utils.h"
+#include "video-encoder.h"
+
+/*
+ * Streaming of the GL scanout to the clients which cannot import its
+ * dmabuf, that is the remote ones: the scanout is mapped and read after
+ * each draw. The area drawn since the client got its last frame is copied
+ * and sent as an image when it is small, the whole scanout is copied and
+ * fed to a video encoder when the drawn areas are large or frequent.
+ */
+
+/* the GL stream uses the id following the ones of the regular streams */
+#define GL_STREAM_ID NUM_STREAMS
+
+/* A CPU mapping of a GL scanout */
+typedef struct RedScanoutMap {
+    uint8_t *data; /* NULL if not mapped */
+    size_t size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    SpiceBitmapFmt format;
+    bool top_down;
+} RedScanoutMap;
+
+bool red_scanout_map_init(RedScanoutMap *map, const SpiceMsgDisplayGlScanoutUnix *scanout);
+void red_scanout_map_destroy(RedScanoutMap *map);
+/* an image of the @area of the scanout, to be drawn on the primary
+ * surface, NULL if @area is outside of the scanout */
+RedImageItem *red_scanout_map_get_image_item(const RedScanoutMap *map, const SpiceRect *area);
+
+static inline bool red_scanout_map_is_mapped(const RedScanoutMap *map)
+{
+    return map->data != NULL;
+}
+
+/* A copy of the scanout after a draw, shared by the clients streaming it */
+typedef struct RedGlFrame {
+    int refs;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    SpiceBitmapFmt format;
+    bool top_down;
+    uint32_t mm_time;
+    SpiceChunks *chunks;
+    uint8_t *data;
+} RedGlFrame;
+
+RedGlFrame *red_gl_frame_new(const RedScanoutMap *map, uint32_t mm_time);
+RedGlFrame *red_gl_frame_ref(RedGlFrame *frame);
+void red_gl_frame_unref(RedGlFrame *frame);
+void red_gl_frame_get_bitmap(RedGlFrame *frame, SpiceBitmap *bitmap);
+
+typedef struct RedGlStreamCreateItem {
+    RedPipeItem base;
+    SpiceVideoCodecType codec_type;
+    uint32_t width;
+    uint32_t height;
+    bool top_down;
+    SpiceRect dest;
+} RedGlStreamCreateItem;
+
+typedef struct RedGlStreamFrameItem {
+    RedPipeItem base;
+    DisplayChannelClient *dcc;
+    uint32_t width; /* of the scanout */
+    uint32_t height;
+    /* the copies of the scanout are made when the frame is queued, or
+     * when it is sent if the client was late and the frame was merged */
+    RedGlFrame *frame; /* for the video encoder */
+    RedImageItem *image; /* otherwise, the damage */
+    SpiceRect damage; /* the areas drawn since the client got a frame, top line first */
+    uint32_t mm_time;
+    bool video; /* whether the frame goes to the video encoder */
+} RedGlStreamFrameItem;
+
+/* The GL stream of a client */
+typedef struct RedGlStream {
+    VideoEncoder *encoder; /* NULL while the frames are sent as images */
+    /* the frames the client has */
+    uint32_t width;
+    uint32_t height;
+    bool top_down;
+    RedGlStreamFrameItem *queued_frame; /* the frame waiting in the pipe */
+    red_time_t last_frame_time;
+    /* the frames following each other closely enough to be a video */
+    uint32_t frames_count;
+    RedTimer *idle_timer; /* drops the encoder once the guest stops drawing */
+} RedGlStream;
+
+/* queues a frame for the client after the guest drew @damage on the
+ * scanout, merging it with the frame still waiting in the pipe if any.
+ * Small draws are copied from @map as images. The whole scanout is copied
+ * in *@frame, shared by the clients, only when a frame goes to the video
+ * encoder */
+void dcc_gl_stream_push_frame(DisplayChannelClient *dcc, const RedScanoutMap *map,
+                              const SpiceRect *damage, uint32_t mm_time,
+                              RedGlFrame **frame);
+/* the frame of a video item, copied from the current scanout if the copy
+ * was skipped, NULL if the scanout changed since */
+RedGlFrame *red_gl_stream_frame_item_get_frame(RedGlStreamFrameItem *item);
+/* the same for the image of the damage of an item, also NULL if the
+ * damage is outside of the scanout */
+RedImageItem *red_gl_stream_frame_item_get_image(RedGlStreamFrameItem *item);
+/* drops the stream, the client is told to destroy it if @notify_client */
+void dcc_gl_stream_stop(DisplayChannelClient *dcc, bool notify_client);
+
+#endif /* GL_STREAM_H_ */
@@ -19,6 +19,7 @@
 #endif
 
 #include "inputs-channel-client.h"
+#include "main-channel.h"
 #include "migration-protocol.h"
 #include "red-channel-client.h"
 
@@ -30,13 +31,12 @@ G_DEFINE_TYPE(InputsChannelClient, inputs_channel_client, RED_TYPE_CHANNEL_CLIEN
 // TODO: RECEIVE_BUF_SIZE used to be the same for inputs_channel and main_channel
 // since it was defined once in reds.c which contained both.
 // Now that they are split we can give a more fitting value for inputs - what
-// should it be?
-#define REDS_AGENT_WINDOW_SIZE 10
-#define REDS_NUM_INTERNAL_AGENT_MESSAGES 1
+// should it be? It keeps the size of the smaller agent window for now.
 
 // approximate max receive message size
 #define RECEIVE_BUF_SIZE \
-    (4096 + (REDS_AGENT_WINDOW_SIZE + REDS_NUM_INTERNAL_AGENT_MESSAGES) * SPICE_AGENT_MAX_DATA_SIZE)
+    (4096 + (REDS_AGENT_MIGRATION_WINDOW_SIZE + REDS_NUM_INTERNAL_AGENT_MESSAGES) * \
+     SPICE_AGENT_MAX_DATA_SIZE)
 
 struct InputsChannelClientPrivate
 {
@@ -53,6 +53,22 @@ struct InputsChannel
     SpiceKbdInstance *keyboard;
     SpiceMouseInstance *mouse;
     SpiceTabletInstance *tablet;
+
+    /* The mouse motions received together are delivered as one, the
+     * device only needs the latest position. Any other event delivers
+     * them first so the order is kept. */
+    uint16_t pending_motion_type; /* 0 if no motion is pending */
+    union {
+        SpiceMsgcMouseMotion motion;
+        SpiceMsgcMousePosition position;
+    } pending_motion;
+    red_time_t pending_motion_time; /* when the first of them was received */
+
+    RedStatCounter events_counter;
+    RedStatCounter coalesced_motions_counter;
+    /* the total time between the events reception and their delivery,
+     * in microseconds */
+    RedStatCounter events_latency_counter;
 };
 
 struct InputsChannelClass
@@ -243,6 +259,113 @@ static void inputs_channel_send_item(RedChannelClient *rcc, RedPipeItem *base)
     red_channel_client_begin_send_message(rcc);
 }
 
+static void inputs_channel_event_delivered(InputsChannel *inputs, red_time_t recv_time)
+{
+    stat_inc_counter(inputs->events_counter, 1);
+    stat_inc_counter(inputs->events_latency_counter,
+                     (spice_get_monotonic_time_ns() - recv_time) / NSEC_PER_MICROSEC);
+}
+
+static void inputs_channel_deliver_motion(InputsChannel *inputs, SpiceMsgcMouseMotion *mouse_motion)
+{
+    SpiceMouseInstance *mouse = inputs_channel_get_mouse(inputs);
+    SpiceMouseInterface *sif;
+
+    sif = SPICE_CONTAINEROF(mouse->base.sif, SpiceMouseInterface, base);
+    sif->motion(mouse,
+                mouse_motion->dx, mouse_motion->dy, 0,
+                RED_MOUSE_STATE_TO_LOCAL(mouse_motion->buttons_state));
+}
+
+static void inputs_channel_deliver_position(InputsChannel *inputs, SpiceMsgcMousePosition *pos)
+{
+    RedsState *reds = red_channel_get_server(RED_CHANNEL(inputs));
+    SpiceTabletInstance *tablet = inputs_channel_get_tablet(inputs);
+
+    spice_assert((reds_config_get_agent_mouse(reds) && reds_has_vdagent(reds)) || tablet);
+    if (!reds_config_get_agent_mouse(reds) || !reds_has_vdagent(reds)) {
+        SpiceTabletInterface *sif;
+        sif = SPICE_CONTAINEROF(tablet->base.sif, SpiceTabletInterface, base);
+        sif->position(tablet, pos->x, pos->y, RED_MOUSE_STATE_TO_LOCAL(pos->buttons_state));
+        return;
+    }
+    VDAgentMouseState *mouse_state = &inputs->mouse_state;
+    mouse_state->x = pos->x;
+    mouse_state->y = pos->y;
+    mouse_state->buttons = RED_MOUSE_BUTTON_STATE_TO_AGENT(pos->buttons_state);
+    mouse_state->display_id = pos->display_id;
+    reds_handle_agent_mouse_event(reds, mouse_state);
+}
+
+static void inputs_channel_flush_motion(InputsChannel *inputs)
+{
+    RedsState *reds = red_channel_get_server(RED_CHANNEL(inputs));
+    uint16_t type = inputs->pending_motion_type;
+
+    if (!type) {
+        return;
+    }
+    inputs->pending_motion_type = 0;
+
+    /* the mouse mode or the devices may have changed since */
+    if (type == SPICE_MSGC_INPUTS_MOUSE_MOTION) {
+        if (!inputs_channel_get_mouse(inputs) ||
+            reds_get_mouse_mode(reds) != SPICE_MOUSE_MODE_SERVER) {
+            return;
+        }
+        inputs_channel_deliver_motion(inputs, &inputs->pending_motion.motion);
+    } else {
+        if (reds_get_mouse_mode(reds) != SPICE_MOUSE_MODE_CLIENT ||
+            (!inputs_channel_get_tablet(inputs) &&
+             !(reds_config_get_agent_mouse(reds) && reds_has_vdagent(reds)))) {
+            return;
+        }
+        inputs_channel_deliver_position(inputs, &inputs->pending_motion.position);
+    }
+    inputs_channel_event_delivered(inputs, inputs->pending_motion_time);
+}
+
+static void inputs_channel_queue_motion(InputsChannel *inputs, uint16_t type,
+                                        void *message, red_time_t recv_time)
+{
+    if (inputs->pending_motion_type == type) {
+        if (type == SPICE_MSGC_INPUTS_MOUSE_MOTION) {
+            SpiceMsgcMouseMotion *motion = message;
+
+            /* the motions are only merged while the buttons do not change */
+            if (motion->buttons_state == inputs->pending_motion.motion.buttons_state) {
+                inputs->pending_motion.motion.dx += motion->dx;
+                inputs->pending_motion.motion.dy += motion->dy;
+                stat_inc_counter(inputs->coalesced_motions_counter, 1);
+                return;
+            }
+        } else {
+            SpiceMsgcMousePosition *pos = message;
+
+            if (pos->buttons_state == inputs->pending_motion.position.buttons_state &&
+                pos->display_id == inputs->pending_motion.position.display_id) {
+                inputs->pending_motion.position = *pos;
+                stat_inc_counter(inputs->coalesced_motions_counter, 1);
+                return;
+            }
+        }
+    }
+
+    inputs_channel_flush_motion(inputs);
+    inputs->pending_motion_type = type;
+    if (type == SPICE_MSGC_INPUTS_MOUSE_MOTION) {
+        inputs->pending_motion.motion = *(SpiceMsgcMouseMotion *)message;
+    } else {
+        inputs->pending_motion.position = *(SpiceMsgcMousePosition *)message;
+    }
+    inputs->pending_motion_time = recv_time;
+}
+
+static void inputs_channel_handle_messages_done(RedChannelClient *rcc)
+{
+    inputs_channel_flush_motion(INPUTS_CHANNEL(red_channel_client_get_channel(rcc)));
+}
+
 static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
                                           uint32_t size, void *message)
 {
@@ -250,6 +373,11 @@ static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
     InputsChannelClient *icc = INPUTS_CHANNEL_CLIENT(rcc);
     uint32_t i;
     RedsState *reds = red_channel_get_server(RED_CHANNEL(inputs_channel));
+    red_time_t recv_time = red_channel_client_get_receive_time(rcc);
+
+    if (type != SPICE_MSGC_INPUTS_MOUSE_MOTION && type != SPICE_MSGC_INPUTS_MOUSE_POSITION) {
+        inputs_channel_flush_motion(inputs_channel);
+    }
 
     switch (type) {
     case SPICE_MSGC_INPUTS_KEY_DOWN: {
@@ -281,40 +409,23 @@ static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
     }
     case SPICE_MSGC_INPUTS_MOUSE_MOTION: {
         SpiceMouseInstance *mouse = inputs_channel_get_mouse(inputs_channel);
-        SpiceMsgcMouseMotion *mouse_motion = message;
 
         inputs_channel_client_on_mouse_motion(icc);
         if (mouse && reds_get_mouse_mode(reds) == SPICE_MOUSE_MODE_SERVER) {
-            SpiceMouseInterface *sif;
-            sif = SPICE_CONTAINEROF(mouse->base.sif, SpiceMouseInterface, base);
-            sif->motion(mouse,
-                        mouse_motion->dx, mouse_motion->dy, 0,
-                        RED_MOUSE_STATE_TO_LOCAL(mouse_motion->buttons_state));
+            inputs_channel_queue_motion(inputs_channel, type, message, recv_time);
         }
-        break;
+        return TRUE;
     }
     case SPICE_MSGC_INPUTS_MOUSE_POSITION: {
-        SpiceMsgcMousePosition *pos = message;
         SpiceTabletInstance *tablet = inputs_channel_get_tablet(inputs_channel);
 
         inputs_channel_client_on_mouse_motion(icc);
         if (reds_get_mouse_mode(reds) != SPICE_MOUSE_MODE_CLIENT) {
-            break;
+            return TRUE;
         }
         spice_assert((reds_config_get_agent_mouse(reds) && reds_has_vdagent(reds)) || tablet);
-        if (!reds_config_get_agent_mouse(reds) || !reds_has_vdagent(reds)) {
-            SpiceTabletInterface *sif;
-            sif = SPICE_CONTAINEROF(tablet->base.sif, SpiceTabletInterface, base);
-            sif->position(tablet, pos->x, pos->y, RED_MOUSE_STATE_TO_LOCAL(pos->buttons_state));
-            break;
-        }
-        VDAgentMouseState *mouse_state = &inputs_channel->mouse_state;
-        mouse_state->x = pos->x;
-        mouse_state->y = pos->y;
-        mouse_state->buttons = RED_MOUSE_BUTTON_STATE_TO_AGENT(pos->buttons_state);
-        mouse_state->display_id = pos->display_id;
-        reds_handle_agent_mouse_event(reds, mouse_state);
-        break;
+        inputs_channel_queue_motion(inputs_channel, type, message, recv_time);
+        return TRUE;
     }
     case SPICE_MSGC_INPUTS_MOUSE_PRESS: {
         SpiceMsgcMousePress *mouse_press = message;
@@ -398,10 +509,11 @@ static bool inputs_channel_handle_message(RedChannelClient *rcc, uint16_t type,
         break;
     }
     case SPICE_MSGC_DISCONNECTING:
-        break;
+        return TRUE;
     default:
         return red_channel_client_handle_message(rcc, type, size, message);
     }
+    inputs_channel_event_delivered(inputs_channel, recv_time);
     return TRUE;
 }
 
@@ -439,6 +551,7 @@ static void inputs_channel_on_disconnect(RedChannelClient *rcc)
     if (!rcc) {
         return;
     }
+    inputs_channel_flush_motion(INPUTS_CHANNEL(red_channel_client_get_channel(rcc)));
     inputs_release_keys(INPUTS_CHANNEL(red_channel_client_get_channel(rcc)));
 }
 
@@ -558,6 +671,14 @@ inputs_channel_constructed(GObject *object)
     red_channel_set_cap(RED_CHANNEL(self), SPICE_INPUTS_CAP_KEY_SCANCODE);
     reds_register_channel(reds, RED_CHANNEL(self));
 
+    red_channel_init_stat_node(RED_CHANNEL(self), NULL, "inputs");
+    stat_init_counter(&self->events_counter, reds,
+                      red_channel_get_stat_node(RED_CHANNEL(self)), "events", TRUE);
+    stat_init_counter(&self->coalesced_motions_counter, reds,
+                      red_channel_get_stat_node(RED_CHANNEL(self)), "coalesced_motions", TRUE);
+    stat_init_counter(&self->events_latency_counter, reds,
+                      red_channel_get_stat_node(RED_CHANNEL(self)), "events_latency_us", TRUE);
+
     self->key_modifiers_timer = reds_core_timer_add(reds, key_modifiers_sender, self);
     if (!self->key_modifiers_timer) {
         spice_error("key modifiers timer create failed");
@@ -592,6 +713,7 @@ inputs_channel_class_init(InputsChannelClass *klass)
 
     channel_class->parser = spice_get_client_channel_parser(SPICE_CHANNEL_INPUTS, NULL);
     channel_class->handle_message = inputs_channel_handle_message;
+    channel_class->handle_messages_done = inputs_channel_handle_messages_done;
 
     /* channel callbacks */
     channel_class->on_disconnect = inputs_channel_on_disconnect;
@@ -27,6 +27,12 @@
 
 typedef struct Lz4Encoder {
     Lz4EncoderUsrContext *usr;
+    /* The stream state and the scratch buffer are kept across images so
+     * that encoding an image does not need any allocation once the
+     * encoder has warmed up. */
+    LZ4_stream_t *stream;
+    uint8_t *compressed_lines;
+    int compressed_lines_size;
 } Lz4Encoder;
 
 Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr)
@@ -38,13 +44,38 @@ Lz4EncoderContext* lz4_encoder_create(Lz4EncoderUsrContext *usr)
 
     enc = spice_new0(Lz4Encoder, 1);
     enc->usr = usr;
+    enc->stream = LZ4_createStream();
+    if (!enc->stream) {
+        free(enc);
+        return NULL;
+    }
 
     return (Lz4EncoderContext*)enc;
 }
 
 void lz4_encoder_destroy(Lz4EncoderContext* encoder)
 {
-    free(encoder);
+    Lz4Encoder *enc = (Lz4Encoder *)encoder;
+
+    if (!enc) {
+        return;
+    }
+    LZ4_freeStream(enc->stream);
+    free(enc->compressed_lines);
+    free(enc);
+}
+
+static int lz4_compress_lines(Lz4Encoder *enc, const uint8_t *in_buf, int in_size,
+                              uint8_t *out_buf, int out_size)
+{
+#ifdef HAVE_LZ4_COMPRESS_FAST_CONTINUE
+    return LZ4_compress_fast_continue(enc->stream, (const char *) in_buf,
+                                      (char *) out_buf, in_size, out_size, 1);
+#else
+    /* out_size is always the compress bound of in_size */
+    return LZ4_compress_continue(enc->stream, (const char *) in_buf,
+                                 (char *) out_buf, in_size);
+#endif
 }
 
 int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
@@ -57,7 +88,11 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
     int in_size, enc_size, out_size, already_copied;
     uint8_t *in_buf, *compressed_lines;
     uint8_t *out_buf = io_ptr;
-    LZ4_stream_t *stream = LZ4_createStream();
+
+    /* The client decodes every image with a fresh stream, so history from
+     * previous images must not be referenced. Chunks of the same image are
+     * still compressed against each other. */
+    LZ4_resetStream(enc->stream);
 
     // Encode direction and format
     *(out_buf++) = top_down ? 1 : 0;
@@ -69,26 +104,39 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
         num_lines = enc->usr->more_lines(enc->usr, &lines);
         if (num_lines <= 0) {
             spice_error("more lines failed");
-            LZ4_freeStream(stream);
             return 0;
         }
         in_buf = lines;
         in_size = stride * num_lines;
         lines += in_size;
         int bound_size = LZ4_compressBound(in_size);
-        compressed_lines = (uint8_t *) malloc(bound_size + 4);
-#ifdef HAVE_LZ4_COMPRESS_FAST_CONTINUE
-        enc_size = LZ4_compress_fast_continue(stream, (const char *) in_buf,
-                                              (char *) compressed_lines + 4, in_size,
-                                              bound_size, 1);
-#else
-        enc_size = LZ4_compress_continue(stream, (const char *) in_buf,
-                                         (char *) compressed_lines + 4, in_size);
-#endif
+
+        if (num_io_bytes >= bound_size + 4) {
+            /* Enough room left in the current output buffer, compress in
+             * place and avoid an extra copy. */
+            enc_size = lz4_compress_lines(enc, in_buf, in_size, out_buf + 4, bound_size);
+            if (enc_size <= 0) {
+                spice_error("compress failed!");
+                return 0;
+            }
+            uint32_t be_size = htonl(enc_size);
+            memcpy(out_buf, &be_size, sizeof(be_size));
+            enc_size += 4;
+            out_size += enc_size;
+            out_buf += enc_size;
+            num_io_bytes -= enc_size;
+            total_lines += num_lines;
+            continue;
+        }
+
+        if (enc->compressed_lines_size < bound_size + 4) {
+            enc->compressed_lines = spice_realloc(enc->compressed_lines, bound_size + 4);
+            enc->compressed_lines_size = bound_size + 4;
+        }
+        compressed_lines = enc->compressed_lines;
+        enc_size = lz4_compress_lines(enc, in_buf, in_size, compressed_lines + 4, bound_size);
         if (enc_size <= 0) {
             spice_error("compress failed!");
-            free(compressed_lines);
-            LZ4_freeStream(stream);
             return 0;
         }
         *((uint32_t *)compressed_lines) = htonl(enc_size);
@@ -102,8 +150,6 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
             num_io_bytes = enc->usr->more_space(enc->usr, &io_ptr);
             if (num_io_bytes <= 0) {
                 spice_error("more space failed");
-                free(compressed_lines);
-                LZ4_freeStream(stream);
                 return 0;
             }
             out_buf = io_ptr;
@@ -112,11 +158,9 @@ int lz4_encode(Lz4EncoderContext *lz4, int height, int stride, uint8_t *io_ptr,
         out_buf += enc_size;
         num_io_bytes -= enc_size;
 
-        free(compressed_lines);
         total_lines += num_lines;
     } while (total_lines < height);
 
-    LZ4_freeStream(stream);
     if (total_lines != height) {
         spice_error("too many lines\n");
         out_size = 0;
@@ -48,6 +48,9 @@ G_DEFINE_TYPE(MainChannelClient, main_channel_client, RED_TYPE_CHANNEL_CLIENT)
 // approximate max receive message size for main channel
 #define MAIN_CHANNEL_RECEIVE_BUF_SIZE \
     (4096 + (REDS_AGENT_WINDOW_SIZE + REDS_NUM_INTERNAL_AGENT_MESSAGES) * SPICE_AGENT_MAX_DATA_SIZE)
+// messages bigger than this, mainly migration data holding queued agent
+// data, are rare and get their own allocation
+#define MAIN_CHANNEL_RECEIVE_INLINE_BUF_SIZE 4096
 
 struct MainChannelClientPrivate {
     uint32_t connection_id;
@@ -62,7 +65,7 @@ struct MainChannelClientPrivate {
     int mig_wait_prev_try_seamless;
     int init_sent;
     int seamless_mig_dst;
-    uint8_t recv_buf[MAIN_CHANNEL_RECEIVE_BUF_SIZE];
+    uint8_t recv_buf[MAIN_CHANNEL_RECEIVE_INLINE_BUF_SIZE];
 };
 
 typedef struct RedPingPipeItem {
@@ -171,9 +174,11 @@ main_channel_client_alloc_msg_rcv_buf(RedChannelClient *rcc,
     if (type == SPICE_MSGC_MAIN_AGENT_DATA) {
         RedChannel *channel = red_channel_client_get_channel(rcc);
         return reds_get_agent_data_buffer(red_channel_get_server(channel), mcc, size);
-    } else if (size > sizeof(mcc->priv->recv_buf)) {
+    } else if (size > MAIN_CHANNEL_RECEIVE_BUF_SIZE) {
         /* message too large, caller will log a message and close the connection */
         return NULL;
+    } else if (size > sizeof(mcc->priv->recv_buf)) {
+        return spice_malloc(size);
     } else {
         return mcc->priv->recv_buf;
     }
@@ -183,9 +188,13 @@ static void
 main_channel_client_release_msg_rcv_buf(RedChannelClient *rcc,
                                         uint16_t type, uint32_t size, uint8_t *msg)
 {
+    MainChannelClient *mcc = MAIN_CHANNEL_CLIENT(rcc);
+
     if (type == SPICE_MSGC_MAIN_AGENT_DATA) {
         RedChannel *channel = red_channel_client_get_channel(rcc);
         reds_release_agent_data_buffer(red_channel_get_server(channel), msg);
+    } else if (msg != mcc->priv->recv_buf) {
+        free(msg);
     }
 }
 
@@ -476,6 +485,7 @@ void main_channel_client_handle_pong(MainChannelClient *mcc, SpiceMsgPing *ping,
 {
     uint64_t roundtrip;
     RedChannelClient* rcc = RED_CHANNEL_CLIENT(mcc);
+    NetEstimator *estimator;
 
     roundtrip = g_get_monotonic_time() - ping->timestamp;
 
@@ -514,6 +524,10 @@ void main_channel_client_handle_pong(MainChannelClient *mcc, SpiceMsgPing *ping,
         mcc->priv->bitrate_per_sec = (uint64_t)(NET_TEST_BYTES * 8) * 1000000
             / (roundtrip - mcc->priv->latency);
         mcc->priv->net_test_stage = NET_TEST_STAGE_COMPLETE;
+        /* seed the continuous estimation of the link */
+        estimator = red_client_get_net_estimator(red_channel_client_get_client(rcc));
+        net_estimator_add_roundtrip(estimator, mcc->priv->latency * NSEC_PER_MICROSEC);
+        net_estimator_add_bitrate(estimator, mcc->priv->bitrate_per_sec);
         spice_printerr("net test: latency %f ms, bitrate %"PRIu64" bps (%f Mbps)%s",
                        (double)mcc->priv->latency / 1000,
                        mcc->priv->bitrate_per_sec,
@@ -625,25 +639,36 @@ MainChannelClient *main_channel_client_create(MainChannel *main_chan, RedClient
     return mcc;
 }
 
+static NetEstimator *main_channel_client_get_net_estimator(MainChannelClient *mcc)
+{
+    return red_client_get_net_estimator(red_channel_client_get_client(RED_CHANNEL_CLIENT(mcc)));
+}
+
 int main_channel_client_is_network_info_initialized(MainChannelClient *mcc)
 {
-    return mcc->priv->net_test_stage == NET_TEST_STAGE_COMPLETE;
+    return net_estimator_get_bitrate_per_sec(main_channel_client_get_net_estimator(mcc)) != 0;
 }
 
 int main_channel_client_is_low_bandwidth(MainChannelClient *mcc)
 {
     // TODO: configurable?
-    return mcc->priv->bitrate_per_sec < 10 * 1024 * 1024;
+    return main_channel_client_get_bitrate_per_sec(mcc) < 10 * 1024 * 1024;
 }
 
 uint64_t main_channel_client_get_bitrate_per_sec(MainChannelClient *mcc)
 {
-    return mcc->priv->bitrate_per_sec;
+    uint64_t bitrate_per_sec;
+
+    bitrate_per_sec = net_estimator_get_bitrate_per_sec(main_channel_client_get_net_estimator(mcc));
+    return bitrate_per_sec ? bitrate_per_sec : mcc->priv->bitrate_per_sec;
 }
 
 uint64_t main_channel_client_get_roundtrip_ms(MainChannelClient *mcc)
 {
-    return mcc->priv->latency / 1000;
+    int64_t roundtrip;
+
+    roundtrip = net_estimator_get_roundtrip(main_channel_client_get_net_estimator(mcc));
+    return roundtrip >= 0 ? roundtrip / NSEC_PER_MILLISEC : mcc->priv->latency / 1000;
 }
 
 void main_channel_client_migrate(RedChannelClient *rcc)
@@ -808,7 +833,7 @@ static void main_channel_marshall_init(RedChannelClient *rcc,
         init.supported_mouse_modes |= SPICE_MOUSE_MODE_CLIENT;
     }
     init.agent_connected = reds_has_vdagent(red_channel_get_server(channel));
-    init.agent_tokens = REDS_AGENT_WINDOW_SIZE;
+    init.agent_tokens = reds_get_agent_window_size(red_channel_get_server(channel));
     init.multi_media_time = item->multi_media_time;
     init.ram_hint = item->ram_hint;
     spice_marshall_msg_main_init(m, &init);
@@ -912,9 +937,10 @@ static void main_channel_marshall_agent_connected(SpiceMarshaller *m,
                                                   RedPipeItem *item)
 {
     SpiceMsgMainAgentConnectedTokens connected;
+    RedChannel *channel = red_channel_client_get_channel(rcc);
 
     red_channel_client_init_send_data(rcc, SPICE_MSG_MAIN_AGENT_CONNECTED_TOKENS);
-    connected.num_tokens = REDS_AGENT_WINDOW_SIZE;
+    connected.num_tokens = reds_get_agent_window_size(red_channel_get_server(channel));
     spice_marshall_msg_main_agent_connected_tokens(m, &connected);
 }
 
@@ -91,8 +91,10 @@ gboolean main_channel_client_migrate_src_complete(MainChannelClient *mcc,
 void main_channel_client_handle_pong(MainChannelClient *mcc, SpiceMsgPing *ping, uint32_t size);
 
 /*
- * return TRUE if network test had been completed successfully.
+ * return TRUE if the bandwidth to the client is known, either from the
+ * network test or from the continuous estimation done by the RedClient.
  * If FALSE, bitrate_per_sec is set to MAX_UINT64 and the roundtrip is set to 0
+ * unless a roundtrip was measured.
  */
 int main_channel_client_is_network_info_initialized(MainChannelClient *mcc);
 int main_channel_client_is_low_bandwidth(MainChannelClient *mcc);
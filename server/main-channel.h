@@ -44,7 +44,16 @@ GType main_channel_get_type(void) G_GNUC_CONST;
 
 // TODO: Defines used to calculate receive buffer size, and also by reds.c
 // other options: is to make a reds_main_consts.h, to duplicate defines.
-#define REDS_AGENT_WINDOW_SIZE 10
+/* Number of agent data messages the client can send without waiting for
+ * tokens, this limits clipboard and file transfers from the client to
+ * REDS_AGENT_WINDOW_SIZE * SPICE_AGENT_MAX_DATA_SIZE bytes per round trip */
+#define REDS_AGENT_WINDOW_SIZE 64
+/* The window is sent to the client as agent tokens and is part of the
+ * seamless migration data of the agent, which the destination restores
+ * assuming it uses the same window. Servers before the larger window used
+ * 10, so this one is used instead when seamless migration is enabled, as
+ * the destination may be such a server. See reds_get_agent_window_size() */
+#define REDS_AGENT_MIGRATION_WINDOW_SIZE 10
 #define REDS_NUM_INTERNAL_AGENT_MESSAGES 1
 
 struct RedsMigSpice {
@@ -148,6 +148,7 @@ enum {
     MAIN_DISPATCHER_MIGRATE_SEAMLESS_DST_COMPLETE,
     MAIN_DISPATCHER_SET_MM_TIME_LATENCY,
     MAIN_DISPATCHER_CLIENT_DISCONNECT,
+    MAIN_DISPATCHER_SSL_HANDSHAKE_DONE,
 
     MAIN_DISPATCHER_NUM_MESSAGES
 };
@@ -170,6 +171,11 @@ typedef struct MainDispatcherClientDisconnectMessage {
     RedClient *client;
 } MainDispatcherClientDisconnectMessage;
 
+typedef struct MainDispatcherSslHandshakeDoneMessage {
+    RedLinkInfo *link;
+    bool success;
+} MainDispatcherSslHandshakeDoneMessage;
+
 /* channel_event - calls core->channel_event, must be done in main thread */
 static void main_dispatcher_self_handle_channel_event(MainDispatcher *self,
                                                       int event,
@@ -234,6 +240,15 @@ static void main_dispatcher_handle_client_disconnect(void *opaque,
     g_object_unref(msg->client);
 }
 
+static void main_dispatcher_handle_ssl_handshake_done(void *opaque,
+                                                      void *payload)
+{
+    MainDispatcher *self = opaque;
+    MainDispatcherSslHandshakeDoneMessage *msg = payload;
+
+    reds_on_ssl_handshake_done(self->priv->reds, msg->link, msg->success);
+}
+
 void main_dispatcher_seamless_migrate_dst_complete(MainDispatcher *self,
                                                    RedClient *client)
 {
@@ -278,6 +293,16 @@ void main_dispatcher_client_disconnect(MainDispatcher *self, RedClient *client)
     }
 }
 
+void main_dispatcher_ssl_handshake_done(MainDispatcher *self, RedLinkInfo *link, bool success)
+{
+    MainDispatcherSslHandshakeDoneMessage msg;
+
+    msg.link = link;
+    msg.success = success;
+    dispatcher_send_message(DISPATCHER(self), MAIN_DISPATCHER_SSL_HANDSHAKE_DONE,
+                            &msg);
+}
+
 static void dispatcher_handle_read(int fd, int event, void *opaque)
 {
     MainDispatcher *self = opaque;
@@ -324,6 +349,9 @@ void main_dispatcher_constructed(GObject *object)
     dispatcher_register_handler(DISPATCHER(self), MAIN_DISPATCHER_CLIENT_DISCONNECT,
                                 main_dispatcher_handle_client_disconnect,
                                 sizeof(MainDispatcherClientDisconnectMessage), 0 /* no ack */);
+    dispatcher_register_handler(DISPATCHER(self), MAIN_DISPATCHER_SSL_HANDSHAKE_DONE,
+                                main_dispatcher_handle_ssl_handshake_done,
+                                sizeof(MainDispatcherSslHandshakeDoneMessage), 0 /* no ack */);
 }
 
 static void main_dispatcher_finalize(GObject *object)
@@ -23,6 +23,8 @@
 #include "dispatcher.h"
 #include "red-channel.h"
 
+typedef struct RedLinkInfo RedLinkInfo;
+
 #define TYPE_MAIN_DISPATCHER main_dispatcher_get_type()
 
 #define MAIN_DISPATCHER(obj) (G_TYPE_CHECK_INSTANCE_CAST((obj), TYPE_MAIN_DISPATCHER, MainDispatcher))
@@ -58,6 +60,9 @@ void main_dispatcher_set_mm_time_latency(MainDispatcher *self, RedClient *client
  * that triggered the client destruction.
  */
 void main_dispatcher_client_disconnect(MainDispatcher *self, RedClient *client);
+/* called from the TLS handshake threads once the handshake of @link
+ * is over, hands @link back to the main loop */
+void main_dispatcher_ssl_handshake_done(MainDispatcher *self, RedLinkInfo *link, bool success);
 
 MainDispatcher* main_dispatcher_new(RedsState *reds, SpiceCoreInterfaceInternal *core);
 
@@ -47,9 +47,8 @@ static void print_memslots(RedMemSlotInfo *info)
     }
 }
 
-/* return 1 if validation successfull, 0 otherwise */
-int memslot_validate_virt(RedMemSlotInfo *info, unsigned long virt, int slot_id,
-                          uint32_t add_size, uint32_t group_id)
+int memslot_validate_virt_full(RedMemSlotInfo *info, unsigned long virt, int slot_id,
+                               uint32_t add_size, uint32_t group_id)
 {
     MemSlot *slot;
 
@@ -85,12 +84,8 @@ unsigned long memslot_max_size_virt(RedMemSlotInfo *info,
     return slot->virt_end_addr - virt;
 }
 
-/*
- * return virtual address if successful, which may be 0.
- * returns 0 and sets error to 1 if an error condition occurs.
- */
-unsigned long memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
-                               int group_id, int *error)
+unsigned long memslot_get_virt_full(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
+                                    int group_id, int *error)
 {
     int slot_id;
     int generation;
@@ -99,14 +94,14 @@ unsigned long memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t
     MemSlot *slot;
 
     *error = 0;
-    if (group_id > info->num_memslots_groups) {
+    if ((uint32_t)group_id >= info->num_memslots_groups) {
         spice_critical("group_id too big");
         *error = 1;
         return 0;
     }
 
     slot_id = memslot_get_id(info, addr);
-    if (slot_id > info->num_memslots) {
+    if (slot_id >= info->num_memslots) {
         print_memslots(info);
         spice_critical("slot_id %d too big, addr=%" PRIx64, slot_id, addr);
         *error = 1;
@@ -132,6 +127,9 @@ unsigned long memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t
         return 0;
     }
 
+    info->last_hits[group_id].tag = addr & info->memslot_tag_mask;
+    info->last_hits[group_id].slot = slot;
+
     return h_virt;
 }
 
@@ -153,6 +151,7 @@ void memslot_info_init(RedMemSlotInfo *info,
     info->internal_groupslot_id = internal_groupslot_id;
 
     info->mem_slots = spice_new(MemSlot *, num_groups);
+    info->last_hits = spice_new0(MemSlotLastHit, num_groups);
 
     for (i = 0; i < num_groups; ++i) {
         info->mem_slots[i] = spice_new0(MemSlot, num_slots);
@@ -164,6 +163,7 @@ void memslot_info_init(RedMemSlotInfo *info,
     info->memslot_gen_mask = ~((QXLPHYSICAL)-1 << info->generation_bits);
     info->memslot_clean_virt_mask = (((QXLPHYSICAL)(-1)) >>
                                        (info->mem_slot_bits + info->generation_bits));
+    info->memslot_tag_mask = ~(uint64_t)info->memslot_clean_virt_mask;
 }
 
 void memslot_info_destroy(RedMemSlotInfo *info)
@@ -174,6 +174,7 @@ void memslot_info_destroy(RedMemSlotInfo *info)
         free(info->mem_slots[i]);
     }
     free(info->mem_slots);
+    free(info->last_hits);
 }
 
 void memslot_info_add_slot(RedMemSlotInfo *info, uint32_t slot_group_id, uint32_t slot_id,
@@ -187,6 +188,8 @@ void memslot_info_add_slot(RedMemSlotInfo *info, uint32_t slot_group_id, uint32_
     info->mem_slots[slot_group_id][slot_id].virt_start_addr = virt_start;
     info->mem_slots[slot_group_id][slot_id].virt_end_addr = virt_end;
     info->mem_slots[slot_group_id][slot_id].generation = generation;
+    /* the generation of the slot changed */
+    info->last_hits[slot_group_id].slot = NULL;
 }
 
 void memslot_info_del_slot(RedMemSlotInfo *info, uint32_t slot_group_id, uint32_t slot_id)
@@ -196,6 +199,7 @@ void memslot_info_del_slot(RedMemSlotInfo *info, uint32_t slot_group_id, uint32_
 
     info->mem_slots[slot_group_id][slot_id].virt_start_addr = 0;
     info->mem_slots[slot_group_id][slot_id].virt_end_addr = 0;
+    info->last_hits[slot_group_id].slot = NULL;
 }
 
 void memslot_info_reset(RedMemSlotInfo *info)
@@ -204,4 +208,5 @@ void memslot_info_reset(RedMemSlotInfo *info)
         for (i = 0; i < info->num_memslots_groups; ++i) {
             memset(info->mem_slots[i], 0, sizeof(MemSlot) * info->num_memslots);
         }
+        memset(info->last_hits, 0, sizeof(MemSlotLastHit) * info->num_memslots_groups);
 }
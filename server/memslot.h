@@ -30,8 +30,17 @@ typedef struct MemSlot {
     long address_delta;
 } MemSlot;
 
+/* The slot the last translated address of a group was in: the following
+ * addresses are most often in the same slot, they skip the slot lookup and
+ * the generation check */
+typedef struct MemSlotLastHit {
+    uint64_t tag; /* the slot id and generation bits of the address */
+    const MemSlot *slot; /* NULL if none */
+} MemSlotLastHit;
+
 typedef struct RedMemSlotInfo {
     MemSlot **mem_slots;
+    MemSlotLastHit *last_hits; /* one per group */
     uint32_t num_memslots_groups;
     uint32_t num_memslots;
     uint8_t mem_slot_bits;
@@ -41,6 +50,7 @@ typedef struct RedMemSlotInfo {
     uint8_t internal_groupslot_id;
     unsigned long memslot_gen_mask;
     unsigned long memslot_clean_virt_mask;
+    uint64_t memslot_tag_mask; /* the slot id and generation bits */
 } RedMemSlotInfo;
 
 static inline int memslot_get_id(RedMemSlotInfo *info, uint64_t addr)
@@ -53,13 +63,57 @@ static inline int memslot_get_generation(RedMemSlotInfo *info, uint64_t addr)
     return (addr >> info->memslot_gen_shift) & info->memslot_gen_mask;
 }
 
-int memslot_validate_virt(RedMemSlotInfo *info, unsigned long virt, int slot_id,
-                          uint32_t add_size, uint32_t group_id);
+/* the complete checks of memslot_validate_virt() and memslot_get_virt(),
+ * which report the errors */
+int memslot_validate_virt_full(RedMemSlotInfo *info, unsigned long virt, int slot_id,
+                               uint32_t add_size, uint32_t group_id);
+unsigned long memslot_get_virt_full(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
+                                    int group_id, int *error);
+
+static inline bool memslot_virt_in_slot(const MemSlot *slot, unsigned long virt,
+                                        uint32_t add_size)
+{
+    return virt + add_size >= virt &&
+           virt >= slot->virt_start_addr && virt + add_size <= slot->virt_end_addr;
+}
+
+/* return 1 if validation successfull, 0 otherwise */
+static inline int memslot_validate_virt(RedMemSlotInfo *info, unsigned long virt, int slot_id,
+                                        uint32_t add_size, uint32_t group_id)
+{
+    if (SPICE_LIKELY(memslot_virt_in_slot(&info->mem_slots[group_id][slot_id], virt, add_size))) {
+        return 1;
+    }
+    return memslot_validate_virt_full(info, virt, slot_id, add_size, group_id);
+}
+
 unsigned long memslot_max_size_virt(RedMemSlotInfo *info,
                                     unsigned long virt, int slot_id,
                                     uint32_t group_id);
-unsigned long memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr, uint32_t add_size,
-                       int group_id, int *error);
+
+/*
+ * return virtual address if successful, which may be 0.
+ * returns 0 and sets error to 1 if an error condition occurs.
+ */
+static inline unsigned long memslot_get_virt(RedMemSlotInfo *info, QXLPHYSICAL addr,
+                                             uint32_t add_size, int group_id, int *error)
+{
+    if (SPICE_LIKELY((uint32_t)group_id < info->num_memslots_groups)) {
+        const MemSlotLastHit *last_hit = &info->last_hits[group_id];
+
+        if (SPICE_LIKELY(last_hit->slot != NULL &&
+                         (addr & info->memslot_tag_mask) == last_hit->tag)) {
+            unsigned long h_virt = (addr & info->memslot_clean_virt_mask) +
+                                   last_hit->slot->address_delta;
+
+            if (SPICE_LIKELY(memslot_virt_in_slot(last_hit->slot, h_virt, add_size))) {
+                *error = 0;
+                return h_virt;
+            }
+        }
+    }
+    return memslot_get_virt_full(info, addr, add_size, group_id, error);
+}
 
 void memslot_info_init(RedMemSlotInfo *info,
                        uint32_t num_groups, uint32_t num_slots,
@@ -0,0 +1,140 @@
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "net-estimator.h"
+
+void net_estimator_init(NetEstimator *estimator)
+{
+    pthread_mutex_init(&estimator->lock, NULL);
+    estimator->bitrate_per_sec = 0;
+    estimator->roundtrip = -1;
+    estimator->min_roundtrip = -1;
+    estimator->period_start = 0;
+    estimator->period_bytes = 0;
+    estimator->period_saturated = false;
+}
+
+void net_estimator_destroy(NetEstimator *estimator)
+{
+    pthread_mutex_destroy(&estimator->lock);
+}
+
+void net_estimator_add_roundtrip(NetEstimator *estimator, int64_t roundtrip)
+{
+    if (roundtrip < 0) {
+        return;
+    }
+    pthread_mutex_lock(&estimator->lock);
+    if (estimator->roundtrip < 0) {
+        estimator->roundtrip = roundtrip;
+        estimator->min_roundtrip = roundtrip;
+    } else {
+        /* same smoothing as TCP's SRTT */
+        estimator->roundtrip = (estimator->roundtrip * 7 + roundtrip) / 8;
+        estimator->min_roundtrip = MIN(estimator->min_roundtrip, roundtrip);
+    }
+    pthread_mutex_unlock(&estimator->lock);
+}
+
+/* lock should be held */
+static void net_estimator_update_bitrate(NetEstimator *estimator, uint64_t bitrate_per_sec)
+{
+    if (estimator->bitrate_per_sec == 0) {
+        estimator->bitrate_per_sec = bitrate_per_sec;
+    } else {
+        estimator->bitrate_per_sec = (estimator->bitrate_per_sec * 3 + bitrate_per_sec) / 4;
+    }
+}
+
+void net_estimator_add_bitrate(NetEstimator *estimator, uint64_t bitrate_per_sec)
+{
+    pthread_mutex_lock(&estimator->lock);
+    net_estimator_update_bitrate(estimator, bitrate_per_sec);
+    pthread_mutex_unlock(&estimator->lock);
+}
+
+void net_estimator_data_sent(NetEstimator *estimator, uint64_t bytes, bool blocked,
+                             red_time_t now)
+{
+    red_time_t elapsed;
+
+    pthread_mutex_lock(&estimator->lock);
+    if (estimator->period_start == 0) {
+        estimator->period_start = now;
+    }
+    estimator->period_bytes += bytes;
+    estimator->period_saturated |= blocked;
+
+    elapsed = now - estimator->period_start;
+    if (elapsed >= 2 * NET_ESTIMATOR_PERIOD_NS) {
+        /* the link was idle for a while, this is not a meaningful sample */
+        estimator->period_start = now;
+        estimator->period_bytes = bytes;
+        estimator->period_saturated = blocked;
+    } else if (elapsed >= NET_ESTIMATOR_PERIOD_NS) {
+        uint64_t bitrate_per_sec = estimator->period_bytes * 8 * 1000000 /
+                                   (elapsed / 1000);
+
+        if (estimator->period_saturated) {
+            net_estimator_update_bitrate(estimator, bitrate_per_sec);
+        } else if (estimator->bitrate_per_sec != 0 &&
+                   bitrate_per_sec > estimator->bitrate_per_sec) {
+            /* the link was not the bottleneck, so we only know it can
+             * do at least that, which is not enough for a first estimation */
+            estimator->bitrate_per_sec = bitrate_per_sec;
+        }
+        estimator->period_start = now;
+        estimator->period_bytes = 0;
+        estimator->period_saturated = false;
+    }
+    pthread_mutex_unlock(&estimator->lock);
+}
+
+uint64_t net_estimator_get_bitrate_per_sec(NetEstimator *estimator)
+{
+    uint64_t ret;
+
+    pthread_mutex_lock(&estimator->lock);
+    ret = estimator->bitrate_per_sec;
+    pthread_mutex_unlock(&estimator->lock);
+    return ret;
+}
+
+int64_t net_estimator_get_roundtrip(NetEstimator *estimator)
+{
+    int64_t ret;
+
+    pthread_mutex_lock(&estimator->lock);
+    ret = estimator->roundtrip;
+    pthread_mutex_unlock(&estimator->lock);
+    return ret;
+}
+
+int64_t net_estimator_get_min_roundtrip(NetEstimator *estimator)
+{
+    int64_t ret;
+
+    pthread_mutex_lock(&estimator->lock);
+    ret = estimator->min_roundtrip;
+    pthread_mutex_unlock(&estimator->lock);
+    return ret;
+}
@@ -0,0 +1,69 @@
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NET_ESTIMATOR_H_
+#define NET_ESTIMATOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "utils.h"
+
+/* length of the periods over which the throughput is sampled */
+#define NET_ESTIMATOR_PERIOD_NS (200 * NSEC_PER_MILLISEC)
+
+/*
+ * Keeps a running estimation of the bandwidth and roundtrip of the link
+ * to a client. It is fed by all the channels of the client, which can live
+ * in different threads:
+ * - the roundtrip from the ping/pong exchanges;
+ * - the bandwidth from the timing of the socket writes. The throughput
+ *   measured over a period during which a write could not complete
+ *   (the link was saturated) is an estimation of the bandwidth, otherwise
+ *   it is only a lower bound.
+ * The one-shot net test done at connection time seeds the estimation.
+ */
+typedef struct NetEstimator {
+    pthread_mutex_t lock;
+
+    uint64_t bitrate_per_sec; /* 0 if unknown */
+    int64_t roundtrip; /* smoothed roundtrip in ns, -1 if unknown */
+    int64_t min_roundtrip;
+
+    red_time_t period_start;
+    uint64_t period_bytes;
+    bool period_saturated;
+} NetEstimator;
+
+void net_estimator_init(NetEstimator *estimator);
+void net_estimator_destroy(NetEstimator *estimator);
+
+void net_estimator_add_roundtrip(NetEstimator *estimator, int64_t roundtrip);
+void net_estimator_add_bitrate(NetEstimator *estimator, uint64_t bitrate_per_sec);
+/* to be called with the result of each socket write, @blocked being true
+ * when the write could not be completed */
+void net_estimator_data_sent(NetEstimator *estimator, uint64_t bytes, bool blocked,
+                             red_time_t now);
+
+/* returns 0 if the bandwidth is unknown */
+uint64_t net_estimator_get_bitrate_per_sec(NetEstimator *estimator);
+/* returns -1 if the roundtrip is unknown */
+int64_t net_estimator_get_roundtrip(NetEstimator *estimator);
+int64_t net_estimator_get_min_roundtrip(NetEstimator *estimator);
+
+#endif /* NET_ESTIMATOR_H_ */
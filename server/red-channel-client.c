@@ -36,6 +36,7 @@
 #include "red-channel-client.h"
 #include "red-client.h"
 #include "glib-compat.h"
+#include "timer-wheel.h"
 
 #define CLIENT_ACK_WINDOW 20
 
@@ -77,7 +78,7 @@ typedef enum {
 typedef struct RedChannelClientLatencyMonitor {
     QosPingState state;
     uint64_t last_pong_time;
-    SpiceTimer *timer;
+    RedTimer *timer;
     uint32_t id;
     bool tcp_nodelay;
     bool warmup_was_sent;
@@ -97,7 +98,7 @@ typedef struct RedChannelClientConnectivityMonitor {
     bool sent_bytes;
     bool received_bytes;
     uint32_t timeout;
-    SpiceTimer *timer;
+    RedTimer *timer;
 } RedChannelClientConnectivityMonitor;
 
 typedef struct OutgoingMessageBuffer {
@@ -162,9 +163,18 @@ struct RedChannelClientPrivate
 
     IncomingMessageBuffer incoming;
     OutgoingMessageBuffer outgoing;
+    /* when the incoming messages being handled started to be read */
+    red_time_t receive_time;
 
     RedStatCounter out_messages;
     RedStatCounter out_bytes;
+
+    /* see RedClient send scheduler */
+    RedClientSendPriority send_priority;
+    bool send_active;
+    bool send_throttled;
+    red_time_t send_throttle_end;
+    RedTimer *send_sched_timer;
 };
 
 static const SpiceDataHeaderOpaque full_header_wrapper;
@@ -223,8 +233,6 @@ typedef struct MarkerPipeItem {
 
 static void red_channel_client_start_ping_timer(RedChannelClient *rcc, uint32_t timeout)
 {
-    SpiceCoreInterfaceInternal *core;
-
     if (!rcc->priv->latency_monitor.timer) {
         return;
     }
@@ -233,14 +241,11 @@ static void red_channel_client_start_ping_timer(RedChannelClient *rcc, uint32_t
     }
     rcc->priv->latency_monitor.state = PING_STATE_TIMER;
 
-    core = red_channel_get_core_interface(rcc->priv->channel);
-    core->timer_start(core, rcc->priv->latency_monitor.timer, timeout);
+    red_timer_start(rcc->priv->latency_monitor.timer, timeout);
 }
 
 static void red_channel_client_cancel_ping_timer(RedChannelClient *rcc)
 {
-    SpiceCoreInterfaceInternal *core;
-
     if (!rcc->priv->latency_monitor.timer) {
         return;
     }
@@ -248,8 +253,7 @@ static void red_channel_client_cancel_ping_timer(RedChannelClient *rcc)
         return;
     }
 
-    core = red_channel_get_core_interface(rcc->priv->channel);
-    core->timer_cancel(core, rcc->priv->latency_monitor.timer);
+    red_timer_cancel(rcc->priv->latency_monitor.timer);
     rcc->priv->latency_monitor.state = PING_STATE_NONE;
 }
 
@@ -269,6 +273,77 @@ static void red_channel_client_restart_ping_timer(RedChannelClient *rcc)
     red_channel_client_start_ping_timer(rcc, timeout);
 }
 
+static void red_channel_client_set_send_active(RedChannelClient *rcc, bool active)
+{
+    if (rcc->priv->send_active == active) {
+        return;
+    }
+    rcc->priv->send_active = active;
+    red_client_send_sched_set_active(rcc->priv->client, rcc->priv->send_priority, active);
+}
+
+static void red_channel_client_update_send_active(RedChannelClient *rcc)
+{
+    red_channel_client_set_send_active(rcc, !red_channel_client_no_item_being_sent(rcc) ||
+                                            !g_queue_is_empty(&rcc->priv->pipe));
+}
+
+static void red_channel_client_end_send_throttle(RedChannelClient *rcc)
+{
+    rcc->priv->send_throttled = false;
+    if (rcc->priv->stream->watch) {
+        SpiceCoreInterfaceInternal *core;
+        core = red_channel_get_core_interface(rcc->priv->channel);
+        core->watch_update_mask(core, rcc->priv->stream->watch,
+                                SPICE_WATCH_EVENT_READ | SPICE_WATCH_EVENT_WRITE);
+    }
+}
+
+static void red_channel_client_send_sched_timer(void *opaque)
+{
+    RedChannelClient *rcc = opaque;
+
+    red_channel_client_end_send_throttle(rcc);
+    red_channel_client_push(rcc);
+}
+
+/* checks with the client send scheduler if this channel client should leave
+ * the link to more important channels for a while */
+static bool red_channel_client_send_throttled(RedChannelClient *rcc)
+{
+    uint32_t delay;
+    red_time_t now;
+
+    if (!rcc->priv->send_sched_timer || g_queue_is_empty(&rcc->priv->pipe)) {
+        return false;
+    }
+    /* the scheduler lock and the clock are only needed when more
+     * important channels have data to send */
+    if (!rcc->priv->send_throttled &&
+        !red_client_send_sched_is_contended(rcc->priv->client, rcc->priv->send_priority)) {
+        return false;
+    }
+    now = spice_get_monotonic_time_ns();
+    if (rcc->priv->send_throttled) {
+        /* the timer does not run while the worker waits for the messages
+         * to be sent (red_channel_wait_all_sent() and the like), the
+         * deadline ends the throttling then */
+        if (now < rcc->priv->send_throttle_end) {
+            return true;
+        }
+        red_timer_cancel(rcc->priv->send_sched_timer);
+        red_channel_client_end_send_throttle(rcc);
+    }
+    delay = red_client_send_sched_get_delay(rcc->priv->client, rcc->priv->send_priority);
+    if (!delay) {
+        return false;
+    }
+    rcc->priv->send_throttled = true;
+    rcc->priv->send_throttle_end = now + delay * NSEC_PER_MILLISEC;
+    red_timer_start(rcc->priv->send_sched_timer, delay);
+    return true;
+}
+
 static void
 red_channel_client_get_property(GObject *object,
                                 guint property_id,
@@ -389,6 +464,10 @@ static void red_channel_client_constructed(GObject *object)
     const RedStatNode *node = red_channel_get_stat_node(channel);
     stat_init_counter(&self->priv->out_messages, reds, node, "out_messages", TRUE);
     stat_init_counter(&self->priv->out_bytes, reds, node, "out_bytes", TRUE);
+
+    uint32_t type;
+    g_object_get(channel, "channel-type", &type, NULL);
+    self->priv->send_priority = red_client_get_channel_send_priority(type);
 }
 
 static void red_channel_client_class_init(RedChannelClientClass *klass)
@@ -471,6 +550,9 @@ static void red_channel_client_data_sent(RedChannelClient *rcc, int n)
         rcc->priv->connectivity_monitor.sent_bytes = true;
     }
     stat_inc_counter(rcc->priv->out_bytes, n);
+    red_client_send_sched_data_sent(rcc->priv->client, rcc->priv->send_priority, n);
+    net_estimator_data_sent(red_client_get_net_estimator(rcc->priv->client), n, false,
+                            spice_get_monotonic_time_ns());
 }
 
 static void red_channel_client_data_read(RedChannelClient *rcc, int n)
@@ -754,7 +836,6 @@ static void red_channel_client_connectivity_timer(void *opaque)
     }
 
     if (is_alive) {
-        SpiceCoreInterfaceInternal *core = red_channel_get_core_interface(rcc->priv->channel);
         monitor->received_bytes = false;
         monitor->sent_bytes = false;
         if (red_channel_client_is_blocked(rcc) || red_channel_client_waiting_for_ack(rcc)) {
@@ -765,8 +846,8 @@ static void red_channel_client_connectivity_timer(void *opaque)
         } else {
              monitor->state = CONNECTIVITY_STATE_CONNECTED;
         }
-        core->timer_start(core, rcc->priv->connectivity_monitor.timer,
-                          rcc->priv->connectivity_monitor.timeout);
+        red_timer_start(rcc->priv->connectivity_monitor.timer,
+                        rcc->priv->connectivity_monitor.timeout);
     } else {
         uint32_t type, id;
         g_object_get(rcc->priv->channel,
@@ -795,8 +876,8 @@ void red_channel_client_start_connectivity_monitoring(RedChannelClient *rcc, uin
      * on this channel.
      */
     if (rcc->priv->latency_monitor.timer == NULL) {
-        rcc->priv->latency_monitor.timer = core->timer_add(
-            core, red_channel_client_ping_timer, rcc);
+        rcc->priv->latency_monitor.timer = red_timer_new(
+            core->timer_wheel, red_channel_client_ping_timer, rcc);
         if (!red_client_during_migrate_at_target(rcc->priv->client)) {
             red_channel_client_start_ping_timer(rcc, PING_TEST_IDLE_NET_TIMEOUT_MS);
         }
@@ -804,12 +885,12 @@ void red_channel_client_start_connectivity_monitoring(RedChannelClient *rcc, uin
     }
     if (rcc->priv->connectivity_monitor.timer == NULL) {
         rcc->priv->connectivity_monitor.state = CONNECTIVITY_STATE_CONNECTED;
-        rcc->priv->connectivity_monitor.timer = core->timer_add(
-            core, red_channel_client_connectivity_timer, rcc);
+        rcc->priv->connectivity_monitor.timer = red_timer_new(
+            core->timer_wheel, red_channel_client_connectivity_timer, rcc);
         rcc->priv->connectivity_monitor.timeout = timeout_ms;
         if (!red_client_during_migrate_at_target(rcc->priv->client)) {
-            core->timer_start(core, rcc->priv->connectivity_monitor.timer,
-                              rcc->priv->connectivity_monitor.timeout);
+            red_timer_start(rcc->priv->connectivity_monitor.timer,
+                            rcc->priv->connectivity_monitor.timeout);
         }
     }
 }
@@ -931,7 +1012,7 @@ static gboolean red_channel_client_initable_init(GInitable *initable,
     if (self->priv->monitor_latency
         && reds_stream_get_family(self->priv->stream) != AF_UNIX) {
         self->priv->latency_monitor.timer =
-            core->timer_add(core, red_channel_client_ping_timer, self);
+            red_timer_new(core->timer_wheel, red_channel_client_ping_timer, self);
 
         if (!red_client_during_migrate_at_target(self->priv->client)) {
             red_channel_client_start_ping_timer(self,
@@ -940,6 +1021,11 @@ static gboolean red_channel_client_initable_init(GInitable *initable,
         self->priv->latency_monitor.roundtrip = -1;
     }
 
+    if (self->priv->send_priority != RED_CLIENT_SEND_PRIORITY_HIGH) {
+        self->priv->send_sched_timer =
+            red_timer_new(core->timer_wheel, red_channel_client_send_sched_timer, self);
+    }
+
     red_channel_add_client(self->priv->channel, self);
     if (!red_client_add_channel(self->priv->client, self, &local_error)) {
         red_channel_remove_client(self->priv->channel, self);
@@ -960,9 +1046,8 @@ static void red_channel_client_seamless_migration_done(RedChannelClient *rcc)
     if (red_client_seamless_migration_done_for_channel(rcc->priv->client)) {
         red_channel_client_start_ping_timer(rcc, PING_TEST_IDLE_NET_TIMEOUT_MS);
         if (rcc->priv->connectivity_monitor.timer) {
-            SpiceCoreInterfaceInternal *core = red_channel_get_core_interface(rcc->priv->channel);
-            core->timer_start(core, rcc->priv->connectivity_monitor.timer,
-                              rcc->priv->connectivity_monitor.timeout);
+            red_timer_start(rcc->priv->connectivity_monitor.timer,
+                            rcc->priv->connectivity_monitor.timeout);
         }
     }
 }
@@ -979,14 +1064,13 @@ bool red_channel_client_is_waiting_for_migrate_data(RedChannelClient *rcc)
 
 void red_channel_client_default_migrate(RedChannelClient *rcc)
 {
-    SpiceCoreInterfaceInternal *core = red_channel_get_core_interface(rcc->priv->channel);
     if (rcc->priv->latency_monitor.timer) {
         red_channel_client_cancel_ping_timer(rcc);
-        core->timer_remove(core, rcc->priv->latency_monitor.timer);
+        red_timer_free(rcc->priv->latency_monitor.timer);
         rcc->priv->latency_monitor.timer = NULL;
     }
     if (rcc->priv->connectivity_monitor.timer) {
-        core->timer_remove(core, rcc->priv->connectivity_monitor.timer);
+        red_timer_free(rcc->priv->connectivity_monitor.timer);
         rcc->priv->connectivity_monitor.timer = NULL;
     }
     red_channel_client_pipe_add_type(rcc, RED_PIPE_ITEM_TYPE_MIGRATE);
@@ -1065,6 +1149,8 @@ static void red_channel_client_handle_outgoing(RedChannelClient *rcc)
             switch (errno) {
             case EAGAIN:
                 red_channel_client_set_blocked(rcc);
+                net_estimator_data_sent(red_client_get_net_estimator(rcc->priv->client), 0, true,
+                                        spice_get_monotonic_time_ns());
                 return;
             case EINTR:
                 continue;
@@ -1250,8 +1336,14 @@ static void red_channel_client_handle_incoming(RedChannelClient *rcc)
 
 void red_channel_client_receive(RedChannelClient *rcc)
 {
+    RedChannelClass *klass = RED_CHANNEL_GET_CLASS(rcc->priv->channel);
+
     g_object_ref(rcc);
+    rcc->priv->receive_time = spice_get_monotonic_time_ns();
     red_channel_client_handle_incoming(rcc);
+    if (klass->handle_messages_done) {
+        klass->handle_messages_done(rcc);
+    }
     g_object_unref(rcc);
 }
 
@@ -1265,7 +1357,8 @@ void red_channel_client_send(RedChannelClient *rcc)
 static inline RedPipeItem *red_channel_client_pipe_item_get(RedChannelClient *rcc)
 {
     if (!rcc || red_channel_client_is_blocked(rcc)
-             || red_channel_client_waiting_for_ack(rcc)) {
+             || red_channel_client_waiting_for_ack(rcc)
+             || red_channel_client_send_throttled(rcc)) {
         return NULL;
     }
     return g_queue_pop_tail(&rcc->priv->pipe);
@@ -1293,13 +1386,16 @@ void red_channel_client_push(RedChannelClient *rcc)
     while ((pipe_item = red_channel_client_pipe_item_get(rcc))) {
         red_channel_client_send_item(rcc, pipe_item);
     }
-    if (red_channel_client_no_item_being_sent(rcc) && g_queue_is_empty(&rcc->priv->pipe)
+    if (((red_channel_client_no_item_being_sent(rcc) && g_queue_is_empty(&rcc->priv->pipe))
+         || rcc->priv->send_throttled)
         && rcc->priv->stream->watch) {
+        /* when throttled, the send scheduler timer will resume sending */
         SpiceCoreInterfaceInternal *core;
         core = red_channel_get_core_interface(rcc->priv->channel);
         core->watch_update_mask(core, rcc->priv->stream->watch,
                                 SPICE_WATCH_EVENT_READ);
     }
+    red_channel_client_update_send_active(rcc);
     rcc->priv->during_send = FALSE;
     g_object_unref(rcc);
 }
@@ -1312,6 +1408,11 @@ int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc)
     return rcc->priv->latency_monitor.roundtrip / NSEC_PER_MILLISEC;
 }
 
+red_time_t red_channel_client_get_receive_time(RedChannelClient *rcc)
+{
+    return rcc->priv->receive_time;
+}
+
 void red_channel_client_init_outgoing_messages_window(RedChannelClient *rcc)
 {
     rcc->priv->ack_data.messages_window = 0;
@@ -1345,6 +1446,11 @@ static void red_channel_client_handle_pong(RedChannelClient *rcc, SpiceMsgPing *
         reds_stream_set_no_delay(rcc->priv->stream, FALSE);
     }
 
+    /* unlike the channel roundtrip below, the client estimation follows
+     * the variations of the link */
+    net_estimator_add_roundtrip(red_client_get_net_estimator(rcc->priv->client),
+                                now - ping->timestamp);
+
     /*
      * The real network latency shouldn't change during the connection. However,
      *  the measurements can be bigger than the real roundtrip due to other
@@ -1517,6 +1623,7 @@ static inline gboolean prepare_pipe_add(RedChannelClient *rcc, RedPipeItem *item
         core->watch_update_mask(core, rcc->priv->stream->watch,
                                 SPICE_WATCH_EVENT_READ | SPICE_WATCH_EVENT_WRITE);
     }
+    red_channel_client_set_send_active(rcc, true);
     return TRUE;
 }
 
@@ -1648,6 +1755,7 @@ static void red_channel_client_pipe_clear(RedChannelClient *rcc)
     while ((item = g_queue_pop_head(&rcc->priv->pipe)) != NULL) {
         red_pipe_item_unref(item);
     }
+    red_channel_client_set_send_active(rcc, false);
 }
 
 void red_channel_client_ack_zero_messages_window(RedChannelClient *rcc)
@@ -1683,13 +1791,18 @@ void red_channel_client_disconnect(RedChannelClient *rcc)
         rcc->priv->stream->watch = NULL;
     }
     if (rcc->priv->latency_monitor.timer) {
-        core->timer_remove(core, rcc->priv->latency_monitor.timer);
+        red_timer_free(rcc->priv->latency_monitor.timer);
         rcc->priv->latency_monitor.timer = NULL;
     }
     if (rcc->priv->connectivity_monitor.timer) {
-        core->timer_remove(core, rcc->priv->connectivity_monitor.timer);
+        red_timer_free(rcc->priv->connectivity_monitor.timer);
         rcc->priv->connectivity_monitor.timer = NULL;
     }
+    if (rcc->priv->send_sched_timer) {
+        red_timer_free(rcc->priv->send_sched_timer);
+        rcc->priv->send_sched_timer = NULL;
+        rcc->priv->send_throttled = false;
+    }
     red_channel_remove_client(channel, rcc);
     red_channel_on_disconnect(channel, rcc);
 }
@@ -1834,6 +1947,7 @@ void red_channel_client_pipe_remove_and_release(RedChannelClient *rcc,
 {
     if (red_channel_client_pipe_remove(rcc, item)) {
         red_pipe_item_unref(item);
+        red_channel_client_update_send_active(rcc);
     }
 }
 
@@ -1844,6 +1958,7 @@ void red_channel_client_pipe_remove_and_release_pos(RedChannelClient *rcc,
 
     g_queue_delete_link(&rcc->priv->pipe, item_pos);
     red_pipe_item_unref(item);
+    red_channel_client_update_send_active(rcc);
 }
 
 /* client mutex should be locked before this call */
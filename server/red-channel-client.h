@@ -85,6 +85,10 @@ SpiceMarshaller *red_channel_client_switch_to_urgent_sender(RedChannelClient *rc
 /* returns -1 if we don't have an estimation */
 int red_channel_client_get_roundtrip_ms(RedChannelClient *rcc);
 
+/* returns the time red_channel_client_receive() started reading the
+ * message being handled, before it was read from the socket and parsed */
+red_time_t red_channel_client_get_receive_time(RedChannelClient *rcc);
+
 /* Checks periodically if the connection is still alive */
 void red_channel_client_start_connectivity_monitoring(RedChannelClient *rcc, uint32_t timeout_ms);
 
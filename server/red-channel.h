@@ -45,6 +45,7 @@ typedef struct MainChannelClient MainChannelClient;
 
 typedef bool (*channel_handle_message_proc)(RedChannelClient *rcc, uint16_t type,
                                             uint32_t size, void *msg);
+typedef void (*channel_handle_messages_done_proc)(RedChannelClient *rcc);
 typedef void (*channel_disconnect_proc)(RedChannelClient *rcc);
 typedef bool (*channel_configure_socket_proc)(RedChannelClient *rcc);
 typedef void (*channel_send_pipe_item_proc)(RedChannelClient *rcc, RedPipeItem *item);
@@ -109,6 +110,9 @@ struct RedChannelClass
      */
     spice_parse_channel_func_t parser;
     channel_handle_message_proc handle_message;
+    /* optional, called once the messages received together were handled,
+     * for the channels which batch their processing */
+    channel_handle_messages_done_proc handle_messages_done;
 
     // TODO: add ASSERTS for thread_id  in client and channel calls
     /*
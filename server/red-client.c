@@ -26,6 +26,36 @@
 #define FOREACH_CHANNEL_CLIENT(_client, _iter, _data) \
     GLIST_FOREACH((_client ? (_client)->channels : NULL), _iter, RedChannelClient, _data)
 
+/* bounds of the accounting window of the send scheduler, the window
+ * follows the roundtrip to the client */
+#define SEND_SCHED_MIN_WINDOW_MS 10
+#define SEND_SCHED_MAX_WINDOW_MS 100
+
+/* percentage of the estimated bandwidth a priority class can use while
+ * channels with a higher priority have data to send */
+static const uint32_t send_sched_share[RED_CLIENT_SEND_PRIORITY_COUNT] = {
+    [RED_CLIENT_SEND_PRIORITY_HIGH] = 100,
+    [RED_CLIENT_SEND_PRIORITY_NORMAL] = 75,
+    [RED_CLIENT_SEND_PRIORITY_BULK] = 20,
+};
+
+/* Arbitrates the bandwidth between the channels of a client.
+ * Channels can live in different threads, so the state is protected
+ * by its own lock. */
+typedef struct RedClientSendScheduler {
+    pthread_mutex_t lock;
+    /* number of channel clients of each class with data to send */
+    uint32_t num_active[RED_CLIENT_SEND_PRIORITY_COUNT];
+    /* bit i is set while class i has data to send, read without the lock
+     * so that a channel alone on the link does not take it */
+    gint active_mask;
+    /* bytes each class can still send in the current window */
+    int64_t budget[RED_CLIENT_SEND_PRIORITY_COUNT];
+    red_time_t last_refill[RED_CLIENT_SEND_PRIORITY_COUNT];
+    /* the budget starts full when higher classes get data to send */
+    bool budget_reset[RED_CLIENT_SEND_PRIORITY_COUNT];
+} RedClientSendScheduler;
+
 struct RedClient {
     GObject parent;
     RedsState *reds;
@@ -46,6 +76,9 @@ struct RedClient {
     int during_target_migrate;
     int seamless_migrate;
     int num_migrated_channels; /* for seamless - number of channels that wait for migrate data*/
+
+    RedClientSendScheduler send_sched;
+    NetEstimator net_estimator;
 };
 
 struct RedClientClass
@@ -110,6 +143,8 @@ red_client_finalize (GObject *object)
 
     spice_debug("release client=%p", self);
     pthread_mutex_destroy(&self->lock);
+    pthread_mutex_destroy(&self->send_sched.lock);
+    net_estimator_destroy(&self->net_estimator);
 
     G_OBJECT_CLASS (red_client_parent_class)->finalize (object);
 }
@@ -142,6 +177,8 @@ static void
 red_client_init (RedClient *self)
 {
     pthread_mutex_init(&self->lock, NULL);
+    pthread_mutex_init(&self->send_sched.lock, NULL);
+    net_estimator_init(&self->net_estimator);
     self->thread_id = pthread_self();
 }
 
@@ -362,3 +399,135 @@ RedsState *red_client_get_server(RedClient *client)
 {
     return client->reds;
 }
+
+NetEstimator *red_client_get_net_estimator(RedClient *client)
+{
+    return &client->net_estimator;
+}
+
+RedClientSendPriority red_client_get_channel_send_priority(uint32_t channel_type)
+{
+    switch (channel_type) {
+    case SPICE_CHANNEL_INPUTS:
+    case SPICE_CHANNEL_CURSOR:
+    case SPICE_CHANNEL_PLAYBACK:
+    case SPICE_CHANNEL_RECORD:
+        return RED_CLIENT_SEND_PRIORITY_HIGH;
+    /* the main channel carries the agent clipboard and file transfers,
+     * a large paste or file drop must not cut the display down */
+    case SPICE_CHANNEL_MAIN:
+    case SPICE_CHANNEL_USBREDIR:
+    case SPICE_CHANNEL_PORT:
+    case SPICE_CHANNEL_WEBDAV:
+        return RED_CLIENT_SEND_PRIORITY_BULK;
+    default:
+        return RED_CLIENT_SEND_PRIORITY_NORMAL;
+    }
+}
+
+void red_client_send_sched_set_active(RedClient *client, RedClientSendPriority prio,
+                                      gboolean active)
+{
+    RedClientSendScheduler *sched = &client->send_sched;
+
+    int mask, i;
+
+    pthread_mutex_lock(&sched->lock);
+    if (active) {
+        sched->num_active[prio]++;
+    } else {
+        spice_assert(sched->num_active[prio] > 0);
+        sched->num_active[prio]--;
+    }
+    mask = 0;
+    for (i = 0; i < RED_CLIENT_SEND_PRIORITY_COUNT; i++) {
+        if (sched->num_active[i]) {
+            mask |= 1 << i;
+        }
+    }
+    if (active && sched->num_active[prio] == 1) {
+        for (i = prio + 1; i < RED_CLIENT_SEND_PRIORITY_COUNT; i++) {
+            sched->budget_reset[i] = true;
+        }
+    }
+    g_atomic_int_set(&sched->active_mask, mask);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+bool red_client_send_sched_is_contended(RedClient *client, RedClientSendPriority prio)
+{
+    return g_atomic_int_get(&client->send_sched.active_mask) & ((1 << prio) - 1);
+}
+
+void red_client_send_sched_data_sent(RedClient *client, RedClientSendPriority prio, size_t n)
+{
+    RedClientSendScheduler *sched = &client->send_sched;
+
+    if (!red_client_send_sched_is_contended(client, prio)) {
+        return;
+    }
+    pthread_mutex_lock(&sched->lock);
+    sched->budget[prio] -= n;
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/* returns the bandwidth (in bytes per second) the class can use when
+ * competing with higher priority channels, 0 if it is unknown */
+static uint64_t red_client_send_sched_get_rate(RedClient *client, RedClientSendPriority prio,
+                                               uint64_t *window_ms)
+{
+    uint64_t bitrate = net_estimator_get_bitrate_per_sec(&client->net_estimator);
+    int64_t roundtrip = net_estimator_get_roundtrip(&client->net_estimator);
+
+    if (roundtrip >= 0) {
+        *window_ms = CLAMP(roundtrip / NSEC_PER_MILLISEC,
+                           SEND_SCHED_MIN_WINDOW_MS, SEND_SCHED_MAX_WINDOW_MS);
+    }
+    return bitrate / 8 * send_sched_share[prio] / 100;
+}
+
+uint32_t red_client_send_sched_get_delay(RedClient *client, RedClientSendPriority prio)
+{
+    RedClientSendScheduler *sched = &client->send_sched;
+    uint64_t rate, window_ms = SEND_SCHED_MIN_WINDOW_MS;
+    int64_t burst;
+    red_time_t now;
+    uint32_t delay = 0;
+    int i;
+
+    /* nothing more important to send, don't hold this channel back */
+    if (!red_client_send_sched_is_contended(client, prio)) {
+        return 0;
+    }
+
+    rate = red_client_send_sched_get_rate(client, prio, &window_ms);
+    burst = rate * window_ms / 1000;
+    now = spice_get_monotonic_time_ns();
+
+    pthread_mutex_lock(&sched->lock);
+    for (i = 0; i < prio; i++) {
+        if (sched->num_active[i]) {
+            break;
+        }
+    }
+    if (i == prio || rate == 0 || sched->budget_reset[prio]) {
+        /* nothing more important to send (or no way to tell how much the
+         * link can take), don't hold this channel back, a class starting
+         * to compete has its whole budget */
+        sched->budget[prio] = burst;
+        sched->budget_reset[prio] = false;
+    } else {
+        red_time_t elapsed = MIN(now - sched->last_refill[prio],
+                                 window_ms * NSEC_PER_MILLISEC);
+        sched->budget[prio] += elapsed * (int64_t)rate / NSEC_PER_SEC;
+        sched->budget[prio] = MIN(sched->budget[prio], burst);
+        if (sched->budget[prio] <= 0) {
+            delay = -sched->budget[prio] * 1000 / (int64_t)rate + 1;
+            delay = MIN(delay, window_ms);
+        }
+    }
+    sched->last_refill[prio] = now;
+    pthread_mutex_unlock(&sched->lock);
+
+    return delay;
+}
@@ -22,6 +22,7 @@
 #include <glib-object.h>
 
 #include "main-channel-client.h"
+#include "net-estimator.h"
 
 G_BEGIN_DECLS
 
@@ -69,6 +70,33 @@ void red_client_migrate(RedClient *client);
 gboolean red_client_is_disconnecting(RedClient *client);
 void red_client_set_disconnecting(RedClient *client);
 RedsState* red_client_get_server(RedClient *client);
+/* bandwidth and roundtrip of the link to the client, updated by all its channels */
+NetEstimator *red_client_get_net_estimator(RedClient *client);
+
+/*
+ * Send scheduler: channel clients of a client share the same link, the
+ * scheduler limits the bandwidth used by less important channels while
+ * channels with a higher priority have data to send.
+ */
+typedef enum {
+    RED_CLIENT_SEND_PRIORITY_HIGH,   /* inputs, cursor, audio */
+    RED_CLIENT_SEND_PRIORITY_NORMAL, /* display, smartcard */
+    RED_CLIENT_SEND_PRIORITY_BULK,   /* main (agent data), usbredir, webdav, ports */
+
+    RED_CLIENT_SEND_PRIORITY_COUNT
+} RedClientSendPriority;
+
+RedClientSendPriority red_client_get_channel_send_priority(uint32_t channel_type);
+/* a channel client of the given class has (or stopped having) data to send */
+void red_client_send_sched_set_active(RedClient *client, RedClientSendPriority prio,
+                                      gboolean active);
+void red_client_send_sched_data_sent(RedClient *client, RedClientSendPriority prio, size_t n);
+/* whether channel clients of a class more important than @prio have data
+ * to send, this does not take the scheduler lock */
+bool red_client_send_sched_is_contended(RedClient *client, RedClientSendPriority prio);
+/* returns 0 if a channel client of the given class can send now, otherwise
+ * the number of milliseconds it should wait before trying again */
+uint32_t red_client_send_sched_get_delay(RedClient *client, RedClientSendPriority prio);
 
 G_END_DECLS
 
@@ -36,12 +36,16 @@
 #include <common/verify.h>
 
 #include "spice.h"
+#include "stat.h"
 #include "utils.h"
 
 #define SPICE_UPCAST(type, ptr) \
     (verify_expr(SPICE_OFFSETOF(type, base) == 0,SPICE_CONTAINEROF(ptr, type, base)))
 
 typedef struct SpiceCoreInterfaceInternal SpiceCoreInterfaceInternal;
+typedef struct EventLoopStats EventLoopStats;
+typedef struct EpollLoop EpollLoop;
+typedef struct RedTimerWheel RedTimerWheel;
 
 struct SpiceCoreInterfaceInternal {
     SpiceTimer *(*timer_add)(const SpiceCoreInterfaceInternal *iface, SpiceTimerFunc func, void *opaque);
@@ -69,12 +73,35 @@ struct SpiceCoreInterfaceInternal {
         GMainContext *main_context;
         SpiceCoreInterface *public_interface;
     };
+
+    /* the dispatch statistics of the timers and watches of event_loop_core,
+     * NULL if they are not collected */
+    EventLoopStats *loop_stats;
+
+    /* the epoll instance of main_context once event_loop_core_use_epoll()
+     * switched to it */
+    EpollLoop *epoll_loop;
+
+    /* the timers of the clients, see timer-wheel.h */
+    RedTimerWheel *timer_wheel;
 };
 
 extern const SpiceCoreInterfaceInternal event_loop_core;
+/* Switches @core, a copy of event_loop_core with its main_context set, to
+ * the epoll variant, which costs less per iteration when there are many
+ * watches. Returns false if epoll is not available.
+ * Must be called before any timer or watch is added. */
+bool event_loop_core_use_epoll(SpiceCoreInterfaceInternal *core);
 
 typedef struct RedsState RedsState;
 
+/* Statistics of an event_loop_core loop, under @parent in the stat tree:
+ * the number of dispatches, the total and the longest run time of each
+ * timer and watch callback and how late the timers run. Only collected
+ * with statistics enabled and SPICE_LOOP_STATS set, NULL otherwise. */
+EventLoopStats *event_loop_stats_new(RedsState *reds, const RedStatNode *parent);
+void event_loop_stats_free(EventLoopStats *stats);
+
 typedef struct GListIter {
     GList *link;
     GList *next;
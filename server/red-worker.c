@@ -47,6 +47,7 @@
 #include "red-worker.h"
 #include "cursor-channel.h"
 #include "tree.h"
+#include "timer-wheel.h"
 
 #define CMD_RING_POLL_TIMEOUT 10 //milli
 #define CMD_RING_POLL_RETRIES 1
@@ -1288,7 +1289,11 @@ static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
 
     worker->event_timeout = INF_EVENT_WAIT;
     worker->was_blocked = FALSE;
-    red_process_cursor(worker, &ring_is_empty);
+    /* the cursor is sent before the display commands are processed, which
+     * can take a while, so the pointer stays responsive */
+    if (red_process_cursor(worker, &ring_is_empty)) {
+        red_channel_push(RED_CHANNEL(worker->cursor_channel));
+    }
     red_process_display(worker, &ring_is_empty);
 
     return TRUE;
@@ -1301,6 +1306,14 @@ static GSourceFuncs worker_source_funcs = {
     .dispatch = worker_source_dispatch,
 };
 
+/* SPICE_EPOLL_LOOP=1 runs the worker loops on epoll */
+static bool use_epoll_loop(void)
+{
+    const char *env_epoll_loop = getenv("SPICE_EPOLL_LOOP");
+
+    return env_epoll_loop != NULL && strcmp(env_epoll_loop, "0") != 0;
+}
+
 RedWorker* red_worker_new(QXLInstance *qxl,
                           const ClientCbs *client_cursor_cbs,
                           const ClientCbs *client_display_cbs)
@@ -1316,6 +1329,9 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     worker = spice_new0(RedWorker, 1);
     worker->core = event_loop_core;
     worker->core.main_context = g_main_context_new();
+    if (use_epoll_loop() && !event_loop_core_use_epoll(&worker->core)) {
+        spice_warning("epoll loop not available, using the GLib one");
+    }
 
     worker->record = reds_get_record(reds);
     dispatcher = red_qxl_get_dispatcher(qxl);
@@ -1336,6 +1352,8 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     stat_init_node(&worker->stat, reds, NULL, worker_str, TRUE);
     stat_init_counter(&worker->wakeup_counter, reds, &worker->stat, "wakeups", TRUE);
     stat_init_counter(&worker->command_counter, reds, &worker->stat, "commands", TRUE);
+    worker->core.loop_stats = event_loop_stats_new(reds, &worker->stat);
+    worker->core.timer_wheel = red_timer_wheel_new(&worker->core);
 
     worker->dispatch_watch =
         worker->core.watch_add(&worker->core, dispatcher_get_recv_fd(dispatcher),
@@ -1450,7 +1468,9 @@ void red_worker_free(RedWorker *worker)
         worker->core.watch_remove(&worker->core, worker->dispatch_watch);
     }
 
+    red_timer_wheel_free(worker->core.timer_wheel);
     g_main_context_unref(worker->core.main_context);
+    event_loop_stats_free(worker->core.loop_stats);
 
     if (worker->record) {
         red_record_unref(worker->record);
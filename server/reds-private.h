@@ -19,6 +19,7 @@
 #ifndef REDS_PRIVATE_H_
 #define REDS_PRIVATE_H_
 
+#include <pthread.h>
 #include <spice/protocol.h>
 #include <spice/stats.h>
 
@@ -27,6 +28,7 @@
 #include "inputs-channel.h"
 #include "stat-file.h"
 #include "red-record-qxl.h"
+#include "av-clock.h"
 
 #define MIGRATE_TIMEOUT (MSEC_PER_SEC * 10)
 #define MM_TIME_DELTA 400 /*ms*/
@@ -81,6 +83,19 @@ typedef struct RedSSLParameters {
 typedef struct RedCharDeviceVDIPort RedCharDeviceVDIPort;
 typedef struct RedServerConfig RedServerConfig;
 
+/* Threads completing the TLS handshakes of the new connections, so
+ * that many clients connecting at once do not stall the main loop. */
+typedef struct RedsSslHandshakePool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    GQueue links; /* RedLinkInfo waiting for a thread */
+    GQueue done; /* RedLinkInfo whose handshake is over, until the main
+                    loop takes them */
+    pthread_t *threads;
+    int num_threads;
+    bool quit;
+} RedsSslHandshakePool;
+
 struct RedsState {
     RedServerConfig *config;
     int listen_socket;
@@ -120,6 +135,8 @@ struct RedsState {
     int seamless_migration_enabled; /* command line arg */
 
     SSL_CTX *ctx;
+    RedsSslHandshakePool *ssl_handshake_pool; /* NULL if the TLS handshakes are done
+                                                 in the main loop */
 
 #ifdef RED_STATISTICS
     RedStatFile *stat_file;
@@ -128,7 +145,7 @@ struct RedsState {
 
     RedsClientMonitorsConfig client_monitors_config;
     int mm_time_enabled;
-    uint32_t mm_time_latency;
+    AVClock av_clock; /* latency of the mm time */
 
     SpiceCharDeviceInstance *vdagent;
     SpiceMigrateInstance *migration_interface;
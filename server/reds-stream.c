@@ -444,6 +444,7 @@ RedsStreamSslStatus reds_stream_ssl_accept(RedsStream *stream)
 
     return_code = SSL_accept(stream->priv->ssl);
     if (return_code == 1) {
+        spice_debug("TLS session %s", SSL_session_reused(stream->priv->ssl) ? "resumed" : "created");
         return REDS_STREAM_SSL_STATUS_OK;
     }
 
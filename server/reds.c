@@ -41,6 +41,7 @@
 
 #include <glib.h>
 #include <sys/un.h>
+#include <poll.h>
 
 #include <spice/protocol.h>
 #include <spice/vd_agent.h>
@@ -74,6 +75,8 @@
 #include "red-client.h"
 #include "glib-compat.h"
 #include "net-utils.h"
+#include "tiled-render.h"
+#include "timer-wheel.h"
 
 #define REDS_MAX_STAT_NODES 100
 
@@ -145,8 +148,13 @@ static const SpiceCoreInterfaceInternal core_interface_adapter = {
 #define REDS_MIG_ABORT 2
 #define REDS_MIG_DIFF_VERSION 3
 
-#define REDS_TOKENS_TO_SEND 5
-#define REDS_VDI_PORT_NUM_RECEIVE_BUFFS 5
+/* tokens are given back to the client once a quarter of the window is used,
+ * or every 5 messages like older servers with their smaller window */
+#define REDS_TOKENS_TO_SEND (REDS_AGENT_WINDOW_SIZE / 4)
+#define REDS_MIGRATION_TOKENS_TO_SEND 5
+/* maximum number of buffers holding agent data which was not yet sent to
+ * the client, they are allocated when needed */
+#define REDS_VDI_PORT_NUM_RECEIVE_BUFFS 32
 
 /* TODO while we can technically create more than one server in a process,
  * the intended use is to support a single server per process */
@@ -195,7 +203,7 @@ struct RedServerConfig {
 };
 
 
-typedef struct RedLinkInfo {
+struct RedLinkInfo {
     RedsState *reds;
     RedsStream *stream;
     SpiceLinkHeader link_header;
@@ -204,7 +212,7 @@ typedef struct RedLinkInfo {
     TicketInfo tiTicketing;
     SpiceLinkAuthMechanism auth_mechanism;
     int skip_auth;
-} RedLinkInfo;
+};
 
 struct ChannelSecurityOptions {
     uint32_t channel_id;
@@ -238,6 +246,7 @@ struct RedCharDeviceVDIPortPrivate {
 
     /* read from agent */
     GList *read_bufs;
+    int num_read_bufs;
     uint32_t read_state;
     uint32_t message_receive_len;
     uint8_t *receive_pos;
@@ -291,6 +300,7 @@ G_DEFINE_TYPE(RedCharDeviceVDIPort, red_char_device_vdi_port, RED_TYPE_CHAR_DEVI
 #define RED_CHAR_DEVICE_VDIPORT_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), RED_TYPE_CHAR_DEVICE_VDIPORT, RedCharDeviceVDIPortPrivate))
 
 static RedCharDeviceVDIPort *red_char_device_vdi_port_new(RedsState *reds);
+static guint64 reds_get_agent_tokens_interval(RedsState *reds);
 
 static void migrate_timeout(void *opaque);
 static RedsMigTargetClient* reds_mig_target_client_find(RedsState *reds, RedClient *client);
@@ -717,7 +727,15 @@ static RedVDIReadBuf *vdi_port_get_read_buf(RedCharDeviceVDIPort *dev)
     RedVDIReadBuf *buf;
 
     if (!(item = g_list_first(dev->priv->read_bufs))) {
-        return NULL;
+        if (dev->priv->num_read_bufs >= REDS_VDI_PORT_NUM_RECEIVE_BUFFS) {
+            return NULL;
+        }
+        /* pool is empty, the buffer will be added to it once released */
+        buf = spice_new0(RedVDIReadBuf, 1);
+        buf->dev = dev;
+        dev->priv->num_read_bufs++;
+        vdi_read_buf_init(buf);
+        return buf;
     }
 
     buf = item->data;
@@ -996,7 +1014,7 @@ void reds_on_main_agent_start(RedsState *reds, MainChannelClient *mcc, uint32_t
                                                   client,
                                                   TRUE, /* flow control */
                                                   REDS_VDI_PORT_NUM_RECEIVE_BUFFS,
-                                                  REDS_AGENT_WINDOW_SIZE,
+                                                  reds_get_agent_window_size(reds),
                                                   num_tokens,
                                                   red_channel_client_is_waiting_for_migrate_data(rcc));
 
@@ -2377,6 +2395,186 @@ static void reds_handle_ssl_accept(int fd, int event, void *data)
     }
 }
 
+void reds_on_ssl_handshake_done(RedsState *reds, RedLinkInfo *link, bool success)
+{
+    RedsSslHandshakePool *pool = reds->ssl_handshake_pool;
+    GList *done_link;
+
+    pthread_mutex_lock(&pool->lock);
+    done_link = g_queue_find(&pool->done, link);
+    if (done_link) {
+        g_queue_delete_link(&pool->done, done_link);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!done_link) {
+        return;
+    }
+
+    if (!success) {
+        reds_link_free(link);
+        return;
+    }
+    reds_handle_new_link(link);
+}
+
+/* the handshake threads give up on clients not completing the handshake
+ * in time, to stay available to the others */
+#define REDS_SSL_HANDSHAKE_TIMEOUT_MS 10000
+#define REDS_SSL_HANDSHAKE_POLL_MS 100
+#define REDS_SSL_HANDSHAKE_MAX_THREADS 16
+
+static bool reds_ssl_handshake_pool_is_quitting(RedsSslHandshakePool *pool)
+{
+    bool quit;
+
+    pthread_mutex_lock(&pool->lock);
+    quit = pool->quit;
+    pthread_mutex_unlock(&pool->lock);
+    return quit;
+}
+
+/* runs the TLS handshake of @link to completion, from a handshake thread */
+static bool reds_do_ssl_handshake(RedsState *reds, RedLinkInfo *link)
+{
+    int waited = 0;
+    int status = reds_stream_enable_ssl(link->stream, reds->ctx);
+
+    while (status == REDS_STREAM_SSL_STATUS_WAIT_FOR_READ ||
+           status == REDS_STREAM_SSL_STATUS_WAIT_FOR_WRITE) {
+        struct pollfd pollfd;
+        int ret;
+
+        if (waited >= REDS_SSL_HANDSHAKE_TIMEOUT_MS ||
+            reds_ssl_handshake_pool_is_quitting(reds->ssl_handshake_pool)) {
+            spice_warning("TLS handshake not completed");
+            return false;
+        }
+
+        pollfd.fd = link->stream->socket;
+        pollfd.events = status == REDS_STREAM_SSL_STATUS_WAIT_FOR_READ ? POLLIN : POLLOUT;
+        pollfd.revents = 0;
+        ret = poll(&pollfd, 1, REDS_SSL_HANDSHAKE_POLL_MS);
+        if (ret < 0 && errno != EINTR) {
+            spice_warning("poll failed, %s", strerror(errno));
+            return false;
+        }
+        if (ret == 0) {
+            waited += REDS_SSL_HANDSHAKE_POLL_MS;
+            continue;
+        }
+        status = reds_stream_ssl_accept(link->stream);
+    }
+
+    return status == REDS_STREAM_SSL_STATUS_OK;
+}
+
+static void *reds_ssl_handshake_thread(void *opaque)
+{
+    RedsState *reds = opaque;
+    RedsSslHandshakePool *pool = reds->ssl_handshake_pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit) {
+        RedLinkInfo *link = g_queue_pop_head(&pool->links);
+        bool success;
+
+        if (link == NULL) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        success = reds_do_ssl_handshake(reds, link);
+        /* the links not taken by the main loop are freed with the pool */
+        pthread_mutex_lock(&pool->lock);
+        g_queue_push_tail(&pool->done, link);
+        pthread_mutex_unlock(&pool->lock);
+        main_dispatcher_ssl_handshake_done(reds->main_dispatcher, link, success);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void reds_destroy_ssl_handshake_pool(RedsState *reds)
+{
+    RedsSslHandshakePool *pool = reds->ssl_handshake_pool;
+    RedLinkInfo *link;
+    int i;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    while ((link = g_queue_pop_head(&pool->links)) != NULL) {
+        reds_link_free(link);
+    }
+    while ((link = g_queue_pop_head(&pool->done)) != NULL) {
+        reds_link_free(link);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+    reds->ssl_handshake_pool = NULL;
+}
+
+/* Setting SPICE_SSL_HANDSHAKE_THREADS to a number of threads moves the
+ * TLS handshakes out of the main loop. */
+static void reds_init_ssl_handshake_pool(RedsState *reds)
+{
+    const char *env_threads = getenv("SPICE_SSL_HANDSHAKE_THREADS");
+    RedsSslHandshakePool *pool;
+    int num_threads, i;
+
+    if (env_threads == NULL) {
+        return;
+    }
+    num_threads = MIN(atoi(env_threads), REDS_SSL_HANDSHAKE_MAX_THREADS);
+    if (num_threads <= 0) {
+        return;
+    }
+
+    pool = spice_new0(RedsSslHandshakePool, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    g_queue_init(&pool->links);
+    g_queue_init(&pool->done);
+    pool->threads = spice_new0(pthread_t, num_threads);
+    reds->ssl_handshake_pool = pool;
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, reds_ssl_handshake_thread, reds) != 0) {
+            spice_warning("failed to create TLS handshake thread");
+            break;
+        }
+        pool->num_threads++;
+    }
+    if (pool->num_threads == 0) {
+        reds_destroy_ssl_handshake_pool(reds);
+    }
+}
+
+static void reds_queue_ssl_handshake(RedsState *reds, RedLinkInfo *link)
+{
+    RedsSslHandshakePool *pool = reds->ssl_handshake_pool;
+
+    pthread_mutex_lock(&pool->lock);
+    g_queue_push_tail(&pool->links, link);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
 #define KEEPALIVE_TIMEOUT (10*60)
 
 static RedLinkInfo *reds_init_client_connection(RedsState *reds, int socket)
@@ -2419,6 +2617,11 @@ static RedLinkInfo *reds_init_client_ssl_connection(RedsState *reds, int socket)
     if (link == NULL)
         goto error;
 
+    if (reds->ssl_handshake_pool) {
+        reds_queue_ssl_handshake(reds, link);
+        return link;
+    }
+
     ssl_status = reds_stream_enable_ssl(link->stream, reds->ctx);
     switch (ssl_status) {
         case REDS_STREAM_SSL_STATUS_OK:
@@ -2599,21 +2802,24 @@ static void reds_send_mm_time(RedsState *reds)
     }
     spice_debug(NULL);
     main_channel_push_multi_media_time(reds->main_channel,
-                                       reds_get_mm_time() - reds->mm_time_latency);
+                                       reds_get_mm_time() -
+                                       av_clock_get_latency(&reds->av_clock));
 }
 
 void reds_set_client_mm_time_latency(RedsState *reds, RedClient *client, uint32_t latency)
 {
     // TODO: multi-client support for mm_time
+    if (!av_clock_add_required_latency(&reds->av_clock, latency,
+                                       spice_get_monotonic_time_ns())) {
+        spice_debug("required latency %u keeps latency at %u (jitter %u)",
+                    latency, av_clock_get_latency(&reds->av_clock),
+                    av_clock_get_jitter(&reds->av_clock));
+        return;
+    }
+    latency = av_clock_get_latency(&reds->av_clock);
+    spice_debug("new latency %u (jitter %u)", latency, av_clock_get_jitter(&reds->av_clock));
     if (reds->mm_time_enabled) {
-        // TODO: consider network latency
-        if (latency > reds->mm_time_latency) {
-            reds->mm_time_latency = latency;
-            reds_send_mm_time(reds);
-        } else {
-            spice_debug("new latency %u is smaller than existing %u",
-                        latency, reds->mm_time_latency);
-        }
+        reds_send_mm_time(reds);
     } else {
         snd_set_playback_latency(client, latency);
     }
@@ -2841,6 +3047,8 @@ static int reds_init_ssl(RedsState *reds)
     sk_zero(cmp_stack);
 #endif
 
+    reds_init_ssl_handshake_pool(reds);
+
     return 0;
 }
 
@@ -3011,8 +3219,8 @@ uint32_t reds_get_mm_time(void)
 
 void reds_enable_mm_time(RedsState *reds)
 {
+    /* the latency measured so far, if any, is kept */
     reds->mm_time_enabled = TRUE;
-    reds->mm_time_latency = MM_TIME_DELTA;
     reds_send_mm_time(reds);
 }
 
@@ -3060,7 +3268,7 @@ static RedCharDevice *attach_to_red_agent(RedsState *reds, SpiceCharDeviceInstan
                                                       reds_get_client(reds),
                                                       TRUE, /* flow control */
                                                       REDS_VDI_PORT_NUM_RECEIVE_BUFFS,
-                                                      REDS_AGENT_WINDOW_SIZE,
+                                                      reds_get_agent_window_size(reds),
                                                       ~0,
                                                       TRUE);
 
@@ -3374,6 +3582,7 @@ static int do_spice_init(RedsState *reds, SpiceCoreInterface *core_interface)
     }
     reds->core = core_interface_adapter;
     reds->core.public_interface = core_interface;
+    reds->core.timer_wheel = red_timer_wheel_new(&reds->core);
     reds->agent_dev = red_char_device_vdi_port_new(reds);
     reds_update_agent_properties(reds);
     reds->clients = NULL;
@@ -3441,6 +3650,7 @@ SPICE_GNUC_VISIBLE SpiceServer *spice_server_new(void)
     RedsState *reds = spice_new0(RedsState, 1);
 
     reds->config = spice_new0(RedServerConfig, 1);
+    av_clock_init(&reds->av_clock, MM_TIME_DELTA);
     reds->config->default_channel_security =
         SPICE_CHANNEL_SECURITY_NONE | SPICE_CHANNEL_SECURITY_SSL;
     reds->config->renderers = g_array_sized_new(FALSE, TRUE, sizeof(uint32_t), RED_RENDERER_LAST);
@@ -3665,6 +3875,8 @@ SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
     pthread_mutex_unlock(&global_reds_lock);
 
     g_list_free_full(reds->qxl_instances, (GDestroyNotify)red_qxl_destroy);
+    /* the display workers are gone, stop the threads rendering for them */
+    tiled_render_shutdown();
 
     if (reds->inputs_channel) {
         reds_unregister_channel(reds, RED_CHANNEL(reds->inputs_channel));
@@ -3675,6 +3887,7 @@ SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
     }
     reds_core_timer_remove(reds, reds->mig_timer);
 
+    reds_destroy_ssl_handshake_pool(reds);
     if (reds->ctx) {
         SSL_CTX_free(reds->ctx);
     }
@@ -3699,6 +3912,8 @@ SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
     stat_file_free(reds->stat_file);
 #endif
 
+    red_timer_wheel_free(reds->core.timer_wheel);
+
     reds_config_free(reds->config);
     free(reds);
 }
@@ -4207,6 +4422,12 @@ SPICE_GNUC_VISIBLE void spice_server_set_seamless_migration(SpiceServer *reds, i
 {
     /* seamless migration is not supported with multiple clients */
     reds->seamless_migration_enabled = enable && !reds->allow_multiple_clients;
+    /* the agent window depends on it, see reds_get_agent_window_size() */
+    if (reds->agent_dev) {
+        g_object_set(reds->agent_dev,
+                     "client-tokens-interval", reds_get_agent_tokens_interval(reds),
+                     NULL);
+    }
     spice_debug("seamless migration enabled=%d", enable);
 }
 
@@ -4466,24 +4687,12 @@ static void red_char_device_vdi_port_constructed(GObject *object)
 static void
 red_char_device_vdi_port_init(RedCharDeviceVDIPort *self)
 {
-    int i;
-
     self->priv = RED_CHAR_DEVICE_VDIPORT_PRIVATE(self);
 
     self->priv->read_state = VDI_PORT_READ_STATE_READ_HEADER;
     self->priv->receive_pos = (uint8_t *)&self->priv->vdi_chunk_header;
     self->priv->receive_len = sizeof(self->priv->vdi_chunk_header);
-
-    for (i = 0; i < REDS_VDI_PORT_NUM_RECEIVE_BUFFS; i++) {
-        RedVDIReadBuf *buf = spice_new0(RedVDIReadBuf, 1);
-        vdi_read_buf_init(buf);
-        buf->dev = self;
-        g_warn_if_fail(!self->priv->agent_attached);
-        /* This ensures the newly created buffer is placed in the
-         * RedCharDeviceVDIPort::read_bufs queue ready to be reused
-         */
-        red_pipe_item_unref(&buf->base);
-    }
+    /* read buffers are allocated by vdi_port_get_read_buf() when needed */
 }
 
 static void
@@ -4515,11 +4724,23 @@ red_char_device_vdi_port_class_init(RedCharDeviceVDIPortClass *klass)
     char_dev_class->on_free_self_token = vdi_port_on_free_self_token;
 }
 
+uint32_t reds_get_agent_window_size(RedsState *reds)
+{
+    return reds->seamless_migration_enabled ?
+        REDS_AGENT_MIGRATION_WINDOW_SIZE : REDS_AGENT_WINDOW_SIZE;
+}
+
+static guint64 reds_get_agent_tokens_interval(RedsState *reds)
+{
+    return reds->seamless_migration_enabled ?
+        REDS_MIGRATION_TOKENS_TO_SEND : REDS_TOKENS_TO_SEND;
+}
+
 static RedCharDeviceVDIPort *red_char_device_vdi_port_new(RedsState *reds)
 {
     return g_object_new(RED_TYPE_CHAR_DEVICE_VDIPORT,
                         "spice-server", reds,
-                        "client-tokens-interval", (guint64)REDS_TOKENS_TO_SEND,
+                        "client-tokens-interval", reds_get_agent_tokens_interval(reds),
                         "self-tokens", (guint64)REDS_NUM_INTERNAL_AGENT_MESSAGES,
                         NULL);
 }
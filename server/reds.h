@@ -51,6 +51,7 @@ RedChannel *reds_find_channel(RedsState *reds, uint32_t type, uint32_t id);
 int reds_get_mouse_mode(RedsState *reds); // used by inputs_channel
 gboolean reds_config_get_agent_mouse(const RedsState *reds); // used by inputs_channel
 int reds_has_vdagent(RedsState *reds); // used by inputs channel
+uint32_t reds_get_agent_window_size(RedsState *reds); // used by main channel
 bool reds_config_get_playback_compression(RedsState *reds); // used by playback channel
 
 void reds_handle_agent_mouse_event(RedsState *reds, const VDAgentMouseState *mouse_state); // used by inputs_channel
@@ -68,6 +69,7 @@ enum {
 
 /* should be called only from main_dispatcher */
 void reds_client_disconnect(RedsState *reds, RedClient *client);
+void reds_on_ssl_handshake_done(RedsState *reds, RedLinkInfo *link, bool success);
 
 // Temporary (?) for splitting main channel
 void reds_marshall_migrate_data(RedsState *reds, SpiceMarshaller *m);
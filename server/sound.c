@@ -22,6 +22,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdlib.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
@@ -37,6 +38,7 @@
 #include "red-client.h"
 #include "sound.h"
 #include "main-channel-client.h"
+#include "utils.h"
 
 #define SND_RECEIVE_BUF_SIZE     (16 * 1024 * 2)
 #define RECORD_SAMPLES_SIZE (SND_RECEIVE_BUF_SIZE >> 2)
@@ -120,7 +122,12 @@ struct AudioFrame {
     bool allocated;
 };
 
-#define NUM_AUDIO_FRAMES 3
+/* Default playback buffering on the server, can be changed with the
+ * SPICE_PLAYBACK_LATENCY environment variable (in milliseconds).
+ * Frames older than this are dropped when the client can't keep up. */
+#define PLAYBACK_DEFAULT_TARGET_LATENCY 40
+/* one frame being sent, one being filled by the guest, the others queued */
+#define NUM_AUDIO_FRAMES 12
 struct AudioFrameContainer
 {
     int refs;
@@ -138,7 +145,12 @@ struct PlaybackChannelClient {
     AudioFrameContainer *frames;
     AudioFrame *free_frames;
     AudioFrame *in_progress;   /* Frame being sent to the client */
-    AudioFrame *pending_frame; /* Next frame to send to the client */
+    /* Next frames to send to the client, oldest first */
+    AudioFrame *pending_frames;
+    AudioFrame *pending_frames_tail;
+    uint32_t num_pending_frames;
+    uint32_t max_pending_frames;
+    uint32_t target_latency;   /* ms */
     uint32_t mode;
     uint32_t latency;
     SndCodec codec;
@@ -185,6 +197,10 @@ GType playback_channel_get_type(void) G_GNUC_CONST;
 
 struct SpicePlaybackState {
     SndChannel channel;
+
+    RedStatCounter frames_sent;
+    RedStatCounter frames_dropped;
+    RedStatCounter encode_time; /* ns */
 };
 
 typedef struct PlaybackChannelClass {
@@ -262,13 +278,65 @@ static void snd_playback_free_frame(PlaybackChannelClient *playback_client, Audi
     playback_client->free_frames = frame;
 }
 
+static PlaybackChannel *snd_playback_get_channel(PlaybackChannelClient *playback_client)
+{
+    return PLAYBACK_CHANNEL(red_channel_client_get_channel(RED_CHANNEL_CLIENT(playback_client)));
+}
+
+static AudioFrame *snd_playback_dequeue_frame(PlaybackChannelClient *playback_client)
+{
+    AudioFrame *frame = playback_client->pending_frames;
+
+    if (frame) {
+        playback_client->pending_frames = frame->next;
+        if (!playback_client->pending_frames) {
+            playback_client->pending_frames_tail = NULL;
+        }
+        playback_client->num_pending_frames--;
+        frame->next = NULL;
+    }
+    return frame;
+}
+
+static void snd_playback_clear_pending_frames(PlaybackChannelClient *playback_client)
+{
+    AudioFrame *frame;
+
+    while ((frame = snd_playback_dequeue_frame(playback_client))) {
+        snd_playback_free_frame(playback_client, frame);
+    }
+}
+
+/* Queues a frame to be sent to the client. When the client or the link
+ * can't keep up, frames which would exceed the target latency are dropped,
+ * oldest first, so that the playback catches up with the guest. */
+static void snd_playback_queue_frame(PlaybackChannelClient *playback_client, AudioFrame *frame)
+{
+    PlaybackChannel *channel = snd_playback_get_channel(playback_client);
+
+    frame->next = NULL;
+    if (playback_client->pending_frames_tail) {
+        playback_client->pending_frames_tail->next = frame;
+    } else {
+        playback_client->pending_frames = frame;
+    }
+    playback_client->pending_frames_tail = frame;
+    playback_client->num_pending_frames++;
+
+    while (playback_client->num_pending_frames > playback_client->max_pending_frames ||
+           frame->time - playback_client->pending_frames->time > playback_client->target_latency) {
+        snd_playback_free_frame(playback_client, snd_playback_dequeue_frame(playback_client));
+        stat_inc_counter(channel->frames_dropped, 1);
+    }
+}
+
 static void snd_playback_on_message_done(SndChannelClient *client)
 {
     PlaybackChannelClient *playback_client = (PlaybackChannelClient *)client;
     if (playback_client->in_progress) {
         snd_playback_free_frame(playback_client, playback_client->in_progress);
         playback_client->in_progress = NULL;
-        if (playback_client->pending_frame) {
+        if (playback_client->pending_frames) {
             client->command |= SND_PLAYBACK_PCM_MASK;
             snd_send(client);
         }
@@ -596,6 +664,9 @@ static bool snd_playback_send_write(PlaybackChannelClient *playback_client)
     }
     else {
         int n = sizeof(playback_client->encode_buf);
+#ifdef RED_STATISTICS
+        red_time_t encode_start = spice_get_monotonic_time_ns();
+#endif
         if (snd_codec_encode(playback_client->codec, (uint8_t *) frame->samples,
                                     snd_codec_frame_size(playback_client->codec) * sizeof(frame->samples[0]),
                                     playback_client->encode_buf, &n) != SND_CODEC_OK) {
@@ -603,10 +674,15 @@ static bool snd_playback_send_write(PlaybackChannelClient *playback_client)
             red_channel_client_disconnect(rcc);
             return false;
         }
+#ifdef RED_STATISTICS
+        stat_inc_counter(snd_playback_get_channel(playback_client)->encode_time,
+                         spice_get_monotonic_time_ns() - encode_start);
+#endif
         spice_marshaller_add_by_ref_full(m, playback_client->encode_buf, n,
                                          marshaller_unref_pipe_item, pipe_item);
     }
 
+    stat_inc_counter(snd_playback_get_channel(playback_client)->frames_sent, 1);
     red_channel_client_begin_send_message(rcc);
     return true;
 }
@@ -679,9 +755,8 @@ static void playback_channel_send_item(RedChannelClient *rcc, G_GNUC_UNUSED RedP
             }
         }
         if (client->command & SND_PLAYBACK_PCM_MASK) {
-            spice_assert(!playback_client->in_progress && playback_client->pending_frame);
-            playback_client->in_progress = playback_client->pending_frame;
-            playback_client->pending_frame = NULL;
+            spice_assert(!playback_client->in_progress && playback_client->pending_frames);
+            playback_client->in_progress = snd_playback_dequeue_frame(playback_client);
             client->command &= ~SND_PLAYBACK_PCM_MASK;
             if (snd_playback_send_write(playback_client)) {
                 break;
@@ -905,19 +980,15 @@ SPICE_GNUC_VISIBLE void spice_server_playback_stop(SpicePlaybackInstance *sin)
     spice_assert(client->active);
     reds_enable_mm_time(snd_channel_get_server(client));
     client->active = false;
+    /* the frames still queued would reach the client after
+     * SPICE_MSG_PLAYBACK_STOP, drop them */
+    client->command &= ~SND_PLAYBACK_PCM_MASK;
+    snd_playback_clear_pending_frames(playback_client);
     if (client->client_active) {
         snd_set_command(client, SND_CTRL_MASK);
         snd_send(client);
     } else {
         client->command &= ~SND_CTRL_MASK;
-        client->command &= ~SND_PLAYBACK_PCM_MASK;
-
-        if (playback_client->pending_frame) {
-            spice_assert(!playback_client->in_progress);
-            snd_playback_free_frame(playback_client,
-                                    playback_client->pending_frame);
-            playback_client->pending_frame = NULL;
-        }
     }
 }
 
@@ -967,11 +1038,8 @@ SPICE_GNUC_VISIBLE void spice_server_playback_put_samples(SpicePlaybackInstance
     }
     spice_assert(SND_CHANNEL_CLIENT(playback_client)->active);
 
-    if (playback_client->pending_frame) {
-        snd_playback_free_frame(playback_client, playback_client->pending_frame);
-    }
     frame->time = reds_get_mm_time();
-    playback_client->pending_frame = frame;
+    snd_playback_queue_frame(playback_client, frame);
     snd_set_command(SND_CHANNEL_CLIENT(playback_client), SND_PLAYBACK_PCM_MASK);
     snd_send(SND_CHANNEL_CLIENT(playback_client));
 }
@@ -1017,6 +1085,30 @@ static int snd_desired_audio_mode(bool playback_compression, int frequency,
     return SPICE_AUDIO_DATA_MODE_RAW;
 }
 
+/* Sets how many frames can be queued for the client from the target
+ * latency and the duration of a frame */
+static void snd_playback_init_latency(PlaybackChannelClient *playback_client, uint32_t frequency)
+{
+    const char *env_latency_str = getenv("SPICE_PLAYBACK_LATENCY");
+    uint32_t frame_duration;
+
+    playback_client->target_latency = PLAYBACK_DEFAULT_TARGET_LATENCY;
+    if (env_latency_str != NULL) {
+        char *end;
+        long env_latency = strtol(env_latency_str, &end, 10);
+
+        if (*end == '\0' && env_latency > 0 && env_latency <= G_MAXUINT32) {
+            playback_client->target_latency = env_latency;
+        } else {
+            spice_warning("invalid SPICE_PLAYBACK_LATENCY: %s", env_latency_str);
+        }
+    }
+
+    frame_duration = snd_codec_frame_size(playback_client->codec) * 1000 / MAX(frequency, 1);
+    playback_client->max_pending_frames =
+        CLAMP(playback_client->target_latency / MAX(frame_duration, 1), 1, NUM_AUDIO_FRAMES - 2);
+}
+
 static void
 playback_channel_client_finalize(GObject *object)
 {
@@ -1075,6 +1167,11 @@ playback_channel_client_constructed(GObject *object)
     spice_debug("playback client %p using mode %s", playback_client,
                 spice_audio_data_mode_to_string(playback_client->mode));
 
+    snd_playback_init_latency(playback_client, channel->frequency);
+    spice_debug("playback client %p target latency %u ms, up to %u queued frames",
+                playback_client, playback_client->target_latency,
+                playback_client->max_pending_frames);
+
     if (!red_client_during_migrate_at_target(red_client)) {
         snd_set_command(scc, SND_PLAYBACK_MODE_MASK);
         if (channel->volume.volume_nchannels) {
@@ -1333,10 +1430,17 @@ playback_channel_constructed(GObject *object)
 {
     ClientCbs client_cbs = { NULL, };
     SndChannel *self = SND_CHANNEL(object);
+    PlaybackChannel *playback = PLAYBACK_CHANNEL(object);
     RedsState *reds = red_channel_get_server(RED_CHANNEL(self));
 
     G_OBJECT_CLASS(playback_channel_parent_class)->constructed(object);
 
+    red_channel_init_stat_node(RED_CHANNEL(self), NULL, "playback");
+    const RedStatNode *stat = red_channel_get_stat_node(RED_CHANNEL(self));
+    stat_init_counter(&playback->frames_sent, reds, stat, "frames_sent", TRUE);
+    stat_init_counter(&playback->frames_dropped, reds, stat, "frames_dropped", TRUE);
+    stat_init_counter(&playback->encode_time, reds, stat, "encode_time", TRUE);
+
     client_cbs.connect = snd_set_playback_peer;
     client_cbs.migrate = snd_migrate_channel_client;
     red_channel_register_client_cbs(RED_CHANNEL(self), &client_cbs, self);
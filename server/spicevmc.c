@@ -26,6 +26,7 @@
 #include <string.h>
 #ifdef USE_LZ4
 #include <lz4.h>
+#include <lz4hc.h>
 #endif
 
 #include <common/generated_server_marshallers.h>
@@ -33,6 +34,7 @@
 #include "char-device.h"
 #include "red-channel.h"
 #include "red-channel-client.h"
+#include "red-client.h"
 #include "reds.h"
 #include "migration-protocol.h"
 
@@ -43,19 +45,55 @@
 /* 64K should be enough for all but the largest writes + 32 bytes hdr */
 #define BUF_SIZE (64 * 1024 + 32)
 #define COMPRESS_THRESHOLD 1000
+/* Data compressing worse than this is considered incompressible, the
+ * following messages are then sent without trying to compress them */
+#define COMPRESS_MAX_RATIO_PERCENT 90
+/* maximum number of messages sent uncompressed before trying again */
+#define COMPRESS_MAX_BACKOFF 64
+/* below this bandwidth the link is the bottleneck and the slower but
+ * stronger LZ4 HC is used, the client decodes it the same way */
+#define COMPRESS_HC_MAX_BITRATE (10 * 1000 * 1000)
+#define COMPRESS_HC_LEVEL 4
 
 typedef struct RedVmcChannel RedVmcChannel;
 typedef struct RedVmcChannelClass RedVmcChannelClass;
 
-typedef struct RedVmcPipeItem {
+typedef struct RedVmcPipeItem RedVmcPipeItem;
+
+struct RedVmcPipeItem {
     RedPipeItem base;
 
     SpiceDataCompressionType type;
     uint32_t uncompressed_data_size;
-    /* writes which don't fit this will get split, this is not a problem */
-    uint8_t buf[BUF_SIZE];
     uint32_t buf_used;
-} RedVmcPipeItem;
+    /* index in vmc_buf_size_classes, gives the allocated size of buf */
+    uint8_t size_class;
+    /* link in the free list while the item is kept in the pool */
+    RedVmcPipeItem *next_free;
+    uint8_t buf[0];
+};
+
+/* Data items are allocated with the size of their data rounded up to one
+ * of these classes. Most usbredir packets are small, so this avoids keeping
+ * a full BUF_SIZE buffer around for each of them.
+ * Released items are kept in a pool per class to be reused. */
+static const uint32_t vmc_buf_size_classes[] = {
+    512, 4 * 1024, 16 * 1024, BUF_SIZE
+};
+#define VMC_NUM_SIZE_CLASSES SPICE_N_ELEMENTS(vmc_buf_size_classes)
+/* maximum amount of memory kept in the pool for each size class */
+#define VMC_POOL_MAX_CLASS_BYTES (256 * 1024)
+/* data is read into a BUF_SIZE item, which is sent as is unless the data
+ * is small enough to be copied to a right-sized item */
+#define VMC_COPY_MAX_SIZE (4 * 1024)
+
+/* the pool is only used from the main thread */
+typedef struct RedVmcBufferPool {
+    RedVmcPipeItem *free_items[VMC_NUM_SIZE_CLASSES];
+    uint32_t num_free[VMC_NUM_SIZE_CLASSES];
+} RedVmcBufferPool;
+
+static RedVmcBufferPool vmc_buffer_pool;
 
 #define RED_TYPE_CHAR_DEVICE_SPICEVMC red_char_device_spicevmc_get_type()
 
@@ -108,8 +146,19 @@ struct RedVmcChannel
     RedChannelClient *rcc;
     RedCharDevice *chardev; /* weak */
     SpiceCharDeviceInstance *chardev_sin;
-    RedVmcPipeItem *pipe_item;
+    /* the item the device data is read into, kept until data is read */
+    RedVmcPipeItem *read_item;
+#ifdef USE_LZ4
+    /* messages left to send without trying to compress them */
+    uint32_t compress_skip;
+    /* length of the next skip if compression does not help */
+    uint32_t compress_backoff;
+#endif
     RedCharDeviceWriteBuffer *recv_from_client_buf;
+    /* receive buffer for compressed messages, reused as the data is
+     * decompressed straight into a device write buffer */
+    uint8_t *recv_compressed_buf;
+    uint32_t recv_compressed_buf_size;
     uint8_t port_opened;
     RedStatCounter in_data;
     RedStatCounter in_compressed;
@@ -117,6 +166,8 @@ struct RedVmcChannel
     RedStatCounter out_data;
     RedStatCounter out_compressed;
     RedStatCounter out_uncompressed;
+    RedStatCounter out_buf_allocated;
+    RedStatCounter out_buf_reused;
 };
 
 struct RedVmcChannelClass
@@ -241,6 +292,8 @@ red_vmc_channel_constructed(GObject *object)
     stat_init_counter(&self->out_data, reds, stat, "out_data", TRUE);
     stat_init_counter(&self->out_compressed, reds, stat, "out_compressed", TRUE);
     stat_init_counter(&self->out_uncompressed, reds, stat, "out_uncompressed", TRUE);
+    stat_init_counter(&self->out_buf_allocated, reds, stat, "out_buf_allocated", TRUE);
+    stat_init_counter(&self->out_buf_reused, reds, stat, "out_buf_reused", TRUE);
 
 #ifdef USE_LZ4
     red_channel_set_cap(RED_CHANNEL(self), SPICE_SPICEVMC_CAP_DATA_COMPRESS_LZ4);
@@ -262,8 +315,9 @@ red_vmc_channel_finalize(GObject *object)
     RedVmcChannel *self = RED_VMC_CHANNEL(object);
 
     red_char_device_write_buffer_release(self->chardev, &self->recv_from_client_buf);
-    if (self->pipe_item) {
-        red_pipe_item_unref(&self->pipe_item->base);
+    free(self->recv_compressed_buf);
+    if (self->read_item) {
+        red_pipe_item_unref(&self->read_item->base);
     }
 
     G_OBJECT_CLASS(red_vmc_channel_parent_class)->finalize(object);
@@ -321,14 +375,74 @@ static void spicevmc_red_channel_release_msg_rcv_buf(RedChannelClient *rcc,
                                                      uint16_t type,
                                                      uint32_t size,
                                                      uint8_t *msg);
+static void red_vmc_pipe_item_free(RedPipeItem *base)
+{
+    RedVmcPipeItem *item = SPICE_UPCAST(RedVmcPipeItem, base);
+    RedVmcBufferPool *pool = &vmc_buffer_pool;
+    uint8_t size_class = item->size_class;
+
+    if ((pool->num_free[size_class] + 1) * vmc_buf_size_classes[size_class] >
+        VMC_POOL_MAX_CLASS_BYTES) {
+        free(item);
+        return;
+    }
+    item->next_free = pool->free_items[size_class];
+    pool->free_items[size_class] = item;
+    pool->num_free[size_class]++;
+}
+
+/* Returns a data pipe item able to hold size bytes, taken from the pool
+ * when possible */
+static RedVmcPipeItem *red_vmc_pipe_item_new(RedVmcChannel *channel, uint32_t size)
+{
+    RedVmcBufferPool *pool = &vmc_buffer_pool;
+    RedVmcPipeItem *item;
+    uint8_t size_class = 0;
+
+    spice_assert(size <= BUF_SIZE);
+    while (vmc_buf_size_classes[size_class] < size) {
+        size_class++;
+    }
+
+    item = pool->free_items[size_class];
+    if (item) {
+        pool->free_items[size_class] = item->next_free;
+        pool->num_free[size_class]--;
+        stat_inc_counter(channel->out_buf_reused, 1);
+    } else {
+        item = spice_malloc(sizeof(RedVmcPipeItem) + vmc_buf_size_classes[size_class]);
+        stat_inc_counter(channel->out_buf_allocated, 1);
+    }
+    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_SPICEVMC_DATA,
+                            red_vmc_pipe_item_free);
+    item->type = SPICE_DATA_COMPRESSION_TYPE_NONE;
+    item->uncompressed_data_size = 0;
+    item->buf_used = 0;
+    item->size_class = size_class;
+    item->next_free = NULL;
+
+    return item;
+}
+
+#ifdef USE_LZ4
+static bool red_vmc_channel_is_bandwidth_limited(RedVmcChannel *channel)
+{
+    RedClient *client = red_channel_client_get_client(channel->rcc);
+    uint64_t bitrate_per_sec;
+
+    bitrate_per_sec = net_estimator_get_bitrate_per_sec(red_client_get_net_estimator(client));
+    /* 0 means not estimated yet */
+    return bitrate_per_sec != 0 && bitrate_per_sec < COMPRESS_HC_MAX_BITRATE;
+}
+#endif
+
 /* n is the data size (uncompressed)
- * msg_item -- the current pipe item with the uncompressed data
  * This function returns:
  *  - NULL upon failure.
  *  - a new pipe item with the compressed data in it upon success
  */
 #ifdef USE_LZ4
-static RedVmcPipeItem* try_compress_lz4(RedVmcChannel *channel, int n, RedVmcPipeItem *msg_item)
+static RedVmcPipeItem* try_compress_lz4(RedVmcChannel *channel, const uint8_t *data, int n)
 {
     RedVmcPipeItem *msg_item_compressed;
     int compressed_data_count;
@@ -345,12 +459,37 @@ static RedVmcPipeItem* try_compress_lz4(RedVmcChannel *channel, int n, RedVmcPip
         /* Client doesn't have compression cap - data will not be compressed */
         return NULL;
     }
-    msg_item_compressed = spice_new0(RedVmcPipeItem, 1);
-    red_pipe_item_init(&msg_item_compressed->base, RED_PIPE_ITEM_TYPE_SPICEVMC_DATA);
-    compressed_data_count = LZ4_compress_default((char*)&msg_item->buf,
-                                                 (char*)&msg_item_compressed->buf,
-                                                 n,
-                                                 BUF_SIZE);
+    if (channel->compress_skip > 0) {
+        /* recent data was incompressible */
+        channel->compress_skip--;
+        return NULL;
+    }
+    /* output is limited to n - 1 so that LZ4 gives up as soon as the data
+     * does not compress, and goes straight into an item of that size */
+    msg_item_compressed = red_vmc_pipe_item_new(channel, n - 1);
+    if (red_vmc_channel_is_bandwidth_limited(channel)) {
+        compressed_data_count = LZ4_compress_HC((const char*)data,
+                                                (char*)msg_item_compressed->buf,
+                                                n,
+                                                n - 1,
+                                                COMPRESS_HC_LEVEL);
+    } else {
+        compressed_data_count = LZ4_compress_default((const char*)data,
+                                                     (char*)msg_item_compressed->buf,
+                                                     n,
+                                                     n - 1);
+    }
+
+    /* Payloads such as JPEG files or encrypted data are usually sent in
+     * long runs, back off exponentially while compression does not pay */
+    if (compressed_data_count <= 0 ||
+        (uint64_t) compressed_data_count * 100 > (uint64_t) n * COMPRESS_MAX_RATIO_PERCENT) {
+        channel->compress_backoff = MIN(MAX(channel->compress_backoff * 2, 1),
+                                        COMPRESS_MAX_BACKOFF);
+        channel->compress_skip = channel->compress_backoff;
+    } else {
+        channel->compress_backoff = 0;
+    }
 
     if (compressed_data_count > 0 && compressed_data_count < n) {
         stat_inc_counter(channel->out_uncompressed, n);
@@ -358,12 +497,11 @@ static RedVmcPipeItem* try_compress_lz4(RedVmcChannel *channel, int n, RedVmcPip
         msg_item_compressed->type = SPICE_DATA_COMPRESSION_TYPE_LZ4;
         msg_item_compressed->uncompressed_data_size = n;
         msg_item_compressed->buf_used = compressed_data_count;
-        free(msg_item);
         return msg_item_compressed;
     }
 
     /* LZ4 compression failed or did non compress, fallback a non-compressed data is to be sent */
-    free(msg_item_compressed);
+    red_pipe_item_unref(&msg_item_compressed->base);
     return NULL;
 }
 #endif
@@ -373,46 +511,45 @@ static RedPipeItem *spicevmc_chardev_read_msg_from_dev(RedCharDevice *self,
 {
     RedCharDeviceSpiceVmc *vmc = RED_CHAR_DEVICE_SPICEVMC(self);
     RedVmcChannel *channel = RED_VMC_CHANNEL(vmc->channel);
-    SpiceCharDeviceInterface *sif;
     RedVmcPipeItem *msg_item;
     int n;
 
-    sif = spice_char_device_get_interface(sin);
-
     if (!channel->rcc) {
         return NULL;
     }
 
-    if (!channel->pipe_item) {
-        msg_item = spice_new0(RedVmcPipeItem, 1);
-        msg_item->type = SPICE_DATA_COMPRESSION_TYPE_NONE;
-        red_pipe_item_init(&msg_item->base, RED_PIPE_ITEM_TYPE_SPICEVMC_DATA);
-    } else {
-        spice_assert(channel->pipe_item->buf_used == 0);
-        msg_item = channel->pipe_item;
-        channel->pipe_item = NULL;
+    if (!channel->read_item) {
+        channel->read_item = red_vmc_pipe_item_new(channel, BUF_SIZE);
     }
+    msg_item = channel->read_item;
 
-    n = sif->read(sin, msg_item->buf,
-                  sizeof(msg_item->buf));
-    if (n > 0) {
-        spice_debug("read from dev %d", n);
-#ifdef USE_LZ4
-        RedVmcPipeItem *msg_item_compressed;
+    /* spicevmc data is a byte stream, consecutive reads are sent to the
+     * client as a single message.
+     * writes which don't fit this will get split, this is not a problem */
+    n = red_char_device_read_batch(sin, msg_item->buf, BUF_SIZE);
+    if (n <= 0) {
+        return NULL;
+    }
 
-        msg_item_compressed = try_compress_lz4(channel, n, msg_item);
-        if (msg_item_compressed != NULL) {
-            return &msg_item_compressed->base;
-        }
+    spice_debug("read from dev %d", n);
+#ifdef USE_LZ4
+    RedVmcPipeItem *msg_item_compressed = try_compress_lz4(channel, msg_item->buf, n);
+    if (msg_item_compressed != NULL) {
+        return &msg_item_compressed->base;
+    }
 #endif
-        stat_inc_counter(channel->out_data, n);
-        msg_item->uncompressed_data_size = n;
-        msg_item->buf_used = n;
-        return &msg_item->base;
+    stat_inc_counter(channel->out_data, n);
+    if (n <= VMC_COPY_MAX_SIZE) {
+        /* copying a small packet costs less than keeping a BUF_SIZE
+         * buffer queued for it */
+        msg_item = red_vmc_pipe_item_new(channel, n);
+        memcpy(msg_item->buf, channel->read_item->buf, n);
     } else {
-        channel->pipe_item = msg_item;
-        return NULL;
+        channel->read_item = NULL;
     }
+    msg_item->uncompressed_data_size = n;
+    msg_item->buf_used = n;
+    return &msg_item->base;
 }
 
 static void spicevmc_chardev_send_msg_to_client(RedCharDevice *self,
@@ -584,7 +721,7 @@ static bool spicevmc_red_channel_client_handle_message(RedChannelClient *rcc,
                                                        void *msg)
 {
     /* NOTE: *msg free by free() (when cb to spicevmc_red_channel_release_msg_rcv_buf
-     * with the compressed msg type) */
+     * with a msg type other than the data ones) */
     RedVmcChannel *channel;
     SpiceCharDeviceInterface *sif;
 
@@ -638,6 +775,20 @@ static uint8_t *spicevmc_red_channel_alloc_msg_rcv_buf(RedChannelClient *rcc,
         }
         return channel->recv_from_client_buf->buf;
     }
+    case SPICE_MSGC_SPICEVMC_COMPRESSED_DATA: {
+        RedVmcChannel *channel = RED_VMC_CHANNEL(red_channel_client_get_channel(rcc));
+
+        if (size > BUF_SIZE) {
+            /* unusually large message, don't keep it around */
+            return spice_malloc(size);
+        }
+        if (channel->recv_compressed_buf_size < size) {
+            free(channel->recv_compressed_buf);
+            channel->recv_compressed_buf = spice_malloc(size);
+            channel->recv_compressed_buf_size = size;
+        }
+        return channel->recv_compressed_buf;
+    }
 
     default:
         return spice_malloc(size);
@@ -658,6 +809,14 @@ static void spicevmc_red_channel_release_msg_rcv_buf(RedChannelClient *rcc,
         red_char_device_write_buffer_release(channel->chardev, &channel->recv_from_client_buf);
         break;
     }
+    case SPICE_MSGC_SPICEVMC_COMPRESSED_DATA: {
+        RedVmcChannel *channel = RED_VMC_CHANNEL(red_channel_client_get_channel(rcc));
+        /* the reusable buffer is kept for the next compressed message */
+        if (msg != channel->recv_compressed_buf) {
+            free(msg);
+        }
+        break;
+    }
     default:
         free(msg);
     }
@@ -79,6 +79,18 @@ stat_inc_counter(RedStatCounter counter, uint64_t value)
 #endif
 }
 
+/* sets the counter to @value if it is larger, for the counters holding
+ * a maximum */
+static inline void
+stat_max_counter(RedStatCounter counter, uint64_t value)
+{
+#ifdef RED_STATISTICS
+    if (counter.counter && *(counter.counter) < value) {
+        *(counter.counter) = value;
+    }
+#endif
+}
+
 typedef uint64_t stat_time_t;
 
 static inline stat_time_t stat_now(clockid_t clock_id)
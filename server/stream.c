@@ -362,7 +362,9 @@ static void before_reattach_stream(DisplayChannel *display,
 #ifdef STREAM_STATS
             agent->stats.num_drops_pipe++;
 #endif
-            agent->video_encoder->notify_server_frame_drop(agent->video_encoder);
+            if (agent->video_encoder) {
+                agent->video_encoder->notify_server_frame_drop(agent->video_encoder);
+            }
         }
     }
 }
@@ -576,7 +578,8 @@ static void dcc_update_streams_max_latency(DisplayChannelClient *dcc, StreamAgen
     dcc_set_max_stream_latency(dcc, new_max_latency);
 }
 
-static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, Stream *stream)
+/* returns the bit rate available to all the streams of @dcc */
+uint64_t dcc_get_stream_base_bit_rate(DisplayChannelClient *dcc)
 {
     char *env_bit_rate_str;
     uint64_t bit_rate = 0;
@@ -595,14 +598,11 @@ static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, Stream *stream)
     }
 
     if (!bit_rate) {
-        MainChannelClient *mcc;
-        uint64_t net_test_bit_rate;
-
-        mcc = red_client_get_main(red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc)));
-        net_test_bit_rate = main_channel_client_is_network_info_initialized(mcc) ?
-                                main_channel_client_get_bitrate_per_sec(mcc) :
-                                0;
-        bit_rate = MAX(dcc_get_max_stream_bit_rate(dcc), net_test_bit_rate);
+        RedClient *client = red_channel_client_get_client(RED_CHANNEL_CLIENT(dcc));
+        uint64_t net_bit_rate;
+
+        net_bit_rate = net_estimator_get_bitrate_per_sec(red_client_get_net_estimator(client));
+        bit_rate = MAX(dcc_get_max_stream_bit_rate(dcc), net_bit_rate);
         if (bit_rate == 0) {
             /*
              * In case we are after a spice session migration,
@@ -617,17 +617,23 @@ static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, Stream *stream)
     }
 
     spice_debug("base-bit-rate %.2f (Mbps)", bit_rate / 1024.0 / 1024.0);
+    return bit_rate;
+}
+
+static uint64_t get_initial_bit_rate(DisplayChannelClient *dcc, Stream *stream)
+{
+    uint64_t bit_rate = dcc_get_stream_base_bit_rate(dcc);
+
     /* dividing the available bandwidth among the active streams, and saving
      * (1-RED_STREAM_CHANNEL_CAPACITY) of it for other messages */
     return (RED_STREAM_CHANNEL_CAPACITY * bit_rate *
             stream->width * stream->height) / DCC_TO_DC(dcc)->priv->streams_size_total;
 }
 
-static uint32_t get_roundtrip_ms(void *opaque)
+uint32_t dcc_get_stream_roundtrip_ms(DisplayChannelClient *dcc)
 {
-    StreamAgent *agent = opaque;
     int roundtrip;
-    RedChannelClient *rcc = RED_CHANNEL_CLIENT(agent->dcc);
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
 
     roundtrip = red_channel_client_get_roundtrip_ms(rcc);
     if (roundtrip < 0) {
@@ -644,6 +650,13 @@ static uint32_t get_roundtrip_ms(void *opaque)
     return roundtrip;
 }
 
+static uint32_t get_roundtrip_ms(void *opaque)
+{
+    StreamAgent *agent = opaque;
+
+    return dcc_get_stream_roundtrip_ms(agent->dcc);
+}
+
 static uint32_t get_source_fps(void *opaque)
 {
     StreamAgent *agent = opaque;
@@ -683,16 +696,21 @@ static void bitmap_unref(gpointer data)
     red_drawable_unref(red_drawable);
 }
 
-/* A helper for dcc_create_stream(). */
-static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
-                                              uint64_t starting_bit_rate,
-                                              VideoEncoderRateControlCbs *cbs)
+VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
+                                       uint64_t starting_bit_rate,
+                                       VideoEncoderRateControlCbs *cbs,
+                                       bitmap_ref_t bitmap_ref,
+                                       bitmap_unref_t bitmap_unref)
 {
     RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
     bool client_has_multi_codec = red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_MULTI_CODEC);
     int i;
     GArray *video_codecs;
 
+    if (dcc_wants_raw_frames(dcc)) {
+        return NULL;
+    }
+
     video_codecs = dcc_get_preferred_video_codecs_for_encoding(dcc);
     for (i = 0; i < video_codecs->len; i++) {
         RedVideoCodec* video_codec = &g_array_index (video_codecs, RedVideoCodec, i);
@@ -742,7 +760,8 @@ void dcc_create_stream(DisplayChannelClient *dcc, Stream *stream)
     video_cbs.update_client_playback_delay = update_client_playback_delay;
 
     uint64_t initial_bit_rate = get_initial_bit_rate(dcc, stream);
-    agent->video_encoder = dcc_create_video_encoder(dcc, initial_bit_rate, &video_cbs);
+    agent->video_encoder = dcc_create_video_encoder(dcc, initial_bit_rate, &video_cbs,
+                                                    bitmap_ref, bitmap_unref);
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), stream_create_item_new(agent));
 
     if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc), SPICE_DISPLAY_CAP_STREAM_REPORT)) {
@@ -151,4 +151,13 @@ void                  stream_agent_stop                             (StreamAgent
 
 void stream_detach_drawable(Stream *stream);
 
+uint64_t dcc_get_stream_base_bit_rate(DisplayChannelClient *dcc);
+uint32_t dcc_get_stream_roundtrip_ms(DisplayChannelClient *dcc);
+/* returns NULL if no video codec is usable with the client */
+VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
+                                       uint64_t starting_bit_rate,
+                                       VideoEncoderRateControlCbs *cbs,
+                                       bitmap_ref_t bitmap_ref,
+                                       bitmap_unref_t bitmap_unref);
+
 #endif /* STREAM_H_ */
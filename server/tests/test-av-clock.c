@@ -0,0 +1,91 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+#include <glib.h>
+
+#include "av-clock.h"
+
+#define INITIAL_LATENCY 400
+
+static void test_av_clock_increase(void)
+{
+    AVClock clock;
+    red_time_t now = NSEC_PER_SEC;
+
+    av_clock_init(&clock, INITIAL_LATENCY);
+    g_assert_cmpuint(av_clock_get_latency(&clock), ==, INITIAL_LATENCY);
+
+    /* a higher requirement is applied at once */
+    g_assert(av_clock_add_required_latency(&clock, 500, now));
+    g_assert_cmpuint(av_clock_get_latency(&clock), ==, 500);
+
+    /* a spike raises the jitter */
+    g_assert(av_clock_add_required_latency(&clock, 580, now));
+    g_assert_cmpuint(av_clock_get_latency(&clock), ==, 580);
+    g_assert_cmpuint(av_clock_get_jitter(&clock), >, 0);
+
+    /* which keeps a margin when the requirement goes back down */
+    g_assert(av_clock_add_required_latency(&clock, 500, now + 10 * NSEC_PER_SEC));
+    g_assert_cmpuint(av_clock_get_latency(&clock), >, 500);
+    g_assert_cmpuint(av_clock_get_latency(&clock), <, 580);
+}
+
+static void test_av_clock_decrease(void)
+{
+    AVClock clock;
+    red_time_t now = NSEC_PER_SEC;
+    uint32_t prev_latency;
+    int i;
+
+    av_clock_init(&clock, INITIAL_LATENCY);
+
+    /* no change right away */
+    g_assert(!av_clock_add_required_latency(&clock, 100, now));
+    g_assert_cmpuint(av_clock_get_latency(&clock), ==, INITIAL_LATENCY);
+
+    /* the latency goes down slowly */
+    prev_latency = INITIAL_LATENCY;
+    for (i = 0; i < 10; i++) {
+        now += NSEC_PER_SEC;
+        g_assert(av_clock_add_required_latency(&clock, 100, now));
+        g_assert_cmpuint(av_clock_get_latency(&clock), ==,
+                         prev_latency - AV_CLOCK_MAX_DECREASE_PER_SEC);
+        prev_latency = av_clock_get_latency(&clock);
+    }
+
+    /* down to what is required */
+    now += 100 * NSEC_PER_SEC;
+    g_assert(av_clock_add_required_latency(&clock, 100, now));
+    g_assert_cmpuint(av_clock_get_latency(&clock), ==, 100);
+    g_assert_cmpuint(av_clock_get_jitter(&clock), ==, 0);
+
+    /* small variations are not sent */
+    now += NSEC_PER_SEC;
+    g_assert(!av_clock_add_required_latency(&clock, 98, now));
+    g_assert_cmpuint(av_clock_get_latency(&clock), ==, 100);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/av-clock/increase", test_av_clock_increase);
+    g_test_add_func("/server/av-clock/decrease", test_av_clock_decrease);
+
+    return g_test_run();
+}
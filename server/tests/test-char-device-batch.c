@@ -0,0 +1,126 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test batched reads from a char device.
+ * The device is a loopback stand-in giving small chunks on each read, like
+ * usbredir does for mass storage transfers.
+ */
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+
+#include "char-device.h"
+
+#define MSG_SIZE (64 * 1024)
+#define TOTAL_SIZE (4 * 1024 * 1024)
+
+typedef struct LoopbackDevice {
+    SpiceCharDeviceInstance sin;
+    int chunk_size;
+    /* data available without blocking */
+    int available;
+    uint8_t next_byte;
+    int num_reads;
+} LoopbackDevice;
+
+static int loopback_read(SpiceCharDeviceInstance *sin, uint8_t *buf, int len)
+{
+    LoopbackDevice *dev = SPICE_CONTAINEROF(sin, LoopbackDevice, sin);
+    int n, i;
+
+    dev->num_reads++;
+    n = MIN(MIN(len, dev->chunk_size), dev->available);
+    for (i = 0; i < n; i++) {
+        buf[i] = dev->next_byte++;
+    }
+    dev->available -= n;
+    return n;
+}
+
+static SpiceCharDeviceInterface loopback_sif = {
+    .base = {
+        .type          = SPICE_INTERFACE_CHAR_DEVICE,
+        .description   = "loopback",
+        .major_version = SPICE_INTERFACE_CHAR_DEVICE_MAJOR,
+        .minor_version = SPICE_INTERFACE_CHAR_DEVICE_MINOR,
+    },
+    .read = loopback_read,
+};
+
+static void loopback_init(LoopbackDevice *dev, int chunk_size, int available)
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->sin.base.sif = &loopback_sif.base;
+    dev->chunk_size = chunk_size;
+    dev->available = available;
+}
+
+static void test_char_device_batch(void)
+{
+    LoopbackDevice dev;
+    uint8_t buf[1024];
+    unsigned int i;
+
+    /* chunks are gathered up to the buffer size */
+    loopback_init(&dev, 100, 5000);
+    g_assert_cmpint(red_char_device_read_batch(&dev.sin, buf, sizeof(buf)), ==, sizeof(buf));
+    for (i = 0; i < sizeof(buf); i++) {
+        g_assert_cmpint(buf[i], ==, i & 0xff);
+    }
+
+    /* reading stops when the device has no more data */
+    loopback_init(&dev, 100, 250);
+    g_assert_cmpint(red_char_device_read_batch(&dev.sin, buf, sizeof(buf)), ==, 250);
+    g_assert_cmpint(dev.num_reads, ==, 4);
+
+    loopback_init(&dev, 100, 0);
+    g_assert_cmpint(red_char_device_read_batch(&dev.sin, buf, sizeof(buf)), ==, 0);
+}
+
+/* a bulk transfer gives one message per buffer instead of one per chunk */
+static void test_char_device_batch_messages(void)
+{
+    static const int chunk_sizes[] = { 64, 512, 4096 };
+    uint8_t *buf = g_malloc(MSG_SIZE);
+    unsigned int i;
+
+    for (i = 0; i < G_N_ELEMENTS(chunk_sizes); i++) {
+        LoopbackDevice dev;
+        int num_msgs;
+
+        loopback_init(&dev, chunk_sizes[i], TOTAL_SIZE);
+        num_msgs = 0;
+        while (red_char_device_read_batch(&dev.sin, buf, MSG_SIZE) > 0) {
+            num_msgs++;
+        }
+        g_assert_cmpint(num_msgs, ==, TOTAL_SIZE / MSG_SIZE);
+        g_assert_cmpint(dev.num_reads, ==, TOTAL_SIZE / chunk_sizes[i] + 1);
+    }
+
+    g_free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/char-device/batch", test_char_device_batch);
+    g_test_add_func("/server/char-device/batch-messages", test_char_device_batch_messages);
+
+    return g_test_run();
+}
@@ -91,8 +91,8 @@ struct Command {
     };
 };
 
-#define MAX_HEIGHT 2048
-#define MAX_WIDTH 2048
+#define MAX_HEIGHT 2160
+#define MAX_WIDTH 3840
 
 #define SURF_WIDTH 320
 #define SURF_HEIGHT 240
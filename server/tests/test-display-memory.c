@@ -0,0 +1,87 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test adding and removing a display and the allocation of the surfaces
+ * of a display channel, which is done by pages on first use.
+ */
+#include <config.h>
+#include <glib.h>
+
+#include "test-display-base.h"
+#include "display-channel-private.h"
+
+static void test_surface_pages(void)
+{
+    DisplayChannel *display = g_new0(DisplayChannel, 1);
+    RedSurface *surface;
+    int i;
+
+    display->priv = g_new0(DisplayChannelPrivate, 1);
+
+    /* reading a surface never allocates it */
+    g_assert(display_channel_get_surface_canvas(display, 0) == NULL);
+    g_assert(display_channel_get_surface_canvas(display, NUM_SURFACES - 1) == NULL);
+    for (i = 0; i < NUM_SURFACE_PAGES; i++) {
+        g_assert(display->priv->surface_pages[i] == NULL);
+    }
+
+    /* only the page holding the surface is allocated, cleared */
+    surface = display_channel_get_surface(display, SURFACES_PER_PAGE + 1);
+    g_assert(display->priv->surface_pages[1] != NULL);
+    g_assert(surface == &display->priv->surface_pages[1][1]);
+    g_assert(surface->context.canvas == NULL);
+    for (i = 0; i < NUM_SURFACE_PAGES; i++) {
+        if (i != 1) {
+            g_assert(display->priv->surface_pages[i] == NULL);
+        }
+    }
+
+    /* the other surfaces of the page use it */
+    surface = display_channel_get_surface(display, SURFACES_PER_PAGE);
+    g_assert(surface == &display->priv->surface_pages[1][0]);
+    g_assert(display_channel_get_surface_canvas(display, SURFACES_PER_PAGE + 2) == NULL);
+
+    g_free(display->priv->surface_pages[1]);
+    g_free(display->priv);
+    g_free(display);
+}
+
+static void test_add_remove_display(void)
+{
+    SpiceCoreInterface *core = basic_event_loop_init();
+    Test *test = test_new(core);
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        test_add_display_interface(test);
+        g_assert_cmpint(spice_server_remove_interface(&test->qxl_instance.base), ==, 0);
+    }
+
+    test_destroy(test);
+    basic_event_loop_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/display-memory/surface-pages", test_surface_pages);
+    g_test_add_func("/server/display-memory/add-remove", test_add_remove_display);
+
+    return g_test_run();
+}
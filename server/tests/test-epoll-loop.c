@@ -0,0 +1,199 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the epoll variant of the event loop core.
+ */
+#include <config.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+
+#include "red-common.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+typedef struct {
+    SpiceCoreInterfaceInternal core;
+    int sv[2];
+} TestLoop;
+
+static void test_loop_init(TestLoop *loop)
+{
+    loop->core = event_loop_core;
+    loop->core.main_context = g_main_context_new();
+    g_assert(event_loop_core_use_epoll(&loop->core));
+    g_assert_cmpint(socketpair(AF_UNIX, SOCK_STREAM, 0, loop->sv), ==, 0);
+}
+
+static void test_loop_destroy(TestLoop *loop)
+{
+    close(loop->sv[0]);
+    close(loop->sv[1]);
+    g_main_context_unref(loop->core.main_context);
+}
+
+static void test_loop_run(TestLoop *loop)
+{
+    while (g_main_context_iteration(loop->core.main_context, FALSE)) {
+    }
+}
+
+static int watch_events;
+
+static void watch_count(int fd, int event, void *opaque)
+{
+    watch_events |= event;
+}
+
+static SpiceWatch *pair_watches[2];
+
+static void watch_remove_other(int fd, int event, void *opaque)
+{
+    TestLoop *loop = opaque;
+    int other = fd == loop->sv[0] ? 1 : 0;
+
+    /* the other watch has an event pending as well, it must not run */
+    loop->core.watch_remove(&loop->core, pair_watches[other]);
+    pair_watches[other] = NULL;
+    watch_events |= event;
+}
+
+static void test_watch(void)
+{
+    TestLoop loop;
+    SpiceWatch *watch;
+
+    test_loop_init(&loop);
+
+    watch_events = 0;
+    watch = loop.core.watch_add(&loop.core, loop.sv[0], SPICE_WATCH_EVENT_READ,
+                                watch_count, NULL);
+    test_loop_run(&loop);
+    g_assert_cmpint(watch_events, ==, 0);
+
+    g_assert_cmpint(write(loop.sv[1], "x", 1), ==, 1);
+    g_main_context_iteration(loop.core.main_context, FALSE);
+    g_assert_cmpint(watch_events, ==, SPICE_WATCH_EVENT_READ);
+
+    /* the watches are level-triggered, there is still a byte to read */
+    watch_events = 0;
+    loop.core.watch_update_mask(&loop.core, watch, SPICE_WATCH_EVENT_WRITE);
+    g_main_context_iteration(loop.core.main_context, FALSE);
+    g_assert_cmpint(watch_events, ==, SPICE_WATCH_EVENT_WRITE);
+
+    watch_events = 0;
+    loop.core.watch_update_mask(&loop.core, watch, 0);
+    test_loop_run(&loop);
+    g_assert_cmpint(watch_events, ==, 0);
+    loop.core.watch_remove(&loop.core, watch);
+
+    /* a watch removed by the callback of another is not dispatched */
+    pair_watches[0] = loop.core.watch_add(&loop.core, loop.sv[0], SPICE_WATCH_EVENT_READ,
+                                          watch_remove_other, &loop);
+    pair_watches[1] = loop.core.watch_add(&loop.core, loop.sv[1], SPICE_WATCH_EVENT_WRITE,
+                                          watch_remove_other, &loop);
+    watch_events = 0;
+    g_main_context_iteration(loop.core.main_context, FALSE);
+    g_assert((pair_watches[0] == NULL) != (pair_watches[1] == NULL));
+    g_assert(watch_events == SPICE_WATCH_EVENT_READ || watch_events == SPICE_WATCH_EVENT_WRITE);
+    loop.core.watch_remove(&loop.core, pair_watches[0] ? pair_watches[0] : pair_watches[1]);
+
+    test_loop_destroy(&loop);
+}
+
+static GString *timer_calls;
+
+static void timer_append(void *opaque)
+{
+    g_string_append(timer_calls, opaque);
+}
+
+static SpiceTimer *restarted_timer;
+
+static void timer_restart(void *opaque)
+{
+    TestLoop *loop = opaque;
+
+    g_string_append(timer_calls, "r");
+    if (timer_calls->len < 3) {
+        loop->core.timer_start(&loop->core, restarted_timer, 0);
+    }
+}
+
+static void test_timer(void)
+{
+    TestLoop loop;
+    SpiceTimer *a, *b, *c;
+
+    test_loop_init(&loop);
+    timer_calls = g_string_new(NULL);
+
+    a = loop.core.timer_add(&loop.core, timer_append, "a");
+    b = loop.core.timer_add(&loop.core, timer_append, "b");
+    c = loop.core.timer_add(&loop.core, timer_append, "c");
+
+    /* the timers run in the order of their deadlines */
+    loop.core.timer_start(&loop.core, c, 20);
+    loop.core.timer_start(&loop.core, a, 5);
+    loop.core.timer_start(&loop.core, b, 10);
+    while (timer_calls->len < 3) {
+        g_main_context_iteration(loop.core.main_context, TRUE);
+    }
+    g_assert_cmpstr(timer_calls->str, ==, "abc");
+
+    /* a cancelled timer does not run, a started one again replaces its
+     * deadline */
+    g_string_truncate(timer_calls, 0);
+    loop.core.timer_start(&loop.core, a, 1);
+    loop.core.timer_start(&loop.core, b, 1);
+    loop.core.timer_cancel(&loop.core, a);
+    loop.core.timer_start(&loop.core, b, 10);
+    loop.core.timer_start(&loop.core, c, 5);
+    while (timer_calls->len < 2) {
+        g_main_context_iteration(loop.core.main_context, TRUE);
+    }
+    g_assert_cmpstr(timer_calls->str, ==, "cb");
+
+    /* a timer started again by its callback runs at the next iteration */
+    g_string_truncate(timer_calls, 0);
+    restarted_timer = loop.core.timer_add(&loop.core, timer_restart, &loop);
+    loop.core.timer_start(&loop.core, restarted_timer, 0);
+    g_main_context_iteration(loop.core.main_context, TRUE);
+    g_assert_cmpstr(timer_calls->str, ==, "r");
+    test_loop_run(&loop);
+    g_assert_cmpstr(timer_calls->str, ==, "rrr");
+
+    loop.core.timer_remove(&loop.core, restarted_timer);
+    loop.core.timer_remove(&loop.core, a);
+    loop.core.timer_remove(&loop.core, b);
+    loop.core.timer_remove(&loop.core, c);
+    g_string_free(timer_calls, TRUE);
+    test_loop_destroy(&loop);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+#ifdef HAVE_SYS_EPOLL_H
+    g_test_add_func("/server/epoll-loop/watch", test_watch);
+    g_test_add_func("/server/epoll-loop/timer", test_timer);
+#endif
+
+    return g_test_run();
+}
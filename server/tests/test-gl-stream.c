@@ -0,0 +1,199 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the mapping of a GL scanout, the frames copied out of it for the
+ * remote clients streams and the images of their drawn areas.
+ * A temporary file stands in for the dmabuf.
+ */
+#include <config.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <common/rect.h>
+
+#include "gl-stream.h"
+
+#define WIDTH 64
+#define HEIGHT 16
+#define STRIDE (WIDTH * 4 + 32)
+
+#define DRM_FORMAT_XRGB8888 0x34325258
+#define DRM_FORMAT_NV12 0x3231564e
+
+static int scanout_file_new(size_t size, char **name)
+{
+    uint8_t *data = g_malloc(size);
+    size_t i;
+    int fd;
+
+    for (i = 0; i < size; i++) {
+        data[i] = i % 251;
+    }
+    fd = g_file_open_tmp("spice-gl-stream-XXXXXX", name, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(write(fd, data, size), ==, size);
+    g_free(data);
+    return fd;
+}
+
+static void scanout_file_free(int fd, char *name)
+{
+    close(fd);
+    g_unlink(name);
+    g_free(name);
+}
+
+static void scanout_init(SpiceMsgDisplayGlScanoutUnix *scanout, int fd, uint32_t format)
+{
+    memset(scanout, 0, sizeof(*scanout));
+    scanout->drm_dma_buf_fd = fd;
+    scanout->width = WIDTH;
+    scanout->height = HEIGHT;
+    scanout->stride = STRIDE;
+    scanout->drm_fourcc_format = format;
+    scanout->flags = SPICE_GL_SCANOUT_FLAGS_Y0TOP;
+}
+
+static void test_frame(void)
+{
+    SpiceMsgDisplayGlScanoutUnix scanout;
+    RedScanoutMap map;
+    RedGlFrame *frame;
+    SpiceBitmap bitmap;
+    char *name;
+    int fd = scanout_file_new(STRIDE * HEIGHT, &name);
+    unsigned int y;
+
+    scanout_init(&scanout, fd, DRM_FORMAT_XRGB8888);
+    g_assert(red_scanout_map_init(&map, &scanout));
+    g_assert(red_scanout_map_is_mapped(&map));
+
+    frame = red_gl_frame_new(&map, 1234);
+    g_assert_cmpuint(frame->width, ==, WIDTH);
+    g_assert_cmpuint(frame->height, ==, HEIGHT);
+    g_assert_cmpuint(frame->stride, ==, WIDTH * 4);
+    g_assert_cmpuint(frame->mm_time, ==, 1234);
+    g_assert(frame->top_down);
+
+    /* the padding at the end of the lines is not copied */
+    for (y = 0; y < HEIGHT; y++) {
+        g_assert(memcmp(frame->data + y * frame->stride, map.data + y * STRIDE,
+                        WIDTH * 4) == 0);
+    }
+
+    red_gl_frame_get_bitmap(frame, &bitmap);
+    g_assert_cmpint(bitmap.format, ==, SPICE_BITMAP_FMT_32BIT);
+    g_assert_cmpint(bitmap.flags, ==, SPICE_BITMAP_FLAGS_TOP_DOWN);
+    g_assert_cmpuint(bitmap.x, ==, WIDTH);
+    g_assert_cmpuint(bitmap.y, ==, HEIGHT);
+    g_assert_cmpuint(bitmap.stride, ==, WIDTH * 4);
+    g_assert_cmpuint(bitmap.data->data_size, ==, WIDTH * 4 * HEIGHT);
+
+    /* the frame outlives the mapping */
+    red_gl_frame_ref(frame);
+    red_scanout_map_destroy(&map);
+    g_assert(!red_scanout_map_is_mapped(&map));
+    red_gl_frame_unref(frame);
+    g_assert_cmpuint(frame->data[WIDTH * 4], ==, STRIDE % 251);
+    red_gl_frame_unref(frame);
+
+    scanout_file_free(fd, name);
+}
+
+static void test_image_item(void)
+{
+    SpiceMsgDisplayGlScanoutUnix scanout;
+    RedScanoutMap map;
+    RedImageItem *image;
+    SpiceRect damage = { 2, 4, 10, 7 };
+    SpiceRect outside = { WIDTH, 0, WIDTH + 8, 8 };
+    char *name;
+    int fd = scanout_file_new(STRIDE * HEIGHT, &name);
+    int y;
+
+    /* the lines of a bottom-up scanout are flipped */
+    scanout_init(&scanout, fd, DRM_FORMAT_XRGB8888);
+    scanout.flags = 0;
+    g_assert(red_scanout_map_init(&map, &scanout));
+
+    image = red_scanout_map_get_image_item(&map, &damage);
+    g_assert(image != NULL);
+    g_assert_cmpint(image->surface_id, ==, 0);
+    g_assert_cmpint(image->pos.x, ==, 2);
+    g_assert_cmpint(image->pos.y, ==, 4);
+    g_assert_cmpint(image->width, ==, 8);
+    g_assert_cmpint(image->height, ==, 3);
+    g_assert_cmpint(image->stride, ==, 8 * 4);
+    g_assert(image->top_down);
+    for (y = 0; y < image->height; y++) {
+        g_assert(memcmp(image->data + y * image->stride,
+                        map.data + (HEIGHT - 1 - 4 - y) * STRIDE + 2 * 4,
+                        image->stride) == 0);
+    }
+    red_pipe_item_unref(&image->base);
+
+    g_assert(red_scanout_map_get_image_item(&map, &outside) == NULL);
+
+    red_scanout_map_destroy(&map);
+    scanout_file_free(fd, name);
+}
+
+static void test_unsupported_format(void)
+{
+    SpiceMsgDisplayGlScanoutUnix scanout;
+    RedScanoutMap map;
+    char *name;
+    int fd = scanout_file_new(STRIDE * HEIGHT, &name);
+
+    scanout_init(&scanout, fd, DRM_FORMAT_NV12);
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*unsupported scanout format*");
+    g_assert(!red_scanout_map_init(&map, &scanout));
+    g_test_assert_expected_messages();
+    g_assert(!red_scanout_map_is_mapped(&map));
+
+    scanout_file_free(fd, name);
+}
+
+static void test_buffer_too_small(void)
+{
+    SpiceMsgDisplayGlScanoutUnix scanout;
+    RedScanoutMap map;
+    char *name;
+    int fd = scanout_file_new(STRIDE * (HEIGHT - 1), &name);
+
+    scanout_init(&scanout, fd, DRM_FORMAT_XRGB8888);
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*scanout buffer too small*");
+    g_assert(!red_scanout_map_init(&map, &scanout));
+    g_test_assert_expected_messages();
+    g_assert(!red_scanout_map_is_mapped(&map));
+
+    scanout_file_free(fd, name);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/gl-stream/frame", test_frame);
+    g_test_add_func("/server/gl-stream/image-item", test_image_item);
+    g_test_add_func("/server/gl-stream/unsupported-format", test_unsupported_format);
+    g_test_add_func("/server/gl-stream/buffer-too-small", test_buffer_too_small);
+
+    return g_test_run();
+}
@@ -0,0 +1,217 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the image encoders on a desktop-like frame, and the compression
+ * chosen for the link of a client.
+ */
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+
+#include "image-encoders.h"
+#include "dcc.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define STRIDE (WIDTH * 4)
+
+typedef bool (*CompressFunc)(ImageEncoders *enc, SpiceImage *dest,
+                             SpiceBitmap *src, compress_send_data_t* o_comp_data);
+
+/* a frame with flat areas, a gradient and some text-like noise */
+static uint8_t *frame_new(void)
+{
+    uint32_t *pixels = g_malloc(STRIDE * HEIGHT);
+    uint32_t seed = 1;
+    int x, y;
+
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < WIDTH; x++) {
+            uint32_t pixel;
+
+            if (y < 40) {
+                pixel = 0x00303030;
+            } else if (x < 300) {
+                pixel = 0x00000000 | ((y * 255 / HEIGHT) << 8) | (x * 255 / 300);
+            } else if ((y / 20) % 2 && x < 1400) {
+                seed = seed * 1103515245 + 12345;
+                pixel = (seed >> 16) & 1 ? 0x00000000 : 0x00ffffff;
+            } else {
+                pixel = 0x00ffffff;
+            }
+            pixels[y * WIDTH + x] = pixel;
+        }
+    }
+    return (uint8_t *)pixels;
+}
+
+static void bitmap_init(SpiceBitmap *bitmap, uint8_t *data)
+{
+    memset(bitmap, 0, sizeof(*bitmap));
+    bitmap->format = SPICE_BITMAP_FMT_32BIT;
+    bitmap->flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap->x = WIDTH;
+    bitmap->y = HEIGHT;
+    bitmap->stride = STRIDE;
+    bitmap->data = spice_chunks_new_linear(data, STRIDE * HEIGHT);
+}
+
+static void comp_data_free(compress_send_data_t *comp_data)
+{
+    RedCompressBuf *buf = comp_data->comp_buf;
+
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    comp_data->comp_buf = NULL;
+}
+
+static uint32_t compress_frame(CompressFunc compress)
+{
+    ImageEncoderSharedData shared_data;
+    ImageEncoders encoders;
+    SpiceBitmap bitmap;
+    uint8_t *frame = frame_new();
+    compress_send_data_t comp_data = { NULL, };
+    SpiceImage image;
+    uint32_t size;
+
+    image_encoder_shared_init(&shared_data);
+    image_encoders_init(&encoders, &shared_data);
+    bitmap_init(&bitmap, frame);
+
+    memset(&image, 0, sizeof(image));
+    g_assert(compress(&encoders, &image, &bitmap, &comp_data));
+    size = comp_data.comp_buf_size;
+    comp_data_free(&comp_data);
+
+    image_encoders_free(&encoders);
+    spice_chunks_destroy(bitmap.data);
+    g_free(frame);
+    return size;
+}
+
+static void test_compress(CompressFunc compress)
+{
+    uint32_t size = compress_frame(compress);
+
+    g_assert_cmpuint(size, >, 0);
+    g_assert_cmpuint(size, <, STRIDE * HEIGHT);
+}
+
+static void test_quic(void)
+{
+    test_compress(image_encoders_compress_quic);
+}
+
+static void test_lz(void)
+{
+    test_compress(image_encoders_compress_lz);
+}
+
+#ifdef USE_LZ4
+static void test_lz4(void)
+{
+    test_compress(image_encoders_compress_lz4);
+}
+#endif
+
+#define SLOW_LINK_BIT_RATE (10 * 1000 * 1000ULL)
+#define FAST_LINK_BIT_RATE (10 * 1000 * 1000 * 1000ULL)
+
+#ifdef USE_LZ4
+#define FAST_LINK_COMPRESSION SPICE_IMAGE_COMPRESSION_LZ4
+#else
+#define FAST_LINK_COMPRESSION SPICE_IMAGE_COMPRESSION_LZ
+#endif
+
+static void test_link_compression(void)
+{
+    static const SpiceImageCompression automatic[] = {
+        SPICE_IMAGE_COMPRESSION_AUTO_GLZ, SPICE_IMAGE_COMPRESSION_AUTO_LZ,
+    };
+    static const SpiceImageCompression configured[] = {
+        SPICE_IMAGE_COMPRESSION_QUIC, SPICE_IMAGE_COMPRESSION_GLZ,
+        SPICE_IMAGE_COMPRESSION_LZ,
+    };
+    unsigned int i;
+
+    /* local clients get raw images whatever the setting */
+    for (i = 0; i < G_N_ELEMENTS(automatic); i++) {
+        g_assert_cmpint(dcc_select_link_image_compression(automatic[i], true, 0),
+                        ==, SPICE_IMAGE_COMPRESSION_OFF);
+    }
+    for (i = 0; i < G_N_ELEMENTS(configured); i++) {
+        g_assert_cmpint(dcc_select_link_image_compression(configured[i], true, FAST_LINK_BIT_RATE),
+                        ==, SPICE_IMAGE_COMPRESSION_OFF);
+    }
+
+    /* the automatic compression is replaced by the cheapest one on fast
+     * links, and kept on slow or unknown ones */
+    for (i = 0; i < G_N_ELEMENTS(automatic); i++) {
+        g_assert_cmpint(dcc_select_link_image_compression(automatic[i], false, FAST_LINK_BIT_RATE),
+                        ==, FAST_LINK_COMPRESSION);
+        g_assert_cmpint(dcc_select_link_image_compression(automatic[i], false, SLOW_LINK_BIT_RATE),
+                        ==, automatic[i]);
+        g_assert_cmpint(dcc_select_link_image_compression(automatic[i], false, 0),
+                        ==, automatic[i]);
+    }
+
+    /* a configured compression is kept on remote links */
+    for (i = 0; i < G_N_ELEMENTS(configured); i++) {
+        g_assert_cmpint(dcc_select_link_image_compression(configured[i], false, FAST_LINK_BIT_RATE),
+                        ==, configured[i]);
+        g_assert_cmpint(dcc_select_link_image_compression(configured[i], false, SLOW_LINK_BIT_RATE),
+                        ==, configured[i]);
+    }
+    g_assert_cmpint(dcc_select_link_image_compression(SPICE_IMAGE_COMPRESSION_OFF, false,
+                                                      SLOW_LINK_BIT_RATE),
+                    ==, SPICE_IMAGE_COMPRESSION_OFF);
+}
+
+static void test_raw_frames(void)
+{
+    g_unsetenv("SPICE_LOCAL_RAW_FRAMES");
+    g_assert(!dcc_select_raw_frames(true));
+
+    g_setenv("SPICE_LOCAL_RAW_FRAMES", "0", TRUE);
+    g_assert(!dcc_select_raw_frames(true));
+
+    /* only local clients get raw frames */
+    g_setenv("SPICE_LOCAL_RAW_FRAMES", "1", TRUE);
+    g_assert(dcc_select_raw_frames(true));
+    g_assert(!dcc_select_raw_frames(false));
+    g_unsetenv("SPICE_LOCAL_RAW_FRAMES");
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/image-compression/quic", test_quic);
+    g_test_add_func("/server/image-compression/lz", test_lz);
+#ifdef USE_LZ4
+    g_test_add_func("/server/image-compression/lz4", test_lz4);
+#endif
+    g_test_add_func("/server/image-compression/link-compression", test_link_compression);
+    g_test_add_func("/server/image-compression/raw-frames", test_raw_frames);
+
+    return g_test_run();
+}
@@ -0,0 +1,97 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+#include <glib.h>
+
+#include "net-estimator.h"
+
+#define PERIOD NET_ESTIMATOR_PERIOD_NS
+
+static void test_net_estimator_roundtrip(void)
+{
+    NetEstimator estimator;
+
+    net_estimator_init(&estimator);
+    g_assert_cmpint(net_estimator_get_roundtrip(&estimator), ==, -1);
+
+    net_estimator_add_roundtrip(&estimator, 8 * NSEC_PER_MILLISEC);
+    g_assert_cmpint(net_estimator_get_roundtrip(&estimator), ==, 8 * NSEC_PER_MILLISEC);
+
+    /* a single spike is smoothed */
+    net_estimator_add_roundtrip(&estimator, 16 * NSEC_PER_MILLISEC);
+    g_assert_cmpint(net_estimator_get_roundtrip(&estimator), ==, 9 * NSEC_PER_MILLISEC);
+    g_assert_cmpint(net_estimator_get_min_roundtrip(&estimator), ==, 8 * NSEC_PER_MILLISEC);
+
+    /* invalid samples are ignored */
+    net_estimator_add_roundtrip(&estimator, -1);
+    g_assert_cmpint(net_estimator_get_roundtrip(&estimator), ==, 9 * NSEC_PER_MILLISEC);
+
+    net_estimator_destroy(&estimator);
+}
+
+static void test_net_estimator_bitrate(void)
+{
+    NetEstimator estimator;
+    red_time_t now = NSEC_PER_SEC;
+    int i;
+
+    net_estimator_init(&estimator);
+
+    /* writes not limited by the link don't give an estimation */
+    net_estimator_data_sent(&estimator, 1000, false, now);
+    net_estimator_data_sent(&estimator, 1000, false, now + PERIOD);
+    g_assert_cmpuint(net_estimator_get_bitrate_per_sec(&estimator), ==, 0);
+
+    /* saturated link: 1MB every period */
+    now += PERIOD;
+    for (i = 0; i < 5; i++) {
+        net_estimator_data_sent(&estimator, 0, true, now);
+        net_estimator_data_sent(&estimator, 1000 * 1000, false, now + PERIOD);
+        now += PERIOD;
+    }
+    g_assert_cmpuint(net_estimator_get_bitrate_per_sec(&estimator), ==,
+                     1000 * 1000 * 8 * NSEC_PER_SEC / PERIOD);
+
+    /* the link can do more than estimated */
+    net_estimator_data_sent(&estimator, 2 * 1000 * 1000, false, now + PERIOD);
+    now += PERIOD;
+    g_assert_cmpuint(net_estimator_get_bitrate_per_sec(&estimator), ==,
+                     2 * 1000 * 1000 * 8 * NSEC_PER_SEC / PERIOD);
+
+    /* an idle link does not lower the estimation */
+    net_estimator_data_sent(&estimator, 10, true, now + 10 * PERIOD);
+    g_assert_cmpuint(net_estimator_get_bitrate_per_sec(&estimator), ==,
+                     2 * 1000 * 1000 * 8 * NSEC_PER_SEC / PERIOD);
+
+    /* the estimation from the net test is only a starting point */
+    net_estimator_add_bitrate(&estimator, 0);
+    g_assert_cmpuint(net_estimator_get_bitrate_per_sec(&estimator), ==,
+                     3 * 1000 * 1000 * 8 * NSEC_PER_SEC / PERIOD / 2);
+
+    net_estimator_destroy(&estimator);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/net-estimator/roundtrip", test_net_estimator_roundtrip);
+    g_test_add_func("/server/net-estimator/bitrate", test_net_estimator_bitrate);
+
+    return g_test_run();
+}
@@ -258,6 +258,34 @@ static void test_circular_small_chunks(void)
 }
 
 
+static void test_memslot_last_hit(void)
+{
+    RedMemSlotInfo mem_info;
+    QXLCursorCmd cursor_cmd;
+    int error;
+
+    init_meminfo(&mem_info);
+
+    /* the slot of a translated address is remembered until the slot
+     * changes */
+    g_assert_true(memslot_get_virt(&mem_info, to_physical(&cursor_cmd), sizeof(cursor_cmd),
+                                   0, &error) == (uintptr_t)&cursor_cmd);
+    g_assert_cmpint(error, ==, 0);
+    g_assert_true(mem_info.last_hits[0].slot == &mem_info.mem_slots[0][0]);
+
+    memslot_info_add_slot(&mem_info, 0, 0, 0, 0, ~0ul, 0);
+    g_assert_true(mem_info.last_hits[0].slot == NULL);
+    g_assert_true(memslot_get_virt(&mem_info, to_physical(&cursor_cmd), sizeof(cursor_cmd),
+                                   0, &error) == (uintptr_t)&cursor_cmd);
+    g_assert_true(mem_info.last_hits[0].slot == &mem_info.mem_slots[0][0]);
+
+    memslot_info_reset(&mem_info);
+    g_assert_true(mem_info.last_hits[0].slot == NULL);
+
+    memslot_info_destroy(&mem_info);
+}
+
+
 int main(int argc, char *argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -289,5 +317,8 @@ int main(int argc, char *argv[])
     /* a circular list of small chunks should not be a problems */
     g_test_add_func("/server/qxl-parsing/circular-small-chunks", test_circular_small_chunks);
 
+    /* the last translated slot of a group is forgotten when slots change */
+    g_test_add_func("/server/qxl-parsing/memslot-last-hit", test_memslot_last_hit);
+
     return g_test_run();
 }
@@ -0,0 +1,164 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the parallel rendering of solid fills and copies.
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "tiled-render.h"
+
+#define WIDTH 3840
+#define HEIGHT 2160
+#define STRIDE (WIDTH * 4)
+
+static uint32_t *surface_new(void)
+{
+    return g_malloc0(STRIDE * HEIGHT);
+}
+
+static void reference_fill(uint8_t *line_0, int32_t stride,
+                           const SpiceRect *rects, int num_rects, uint32_t color)
+{
+    int i, y;
+
+    for (i = 0; i < num_rects; i++) {
+        for (y = rects[i].top; y < rects[i].bottom; y++) {
+            uint32_t *line = (uint32_t *)(line_0 + y * stride);
+            int x;
+
+            for (x = rects[i].left; x < rects[i].right; x++) {
+                line[x] = color;
+            }
+        }
+    }
+}
+
+static void test_fill(int32_t stride)
+{
+    static const SpiceRect rects[] = {
+        { .left = 0, .top = 0, .right = WIDTH, .bottom = 100 },
+        { .left = 10, .top = 100, .right = 2000, .bottom = 1500 },
+        { .left = 2500, .top = 1000, .right = 3000, .bottom = HEIGHT },
+    };
+    uint32_t *expected = surface_new();
+    uint32_t *result = surface_new();
+    uint8_t *expected_line_0 = (uint8_t *)expected;
+    uint8_t *result_line_0 = (uint8_t *)result;
+
+    if (stride < 0) {
+        expected_line_0 -= stride * (HEIGHT - 1);
+        result_line_0 -= stride * (HEIGHT - 1);
+    }
+
+    reference_fill(expected_line_0, stride, rects, G_N_ELEMENTS(rects), 0x00ff8000);
+    g_assert(tiled_render_fill_rects(result_line_0, stride, rects, G_N_ELEMENTS(rects),
+                                     0x00ff8000));
+    g_assert(memcmp(expected, result, STRIDE * HEIGHT) == 0);
+
+    g_free(expected);
+    g_free(result);
+}
+
+static void test_fill_top_down(void)
+{
+    test_fill(STRIDE);
+}
+
+static void test_fill_bottom_up(void)
+{
+    test_fill(-STRIDE);
+}
+
+static void test_copy(void)
+{
+    static const SpiceRect rects[] = {
+        { .left = 0, .top = 0, .right = 1000, .bottom = 700 },
+        { .left = 1000, .top = 300, .right = 1700, .bottom = 900 },
+    };
+    uint32_t *src = surface_new();
+    uint32_t *expected = surface_new();
+    uint32_t *result = surface_new();
+    uint8_t *src_line_0 = (uint8_t *)src + STRIDE * (HEIGHT - 1);
+    int dx = 100, dy = 200;
+    unsigned int i;
+    int x, y;
+
+    for (i = 0; i < WIDTH * HEIGHT; i++) {
+        src[i] = i;
+    }
+    /* a bottom-up source to a top-down surface */
+    for (i = 0; i < G_N_ELEMENTS(rects); i++) {
+        for (y = rects[i].top; y < rects[i].bottom; y++) {
+            for (x = rects[i].left; x < rects[i].right; x++) {
+                expected[y * WIDTH + x] =
+                    *(uint32_t *)(src_line_0 - (y + dy) * STRIDE + (x + dx) * 4);
+            }
+        }
+    }
+    g_assert(tiled_render_copy_rects((uint8_t *)result, STRIDE, rects, G_N_ELEMENTS(rects),
+                                     src_line_0, -STRIDE, dx, dy));
+    g_assert(memcmp(expected, result, STRIDE * HEIGHT) == 0);
+
+    g_free(src);
+    g_free(expected);
+    g_free(result);
+}
+
+static void test_small_fill(void)
+{
+    static const SpiceRect rect = { .left = 0, .top = 0, .right = 64, .bottom = 64 };
+    uint32_t *surface = surface_new();
+
+    /* not worth splitting */
+    g_assert(!tiled_render_fill_rects((uint8_t *)surface, STRIDE, &rect, 1, 0));
+    g_free(surface);
+}
+
+static void test_shutdown(void)
+{
+    static const SpiceRect rect = { .left = 0, .top = 0, .right = WIDTH, .bottom = HEIGHT };
+    uint32_t *surface = surface_new();
+
+    /* the threads are started again for the next job */
+    tiled_render_shutdown();
+    tiled_render_shutdown();
+    g_assert(tiled_render_fill_rects((uint8_t *)surface, STRIDE, &rect, 1, 0x00ff8000));
+    g_assert_cmpint(surface[WIDTH * HEIGHT - 1], ==, 0x00ff8000);
+    tiled_render_shutdown();
+
+    g_free(surface);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    /* the rendering threads run whatever the number of CPUs */
+    g_setenv("SPICE_RENDER_THREADS", "3", TRUE);
+
+    g_test_add_func("/server/tiled-render/fill-top-down", test_fill_top_down);
+    g_test_add_func("/server/tiled-render/fill-bottom-up", test_fill_bottom_up);
+    g_test_add_func("/server/tiled-render/copy", test_copy);
+    g_test_add_func("/server/tiled-render/small-fill", test_small_fill);
+    g_test_add_func("/server/tiled-render/shutdown", test_shutdown);
+
+    return g_test_run();
+}
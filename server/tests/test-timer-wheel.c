@@ -0,0 +1,171 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the timer wheel on top of the GLib event loop core: the order the
+ * timers run in, that they do not run early, and starting, cancelling and
+ * freeing timers from the callbacks.
+ */
+#include <config.h>
+#include <glib.h>
+
+#include "timer-wheel.h"
+#include "utils.h"
+
+typedef struct {
+    RedTimer *timer;
+    const char *name;
+    uint32_t ms;
+    red_time_t start_time;
+} TestTimer;
+
+static SpiceCoreInterfaceInternal core;
+static RedTimerWheel *wheel;
+static GString *calls;
+
+static void test_wheel_init(void)
+{
+    core = event_loop_core;
+    core.main_context = g_main_context_new();
+    wheel = red_timer_wheel_new(&core);
+    core.timer_wheel = wheel;
+    calls = g_string_new(NULL);
+}
+
+static void test_wheel_destroy(void)
+{
+    red_timer_wheel_free(wheel);
+    g_main_context_unref(core.main_context);
+    g_string_free(calls, TRUE);
+}
+
+static void test_wheel_run(unsigned int num_calls)
+{
+    while (calls->len < num_calls) {
+        g_main_context_iteration(core.main_context, TRUE);
+    }
+}
+
+static void test_timer_func(void *opaque)
+{
+    TestTimer *test_timer = opaque;
+    red_time_t elapsed = spice_get_monotonic_time_ns() - test_timer->start_time;
+
+    g_assert_cmpint(elapsed, >=, test_timer->ms * NSEC_PER_MILLISEC);
+    g_string_append(calls, test_timer->name);
+}
+
+static void test_timer_start(TestTimer *test_timer, uint32_t ms)
+{
+    test_timer->ms = ms;
+    test_timer->start_time = spice_get_monotonic_time_ns();
+    red_timer_start(test_timer->timer, ms);
+}
+
+static void test_order(void)
+{
+    TestTimer timers[] = {
+        { NULL, "a", }, { NULL, "b", }, { NULL, "c", }, { NULL, "d", }, { NULL, "e", },
+    };
+    unsigned int i;
+
+    test_wheel_init();
+    for (i = 0; i < G_N_ELEMENTS(timers); i++) {
+        timers[i].timer = red_timer_new(wheel, test_timer_func, &timers[i]);
+    }
+
+    /* "d" and "e" start on the upper levels of the wheel */
+    test_timer_start(&timers[3], 100);
+    test_timer_start(&timers[1], 5);
+    test_timer_start(&timers[4], 250);
+    test_timer_start(&timers[0], 0);
+    test_timer_start(&timers[2], 20);
+    test_wheel_run(5);
+    g_assert_cmpstr(calls->str, ==, "abcde");
+
+    /* starting a timer again replaces its expiry, a cancelled one does
+     * not run */
+    g_string_truncate(calls, 0);
+    test_timer_start(&timers[0], 1);
+    test_timer_start(&timers[1], 2);
+    red_timer_cancel(timers[0].timer);
+    test_timer_start(&timers[1], 30);
+    test_timer_start(&timers[2], 10);
+    test_wheel_run(2);
+    g_assert_cmpstr(calls->str, ==, "cb");
+
+    for (i = 0; i < G_N_ELEMENTS(timers); i++) {
+        red_timer_free(timers[i].timer);
+    }
+    test_wheel_destroy();
+}
+
+static TestTimer restarted;
+static RedTimer *freed_timer;
+
+static void timer_restart(void *opaque)
+{
+    test_timer_func(opaque);
+    if (calls->len < 3) {
+        test_timer_start(&restarted, 0);
+    }
+}
+
+static void timer_free_other(void *opaque)
+{
+    /* the other timer is due as well, it must not run once freed */
+    red_timer_free(freed_timer);
+    freed_timer = NULL;
+    g_string_append(calls, "f");
+}
+
+static void test_callbacks(void)
+{
+    RedTimer *timer;
+
+    test_wheel_init();
+
+    /* a timer started again by its callback runs at a later tick */
+    restarted.name = "r";
+    restarted.timer = red_timer_new(wheel, timer_restart, &restarted);
+    test_timer_start(&restarted, 0);
+    test_wheel_run(3);
+    g_assert_cmpstr(calls->str, ==, "rrr");
+    red_timer_free(restarted.timer);
+
+    g_string_truncate(calls, 0);
+    timer = red_timer_new(wheel, timer_free_other, NULL);
+    freed_timer = red_timer_new(wheel, timer_free_other, NULL);
+    red_timer_start(timer, 5);
+    red_timer_start(freed_timer, 5);
+    test_wheel_run(1);
+    g_assert_cmpstr(calls->str, ==, "f");
+    g_assert(freed_timer == NULL);
+    red_timer_free(timer);
+
+    test_wheel_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/timer-wheel/order", test_order);
+    g_test_add_func("/server/timer-wheel/callbacks", test_callbacks);
+
+    return g_test_run();
+}
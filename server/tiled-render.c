@@ -0,0 +1,295 @@
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pixman.h>
+#include <common/log.h>
+#include <common/rect.h>
+
+#include "red-common.h"
+#include "tiled-render.h"
+
+#define TILED_RENDER_MIN_BAND_HEIGHT 64
+
+typedef struct TiledJob TiledJob;
+
+struct TiledJob {
+    /* renders the lines from @top to @bottom of @rect */
+    void (*render_rect)(TiledJob *job, const SpiceRect *rect, int top, int bottom);
+    uint8_t *line_0;
+    int32_t stride;
+    const SpiceRect *rects;
+    int num_rects;
+
+    /* fill */
+    uint32_t color;
+    /* copy, the source of the pixel (x, y) is at (x + dx, y + dy) */
+    const uint8_t *src_line_0;
+    int32_t src_stride;
+    int dx;
+    int dy;
+
+    int top;
+    int band_height;
+    int num_bands;
+    int next_band;
+    int done_bands;
+};
+
+static struct {
+    /* held while a job runs and while the threads start or stop, only one
+     * job is handled at a time */
+    pthread_mutex_t submit_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t done_cond;
+    TiledJob *job;
+    bool started;
+    bool quit;
+    int num_threads;
+    pthread_t threads[TILED_RENDER_MAX_THREADS - 1];
+} pool = {
+    .submit_lock = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .job_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void tiled_fill_rect(TiledJob *job, const SpiceRect *r, int top, int bottom)
+{
+    int y;
+
+    /* filling line by line, pixman does not handle negative strides */
+    for (y = top; y < bottom; y++) {
+        uint32_t *line = (uint32_t *)(job->line_0 + y * job->stride);
+        pixman_fill(line, abs(job->stride) / 4, 32, r->left, 0, r->right - r->left, 1, job->color);
+    }
+}
+
+static void tiled_copy_rect(TiledJob *job, const SpiceRect *r, int top, int bottom)
+{
+    int y;
+
+    for (y = top; y < bottom; y++) {
+        memcpy(job->line_0 + y * job->stride + r->left * 4,
+               job->src_line_0 + (y + job->dy) * job->src_stride + (r->left + job->dx) * 4,
+               (r->right - r->left) * 4);
+    }
+}
+
+static void tiled_job_render_band(TiledJob *job, int band)
+{
+    int band_top = job->top + band * job->band_height;
+    int band_bottom = band_top + job->band_height;
+    int i;
+
+    for (i = 0; i < job->num_rects; i++) {
+        const SpiceRect *r = &job->rects[i];
+        int top = MAX(r->top, band_top);
+        int bottom = MIN(r->bottom, band_bottom);
+
+        if (top < bottom) {
+            job->render_rect(job, r, top, bottom);
+        }
+    }
+}
+
+/* returns false when there is no band left, pool.lock should be held */
+static bool tiled_job_run_band(TiledJob *job)
+{
+    int band;
+
+    if (job->next_band >= job->num_bands) {
+        return false;
+    }
+    band = job->next_band++;
+
+    pthread_mutex_unlock(&pool.lock);
+    tiled_job_render_band(job, band);
+    pthread_mutex_lock(&pool.lock);
+
+    if (++job->done_bands == job->num_bands) {
+        pthread_cond_signal(&pool.done_cond);
+    }
+    return true;
+}
+
+static void *tiled_render_thread(void *opaque)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.quit) {
+        if (!pool.job || !tiled_job_run_band(pool.job)) {
+            pthread_cond_wait(&pool.job_cond, &pool.lock);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/* Setting SPICE_RENDER_THREADS overrides the number of threads rendering
+ * besides the display worker, 0 disables the parallel rendering. */
+static int tiled_render_get_num_threads(void)
+{
+    const char *env_threads = getenv("SPICE_RENDER_THREADS");
+    long num_threads;
+
+    if (env_threads) {
+        char *end;
+
+        num_threads = strtol(env_threads, &end, 10);
+        if (*end == '\0' && num_threads >= 0) {
+            return MIN(num_threads, TILED_RENDER_MAX_THREADS - 1);
+        }
+        spice_warning("invalid SPICE_RENDER_THREADS value %s", env_threads);
+    }
+
+    /* the thread submitting a job renders too */
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    return CLAMP(num_threads, 0, TILED_RENDER_MAX_THREADS - 1);
+}
+
+/* pool.submit_lock should be held */
+static void tiled_render_start(void)
+{
+    int num_threads = tiled_render_get_num_threads();
+    int i;
+
+    pool.started = true;
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool.threads[i], NULL, tiled_render_thread, NULL) != 0) {
+            spice_warning("failed to create rendering thread");
+            break;
+        }
+    }
+    pool.num_threads = i;
+}
+
+void tiled_render_shutdown(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool.submit_lock);
+    if (!pool.started) {
+        pthread_mutex_unlock(&pool.submit_lock);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = true;
+    pthread_cond_broadcast(&pool.job_cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.num_threads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    pool.quit = false;
+    pool.started = false;
+    pool.num_threads = 0;
+    pthread_mutex_unlock(&pool.submit_lock);
+}
+
+static bool tiled_job_run(TiledJob *job)
+{
+    SpiceRect bounds;
+    uint64_t area = 0;
+    int i;
+
+    if (job->num_rects == 0) {
+        return false;
+    }
+    bounds = job->rects[0];
+    for (i = 0; i < job->num_rects; i++) {
+        area += rect_get_area(&job->rects[i]);
+        rect_union(&bounds, &job->rects[i]);
+    }
+    if (area < TILED_RENDER_MIN_AREA) {
+        return false;
+    }
+
+    if (pthread_mutex_trylock(&pool.submit_lock) != 0) {
+        return false;
+    }
+    if (!pool.started) {
+        tiled_render_start();
+    }
+    if (pool.num_threads == 0) {
+        pthread_mutex_unlock(&pool.submit_lock);
+        return false;
+    }
+
+    job->top = bounds.top;
+    job->band_height = MAX(TILED_RENDER_MIN_BAND_HEIGHT,
+                           (bounds.bottom - bounds.top + pool.num_threads) / (pool.num_threads + 1));
+    job->num_bands = (bounds.bottom - bounds.top + job->band_height - 1) / job->band_height;
+    job->next_band = 0;
+    job->done_bands = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = job;
+    pthread_cond_broadcast(&pool.job_cond);
+    while (tiled_job_run_band(job)) {
+        continue;
+    }
+    while (job->done_bands != job->num_bands) {
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+    }
+    pool.job = NULL;
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&pool.submit_lock);
+    return true;
+}
+
+bool tiled_render_fill_rects(uint8_t *line_0, int32_t stride,
+                             const SpiceRect *rects, int num_rects, uint32_t color)
+{
+    TiledJob job = {
+        .render_rect = tiled_fill_rect,
+        .line_0 = line_0,
+        .stride = stride,
+        .rects = rects,
+        .num_rects = num_rects,
+        .color = color,
+    };
+
+    return tiled_job_run(&job);
+}
+
+bool tiled_render_copy_rects(uint8_t *line_0, int32_t stride,
+                             const SpiceRect *rects, int num_rects,
+                             const uint8_t *src_line_0, int32_t src_stride, int dx, int dy)
+{
+    TiledJob job = {
+        .render_rect = tiled_copy_rect,
+        .line_0 = line_0,
+        .stride = stride,
+        .rects = rects,
+        .num_rects = num_rects,
+        .src_line_0 = src_line_0,
+        .src_stride = src_stride,
+        .dx = dx,
+        .dy = dy,
+    };
+
+    return tiled_job_run(&job);
+}
@@ -0,0 +1,52 @@
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TILED_RENDER_H_
+#define TILED_RENDER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <common/draw.h>
+
+/* operations covering less pixels are not worth splitting */
+#define TILED_RENDER_MIN_AREA (512 * 512)
+#define TILED_RENDER_MAX_THREADS 4
+
+/*
+ * Fills @rects of a 32 bits per pixel surface with @color, splitting the
+ * work in horizontal bands rendered in parallel by a small thread pool
+ * shared by all the display channels.
+ * @line_0 and @stride describe the surface the same way they do for the
+ * canvas, @stride can be negative. @rects must be inside the surface.
+ * Returns false if the operation was not done (too small, no spare CPU or
+ * the pool is busy with another surface), in which case the caller should
+ * render it itself.
+ */
+bool tiled_render_fill_rects(uint8_t *line_0, int32_t stride,
+                             const SpiceRect *rects, int num_rects, uint32_t color);
+/*
+ * Same as tiled_render_fill_rects() for a copy of 32 bits per pixel data,
+ * the pixel (x, y) of the surface gets the pixel (x + @dx, y + @dy) of the
+ * source described by @src_line_0 and @src_stride.
+ */
+bool tiled_render_copy_rects(uint8_t *line_0, int32_t stride,
+                             const SpiceRect *rects, int num_rects,
+                             const uint8_t *src_line_0, int32_t src_stride, int dx, int dy);
+/* stops the threads of the pool, they are started again if needed */
+void tiled_render_shutdown(void);
+
+#endif /* TILED_RENDER_H_ */
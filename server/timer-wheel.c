@@ -0,0 +1,282 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <common/ring.h>
+
+#include "timer-wheel.h"
+#include "utils.h"
+
+/*
+ * Each level has 64 slots, a slot of level n covers 64^n ticks. A timer
+ * goes to the lowest level whose range holds its expiry and comes down a
+ * level each time the level below wraps around ("cascades"), until it
+ * reaches the level of single ticks and runs. The 4 levels cover about
+ * 4.6 hours, the later timers stay on the last level until they get
+ * close enough.
+ */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+#define TIMER_WHEEL_NEVER UINT64_MAX
+
+struct RedTimerWheel {
+    const SpiceCoreInterfaceInternal *core;
+    SpiceTimer *timer;
+    red_time_t start_time; /* the time of tick 0 */
+    uint64_t current_tick; /* the next tick to run */
+    uint64_t wakeup_tick; /* when the core timer runs, TIMER_WHEEL_NEVER if stopped */
+    unsigned int num_timers; /* the started timers */
+    bool running;
+    Ring slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+struct RedTimer {
+    RingItem link; /* in a slot of the wheel while started */
+    RedTimerWheel *wheel;
+    uint64_t expires; /* the tick the timer runs at */
+    SpiceTimerFunc func;
+    void *opaque;
+};
+
+static Ring *timer_wheel_get_slot(RedTimerWheel *wheel, int level, uint64_t tick)
+{
+    return &wheel->slots[level][(tick >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK];
+}
+
+static void timer_wheel_insert(RedTimerWheel *wheel, RedTimer *timer)
+{
+    uint64_t delta;
+    int level;
+
+    /* an expired timer runs with the next tick */
+    if (timer->expires <= wheel->current_tick) {
+        ring_add_before(&timer->link, timer_wheel_get_slot(wheel, 0, wheel->current_tick));
+        return;
+    }
+
+    delta = timer->expires - wheel->current_tick;
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (delta < (UINT64_C(1) << (TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    ring_add_before(&timer->link, timer_wheel_get_slot(wheel, level, timer->expires));
+}
+
+/* moves the timers of @slot to @dest */
+static void timer_wheel_take_slot(Ring *slot, Ring *dest)
+{
+    RingItem *item;
+
+    while ((item = ring_get_head(slot))) {
+        ring_remove(item);
+        ring_add_before(item, dest);
+    }
+}
+
+static void timer_wheel_cascade(RedTimerWheel *wheel, int level)
+{
+    Ring timers;
+    RingItem *item;
+
+    ring_init(&timers);
+    timer_wheel_take_slot(timer_wheel_get_slot(wheel, level, wheel->current_tick), &timers);
+    while ((item = ring_get_head(&timers))) {
+        ring_remove(item);
+        timer_wheel_insert(wheel, SPICE_CONTAINEROF(item, RedTimer, link));
+    }
+}
+
+static void timer_wheel_run_tick(RedTimerWheel *wheel)
+{
+    uint64_t tick = wheel->current_tick;
+    Ring expired;
+    RingItem *item;
+    int level;
+
+    /* the upper levels come down first, they may fill the lower ones */
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (tick & ((UINT64_C(1) << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) {
+            break;
+        }
+    }
+    while (--level > 0) {
+        timer_wheel_cascade(wheel, level);
+    }
+
+    /* the timers started by the callbacks go to the next ticks */
+    ring_init(&expired);
+    timer_wheel_take_slot(timer_wheel_get_slot(wheel, 0, tick), &expired);
+    wheel->current_tick++;
+
+    while ((item = ring_get_head(&expired))) {
+        RedTimer *timer = SPICE_CONTAINEROF(item, RedTimer, link);
+
+        ring_remove(item);
+        wheel->num_timers--;
+        /* the callback may free or start the timer */
+        timer->func(timer->opaque);
+    }
+}
+
+static uint64_t timer_wheel_get_tick(RedTimerWheel *wheel)
+{
+    return (spice_get_monotonic_time_ns() - wheel->start_time) / NSEC_PER_MILLISEC;
+}
+
+/* the first tick that runs a timer or brings some down a level */
+static uint64_t timer_wheel_get_next_tick(RedTimerWheel *wheel)
+{
+    uint64_t next_tick = TIMER_WHEEL_NEVER;
+    int level, i;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_SLOT_BITS * level;
+        uint64_t base = wheel->current_tick >> shift;
+
+        /* the slot of the current tick was brought down already on the
+         * upper levels, it holds the timers of the next round */
+        for (i = level ? 1 : 0; i <= TIMER_WHEEL_SLOTS - (level ? 0 : 1); i++) {
+            if (!ring_is_empty(&wheel->slots[level][(base + i) & TIMER_WHEEL_SLOT_MASK])) {
+                next_tick = MIN(next_tick, (base + i) << shift);
+                break;
+            }
+        }
+    }
+    return next_tick;
+}
+
+static void timer_wheel_wakeup_at(RedTimerWheel *wheel, uint64_t tick)
+{
+    uint64_t now = timer_wheel_get_tick(wheel);
+
+    wheel->wakeup_tick = tick;
+    wheel->core->timer_start(wheel->core, wheel->timer, tick > now ? tick - now : 0);
+}
+
+static void timer_wheel_run(void *opaque)
+{
+    RedTimerWheel *wheel = opaque;
+    uint64_t now = timer_wheel_get_tick(wheel);
+
+    wheel->wakeup_tick = TIMER_WHEEL_NEVER;
+    wheel->running = true;
+    while (wheel->num_timers && wheel->current_tick <= now) {
+        timer_wheel_run_tick(wheel);
+    }
+    wheel->running = false;
+
+    if (wheel->num_timers) {
+        timer_wheel_wakeup_at(wheel, timer_wheel_get_next_tick(wheel));
+    }
+}
+
+RedTimerWheel *red_timer_wheel_new(const SpiceCoreInterfaceInternal *core)
+{
+    RedTimerWheel *wheel = spice_new0(RedTimerWheel, 1);
+    int level, i;
+
+    wheel->core = core;
+    wheel->timer = core->timer_add(core, timer_wheel_run, wheel);
+    spice_assert(wheel->timer != NULL);
+    wheel->start_time = spice_get_monotonic_time_ns();
+    wheel->wakeup_tick = TIMER_WHEEL_NEVER;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            ring_init(&wheel->slots[level][i]);
+        }
+    }
+
+    return wheel;
+}
+
+void red_timer_wheel_free(RedTimerWheel *wheel)
+{
+    if (!wheel) {
+        return;
+    }
+
+    wheel->core->timer_remove(wheel->core, wheel->timer);
+    free(wheel);
+}
+
+RedTimer *red_timer_new(RedTimerWheel *wheel, SpiceTimerFunc func, void *opaque)
+{
+    RedTimer *timer = spice_new0(RedTimer, 1);
+
+    ring_item_init(&timer->link);
+    timer->wheel = wheel;
+    timer->func = func;
+    timer->opaque = opaque;
+
+    return timer;
+}
+
+void red_timer_start(RedTimer *timer, uint32_t ms)
+{
+    RedTimerWheel *wheel = timer->wheel;
+    red_time_t expires;
+
+    red_timer_cancel(timer);
+
+    expires = spice_get_monotonic_time_ns() - wheel->start_time + ms * NSEC_PER_MILLISEC;
+    /* rounded up, at least @ms elapse */
+    timer->expires = (expires + NSEC_PER_MILLISEC - 1) / NSEC_PER_MILLISEC;
+    if (!wheel->num_timers && !wheel->running) {
+        /* no need to go through the ticks the wheel was empty */
+        wheel->current_tick = MAX(wheel->current_tick, timer_wheel_get_tick(wheel));
+    }
+    timer_wheel_insert(wheel, timer);
+    wheel->num_timers++;
+
+    /* the wheel wakes up for it, possibly before it got down to the
+     * ticks level, it gets there as the wheel catches up */
+    if (!wheel->running && timer->expires < wheel->wakeup_tick) {
+        timer_wheel_wakeup_at(wheel, timer->expires);
+    }
+}
+
+void red_timer_cancel(RedTimer *timer)
+{
+    RedTimerWheel *wheel = timer->wheel;
+
+    if (!ring_item_is_linked(&timer->link)) {
+        return;
+    }
+
+    ring_remove(&timer->link);
+    if (--wheel->num_timers == 0 && !wheel->running) {
+        wheel->core->timer_cancel(wheel->core, wheel->timer);
+        wheel->wakeup_tick = TIMER_WHEEL_NEVER;
+    }
+}
+
+void red_timer_free(RedTimer *timer)
+{
+    if (!timer) {
+        return;
+    }
+
+    red_timer_cancel(timer);
+    free(timer);
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2017 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+#include "red-common.h"
+
+/*
+ * A hierarchical timer wheel with a millisecond tick, for the many timers
+ * each client has (pings, connectivity checks, char device retries).
+ * Starting and cancelling a timer is O(1) and all of them share a single
+ * timer of the core, which only runs when the earliest of them expires.
+ * The timers run in the thread of the core.
+ */
+
+typedef struct RedTimer RedTimer;
+
+RedTimerWheel *red_timer_wheel_new(const SpiceCoreInterfaceInternal *core);
+/* the timers of the wheel must have been freed */
+void red_timer_wheel_free(RedTimerWheel *wheel);
+
+RedTimer *red_timer_new(RedTimerWheel *wheel, SpiceTimerFunc func, void *opaque);
+/* (re)starts @timer, it runs once after @ms milliseconds */
+void red_timer_start(RedTimer *timer, uint32_t ms);
+void red_timer_cancel(RedTimer *timer);
+void red_timer_free(RedTimer *timer);
+
+#endif /* TIMER_WHEEL_H_ */